@@ -0,0 +1,157 @@
+#include <glm/glm.hpp>
+
+#include <fstream>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+#include "../src/ObjLoader.h"
+
+/*
+	Compares the memory mapped, multithreaded OBJ loader with the stream based loader it replaced
+	Usage: obj_bench [mesh.obj] [runs]
+	Without a mesh a synthetic one using the `v/vt/vn` face syntax is generated
+*/
+
+constexpr int SYNTHETIC_GRID_SIZE = 700; // 490k vertices, 978k triangles
+
+bool loadObjLegacy(const char* path, ObjData& obj) {
+	//The previous loader from Bodies.h, kept as the baseline (it only understands `f a b c`, so `/` suffixes are cut off by std::stoi)
+
+	obj.vertices.clear();
+	obj.indices.clear();
+
+	std::ifstream meshFile(path);
+	if (!meshFile.is_open()) {
+		std::cerr << "Error: Could not open mesh file\n";
+		return false;
+	}
+
+	std::vector<float> vertices;
+
+	std::string line;
+	while (std::getline(meshFile, line)) {
+
+		std::string type = line.substr(0, line.find(' '));
+
+		std::istringstream iss(line);
+		std::string arg1, arg2, arg3;
+		iss >> type >> arg1 >> arg2 >> arg3;
+
+		if (type == "v") {
+			vertices.push_back(std::stof(arg1));
+			vertices.push_back(std::stof(arg2));
+			vertices.push_back(std::stof(arg3));
+		}
+		else if (type == "f") {
+			obj.indices.push_back(std::stoi(arg1) - 1);
+			obj.indices.push_back(std::stoi(arg2) - 1);
+			obj.indices.push_back(std::stoi(arg3) - 1);
+		}
+	}
+
+	for (size_t i = 0; i + 2 < vertices.size(); i += 3) {
+		obj.vertices.push_back(glm::vec3(vertices[i], vertices[i + 1], vertices[i + 2]));
+	}
+
+	return true;
+}
+
+bool writeSyntheticObj(const char* path) {
+	//A displaced grid, written as triangles so both loaders read the same geometry
+
+	FILE* file = std::fopen(path, "w");
+	if (!file) {
+		std::cerr << "Error: Could not create " << path << "\n";
+		return false;
+	}
+
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> height(-0.05f, 0.05f);
+
+	const int n = SYNTHETIC_GRID_SIZE;
+	std::fprintf(file, "# synthetic %dx%d grid\no grid\n", n, n);
+
+	for (int y = 0; y < n; ++y) {
+		for (int x = 0; x < n; ++x) {
+			std::fprintf(file, "v %.6f %.6f %.6f\n", x / float(n - 1) * 2.0f - 1.0f, height(rng), y / float(n - 1) * 2.0f - 1.0f);
+		}
+	}
+	for (int y = 0; y < n; ++y) {
+		for (int x = 0; x < n; ++x) {
+			std::fprintf(file, "vt %.6f %.6f\n", x / float(n - 1), y / float(n - 1));
+		}
+	}
+	std::fprintf(file, "vn 0.000000 1.000000 0.000000\ns off\n");
+
+	for (int y = 0; y + 1 < n; ++y) {
+		for (int x = 0; x + 1 < n; ++x) {
+			const int a = y * n + x + 1, b = a + 1, c = a + n, d = c + 1;
+			std::fprintf(file, "f %d/%d/1 %d/%d/1 %d/%d/1\n", a, a, c, c, b, b);
+			std::fprintf(file, "f %d/%d/1 %d/%d/1 %d/%d/1\n", b, b, c, c, d, d);
+		}
+	}
+
+	std::fclose(file);
+	return true;
+}
+
+template<typename Loader>
+double benchmark(const char* name, Loader loader, const char* path, const size_t fileSize, const int runs, ObjData& obj) {
+	//Returns the best throughput in MB/s
+
+	double bestSeconds = 1e30;
+	for (int i = 0; i < runs; ++i) {
+		auto start = std::chrono::high_resolution_clock::now();
+		if (!loader(path, obj)) return 0.0;
+		auto end = std::chrono::high_resolution_clock::now();
+		bestSeconds = std::min(bestSeconds, std::chrono::duration<double>(end - start).count());
+	}
+
+	const double throughput = fileSize / (1024.0 * 1024.0) / bestSeconds;
+	printf("%-8s %8.1f ms  %8.1f MB/s  (%zu vertices, %zu triangles)\n", name, bestSeconds * 1000.0, throughput, obj.vertices.size(), obj.indices.size() / 3);
+	return throughput;
+}
+
+int main(int argc, char* argv[]) {
+
+	std::string path = argc > 1 ? argv[1] : "obj_bench_synthetic.obj";
+	const int runs = argc > 2 ? std::max(1, std::atoi(argv[2])) : 3;
+
+	if (argc <= 1 && !writeSyntheticObj(path.c_str())) {
+		return 1;
+	}
+
+	MappedFile file;
+	if (!mapFile(path.c_str(), file)) {
+		std::cerr << "Error: Could not open " << path << "\n";
+		return 1;
+	}
+	const size_t fileSize = file.size;
+	unmapFile(file);
+
+	printf("%s: %.1f MB, best of %d runs, %u threads\n", path.c_str(), fileSize / (1024.0 * 1024.0), runs, std::max(1u, std::thread::hardware_concurrency()));
+
+	ObjData legacy, mapped;
+	const double legacyThroughput = benchmark("legacy", loadObjLegacy, path.c_str(), fileSize, runs, legacy);
+	const double mappedThroughput = benchmark("mapped", loadObj, path.c_str(), fileSize, runs, mapped);
+
+	if (legacyThroughput > 0.0) {
+		printf("speedup  %.1fx\n", mappedThroughput / legacyThroughput);
+	}
+
+	//Both loaders have to agree on plain triangle meshes
+	if (legacy.indices != mapped.indices || legacy.vertices != mapped.vertices) {
+		std::cerr << "Error: The loaders produced different meshes\n";
+		return 1;
+	}
+
+	if (argc <= 1) {
+		std::remove(path.c_str());
+	}
+
+	return 0;
+}
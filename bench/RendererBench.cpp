@@ -0,0 +1,298 @@
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include <glm/gtx/rotate_vector.hpp>
+#include <glm/gtx/scalar_multiplication.hpp>
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+
+#ifdef _WIN32
+#include "../src/MappedFile.h" // Pulls in windows.h with the right defines
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "../src/Structures.h"
+#include "../src/BVH.h"
+#include "../src/Selection.h"
+#include "../src/Tracer.h"
+#include "../src/ObjLoader.h"
+#include "../src/Bodies.h"
+#include "../tests/TestScenes.h"
+
+/*
+	Deterministic benchmark of the CPU backend:
+		- Renders a fixed set of scenes with fixed resolutions, samples and bounces, the seeds are fixed as well,
+		  so the images (and `imageMean`) are the same on every run and every thread count
+		- Reports samples per pixel (at most `samples` with adaptive sampling), wall time (with a noise threshold the time until the image converged), rays per second (primary and secondary), time to the first finished tile, the time denoising took and the peak RSS as JSON,
+		  as well as how long every thread was busy and idle
+		- The peak RSS of a scene is measured on its own on Linux and `null` elsewhere, the peak of the whole run is reported once at the end
+		- Run it from the repository root, the scenes load the meshes from `meshes/`
+		- `RENDERER_ISA` forces the instruction set of the CPU kernels, see CpuFeatures.h
+	Usage: renderer_bench [output.json], writes to renderer_bench.json by default
+*/
+
+struct BenchScene {
+	const char* name;
+	int width;
+	int height;
+	int numSamples;
+	int maxBounces;
+	bool packets; // Trace the primary rays in packets
+	std::function<bool(ObjectBuffer&)> build;
+	float noiseThreshold = 0.0f; // Adaptive sampling, `numSamples` per pixel is the budget
+	int samplesPerBatch = 0; // All samples in one batch if 0, adaptive sampling decides between batches
+	bool russianRoulette = true; // Otherwise every path takes all bounces
+	bool nextEventEstimation = true; // Otherwise lights are only found by bouncing into them
+	int sampler = SAMPLER_SOBOL; // Like exports
+	bool denoise = false; // Filter the image guided by its first hit features, like `--denoise` exports
+
+};
+
+size_t peakResidentKilobytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.PeakWorkingSetSize / 1024;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+bool resetPeakResident() {
+	//Sets the high-water mark read by `scenePeakResidentKilobytes` back to the current resident size, Linux only
+
+#ifdef __linux__
+	std::ofstream clearRefs("/proc/self/clear_refs");
+	clearRefs << "5";
+	clearRefs.close();
+	return !clearRefs.fail();
+#else
+	return false;
+#endif
+}
+
+size_t scenePeakResidentKilobytes() {
+	//The high-water mark since `resetPeakResident`, unlike the one of `peakResidentKilobytes` it can go down again
+
+#ifdef __linux__
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line)) {
+		if (line.compare(0, 6, "VmHWM:") == 0) return std::strtoull(line.c_str() + 6, nullptr, 10);
+	}
+#endif
+	return 0;
+}
+
+std::string formatNumber(const char* format, const double value) {
+	//A single number, always short enough for the buffer
+	char text[64];
+	snprintf(text, sizeof(text), format, value);
+	return text;
+}
+
+void initBenchScene(ObjectBuffer& objectBuffer, const BenchScene& scene) {
+	initTestScene(objectBuffer, scene.width, scene.height, scene.numSamples, scene.maxBounces);
+	objectBuffer.noiseThreshold = scene.noiseThreshold;
+	objectBuffer.sampler = scene.sampler;
+}
+
+bool buildDefaultScene(ObjectBuffer& objectBuffer) {
+	//The scene `main` starts with
+
+	Mesh meshes[2];
+
+	createSphere(objectBuffer, glm::vec3(15.0f, 15.0f, .0f), 20.0f, Material{ glm::vec3(1.0f, 0.0f, 0.0f), 0.0f, glm::vec3(1.0f) });
+	createSphere(objectBuffer, glm::vec3(-1.5f, .2f, -4.0f), 1.0f, Material{ glm::vec3(1.0f, 1.0f, 0.0f), 0.2f, glm::vec3(0.0f) });
+
+	if (!loadMesh(objectBuffer, "meshes/ico_sphere.obj", meshes[0])) return false;
+	setMeshMaterial(objectBuffer, meshes[0], Material{ glm::vec3(1.0f, 0.0f, 1.0f), .3f, glm::vec3(0.0f) });
+	translateMesh(objectBuffer, meshes[0], glm::vec3(0.0f, 0.0f, -3.0f));
+
+	if (!loadMesh(objectBuffer, "meshes/plane.obj", meshes[1])) return false;
+	setMeshMaterial(objectBuffer, meshes[1], Material{ glm::vec3(1.0f, 1.0f, 1.0f), 0.f, glm::vec3(0.0f) });
+	translateMesh(objectBuffer, meshes[1], glm::vec3(0.0f, -.5f, -3.0f));
+
+	return true;
+}
+
+bool buildInstancedScene(ObjectBuffer& objectBuffer) {
+	//A grid of instances of two meshes on a plane, lit by a big emissive sphere, exercises both levels of the BVH
+
+	Mesh ground, icoSphere, pillar, copy;
+
+	createSphere(objectBuffer, glm::vec3(8.0f, 12.0f, -16.0f), 8.0f, Material{ glm::vec3(1.0f), 0.0f, glm::vec3(1.5f) });
+
+	if (!loadMesh(objectBuffer, "meshes/plane.obj", ground)) return false;
+	setMeshMaterial(objectBuffer, ground, Material{ glm::vec3(0.8f), 0.f, glm::vec3(0.0f) });
+	translateMesh(objectBuffer, ground, glm::vec3(0.0f, -1.0f, -6.0f));
+
+	if (!loadMesh(objectBuffer, "meshes/ico_sphere.obj", icoSphere)) return false;
+	if (!loadMesh(objectBuffer, "meshes/whatever.obj", pillar)) return false;
+
+	for (int z = 0; z < 8; ++z) {
+		for (int x = 0; x < 8; ++x) {
+			const Mesh& source = (x + z) % 2 ? pillar : icoSphere;
+			if (!instanceMesh(objectBuffer, source, copy)) return false;
+
+			setMeshMaterial(objectBuffer, copy, Material{ glm::vec3(0.2f + 0.1f * x, 0.9f - 0.1f * z, 0.5f), (x % 3) * 0.4f, glm::vec3(0.0f) });
+			scaleMesh(objectBuffer, copy, glm::vec3(0.25f));
+			rotateMesh(objectBuffer, copy, 0.3f * (x + 8 * z), glm::vec3(0.0f, 1.0f, 0.0f));
+			translateMesh(objectBuffer, copy, glm::vec3(-3.5f + x, -0.75f, -3.0f - z));
+		}
+	}
+
+	//The meshes the instances were copied from stay out of sight
+	translateMesh(objectBuffer, icoSphere, glm::vec3(0.0f, -100.0f, 0.0f));
+	translateMesh(objectBuffer, pillar, glm::vec3(0.0f, -100.0f, 0.0f));
+
+	return true;
+}
+
+bool buildRoomScene(ObjectBuffer& objectBuffer) {
+	RoomOptions options;
+	options.furniture = true;
+	return buildRoom(objectBuffer, options);
+}
+
+bool buildSmallLightRoomScene(ObjectBuffer& objectBuffer) {
+	//Hard to find by bouncing around, but just as easy to sample directly
+	RoomOptions options;
+	options.lightRadius = 0.25f;
+	options.furniture = true;
+	return buildRoom(objectBuffer, options);
+}
+
+int main(int argc, char* argv[]) {
+
+	const BenchScene scenes[] = {
+		{ "default", 320, 240, 64, 4, true, buildDefaultScene },
+		{ "default_720p", 1280, 720, 4, 2, true, buildDefaultScene },
+		{ "instances", 320, 240, 32, 4, true, buildInstancedScene },
+		//Only primary rays, with and without packets
+		{ "primary_4k", 3840, 2160, 1, 1, false, buildInstancedScene },
+		{ "primary_4k_packets", 3840, 2160, 1, 1, true, buildInstancedScene },
+		//The same budget of samples taken in full and adaptively, the samplers that stratify better stop sooner
+		{ "instances_256", 320, 240, 256, 4, true, buildInstancedScene, 0.0f, 16 },
+		{ "instances_adaptive", 320, 240, 256, 4, true, buildInstancedScene, 0.1f, 16 },
+		{ "instances_adaptive_random", 320, 240, 256, 4, true, buildInstancedScene, 0.1f, 16, true, true, SAMPLER_RANDOM },
+		{ "instances_adaptive_blue_noise", 320, 240, 256, 4, true, buildInstancedScene, 0.1f, 16, true, true, SAMPLER_BLUE_NOISE },
+		//Time until the image converged with deep paths, with and without Russian roulette
+		{ "room_fixed_depth", 160, 120, 256, 16, true, buildRoomScene, 0.1f, 16, false },
+		{ "room_russian_roulette", 160, 120, 256, 16, true, buildRoomScene, 0.1f, 16, true },
+		//Time until the image converged with a small light, found by bouncing into it and sampled directly
+		{ "small_light_bounced", 160, 120, 1024, 8, true, buildSmallLightRoomScene, 0.1f, 16, true, false },
+		{ "small_light_next_event", 160, 120, 1024, 8, true, buildSmallLightRoomScene, 0.1f, 16, true, true },
+		//A denoised preview, against the samples it replaces
+		{ "room_preview", 160, 120, 1000, 16, true, buildRoomScene },
+		{ "room_preview_denoised", 160, 120, DENOISE_PREVIEW_SAMPLES, 16, true, buildRoomScene, 0.0f, 0, true, true, SAMPLER_SOBOL, true },
+	};
+
+	const char* samplerNames[] = { "random", "sobol", "blue-noise" }; // By SAMPLER_ constant
+
+	const unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	std::ostringstream json;
+	json << std::boolalpha << "{\n  \"threads\": " << numThreads << ",\n  \"isa\": \"" << cpuISAName(cpuISA) << "\",\n  \"scenes\": [";
+
+	bool first = true;
+	for (const BenchScene& scene : scenes) {
+
+		std::cerr << "Rendering " << scene.name << "...\n";
+
+		//Otherwise every scene after the largest one would report its peak
+		const bool measurePeak = resetPeakResident();
+
+		ObjectBuffer objectBuffer;
+		BVH bvh;
+
+		initBenchScene(objectBuffer, scene);
+		if (!scene.build(objectBuffer)) {
+			std::cerr << "Error: Could not build scene " << scene.name << "\n";
+			return 1;
+		}
+
+		const auto buildStart = std::chrono::steady_clock::now();
+		buildBVH(bvh, objectBuffer);
+		const double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+
+		std::vector<glm::vec3> image;
+		RenderStats stats;
+		usePrimaryRayPackets = scene.packets;
+		useRussianRoulette = scene.russianRoulette;
+		useNextEventEstimation = scene.nextEventEstimation;
+		renderCPU(objectBuffer, bvh, image, scene.samplesPerBatch, nullptr, &stats);
+
+		//Features and filter both count, they are what the denoised image costs on top of its samples
+		double denoiseSeconds = 0.0;
+		if (scene.denoise) {
+			const auto denoiseStart = std::chrono::steady_clock::now();
+			Features features;
+			objectBuffer.numSamples = std::min(DENOISE_FEATURE_SAMPLES, scene.numSamples);
+			renderFeatures(objectBuffer, bvh, features);
+			objectBuffer.numSamples = scene.numSamples;
+			denoise(image, features, scene.width, scene.height);
+			denoiseSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - denoiseStart).count();
+		}
+
+		//Cheap fingerprint of the image, it only changes if the rendered paths change
+		double imageMean = 0.0;
+		for (const glm::vec3& pixel : image) {
+			imageMean += pixel.r + pixel.g + pixel.b;
+		}
+		imageMean /= 3.0 * image.size();
+
+		//Streamed field by field, a fixed buffer would cut long records short and leave invalid JSON
+		json << (first ? "" : ",") << "\n    {\"name\": \"" << scene.name << "\", \"packets\": " << scene.packets
+			<< ", \"russianRoulette\": " << scene.russianRoulette << ", \"nextEventEstimation\": " << scene.nextEventEstimation
+			<< ", \"sampler\": \"" << samplerNames[scene.sampler] << "\", \"denoised\": " << scene.denoise
+			<< ", \"width\": " << scene.width << ", \"height\": " << scene.height << ", \"samples\": " << scene.numSamples
+			<< ", \"noiseThreshold\": " << formatNumber("%g", scene.noiseThreshold) << ", \"samplesPerPixel\": " << formatNumber("%.3f", double(stats.samples) / image.size())
+			<< ", \"bounces\": " << scene.maxBounces << ", \"triangles\": " << objectBuffer.numTriangles << ", \"instances\": " << objectBuffer.numInstances
+			<< ", \"bvhBuildSeconds\": " << formatNumber("%.6f", buildSeconds) << ", \"wallSeconds\": " << formatNumber("%.6f", stats.seconds)
+			<< ", \"denoiseSeconds\": " << formatNumber("%.6f", denoiseSeconds) << ", \"firstPixelSeconds\": " << formatNumber("%.6f", stats.firstTileSeconds)
+			<< ", \"rays\": " << stats.rays << ", \"raysPerSecond\": " << formatNumber("%.1f", stats.rays / stats.seconds)
+			<< ", \"raysPerSample\": " << formatNumber("%.3f", double(stats.rays) / stats.samples)
+			<< ", \"imageMean\": " << formatNumber("%.9f", imageMean) << ", \"peakRssKilobytes\": " << (measurePeak ? std::to_string(scenePeakResidentKilobytes()) : "null") << ", \"threadStats\": [";
+
+		//Busy and idle time of every thread, idle threads mean the tiles were badly balanced
+		for (size_t i = 0; i < stats.threads.size(); ++i) {
+			const ThreadStats& thread = stats.threads[i];
+			json << (i == 0 ? "" : ",") << "\n      {\"busySeconds\": " << formatNumber("%.6f", thread.busySeconds) << ", \"idleSeconds\": " << formatNumber("%.6f", thread.idleSeconds)
+				<< ", \"tiles\": " << thread.tiles << ", \"stolenTiles\": " << thread.stolenTiles << ", \"splitTiles\": " << thread.splitTiles << "}";
+		}
+		json << "\n    ]}";
+		first = false;
+	}
+
+	json << "\n  ],\n  \"peakRssKilobytes\": " << peakResidentKilobytes() << "\n}\n";
+
+	//Not written to stdout, loading the meshes prints there
+	const char* outputPath = argc > 1 ? argv[1] : "renderer_bench.json";
+
+	std::ofstream file(outputPath);
+	if (!file.is_open()) {
+		std::cerr << "Error: Could not write " << outputPath << "\n";
+		return 1;
+	}
+	file << json.str();
+
+	std::cerr << "Results written to " << outputPath << "\n";
+
+	return 0;
+}
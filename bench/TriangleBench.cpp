@@ -0,0 +1,146 @@
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "../src/Structures.h"
+#include "../src/BVH.h"
+#include "../src/Selection.h"
+
+/*
+	Compares the ray versus triangle kernels of TriangleBlocks.h with `rayTriangle` from Selection.h,
+	every ray is tested against every triangle, like picking does
+	Usage: triangle_bench [triangles] [rays]
+	Every kernel up to the instruction set picked at startup is measured, `RENDERER_ISA` lowers it
+*/
+
+struct BenchResult {
+	double seconds = 0.0;
+	std::vector<int> closest; // Closest triangle for every ray, -1 for misses
+};
+
+template<typename Kernel>
+BenchResult benchmark(const char* name, Kernel kernel, const std::vector<Ray>& rays, const int numTriangles, const int runs) {
+
+	BenchResult result;
+	result.seconds = 1e30;
+	result.closest.resize(rays.size());
+
+	for (int run = 0; run < runs; ++run) {
+		auto start = std::chrono::high_resolution_clock::now();
+		for (size_t i = 0; i < rays.size(); ++i) {
+			result.closest[i] = kernel(rays[i]);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		result.seconds = std::min(result.seconds, std::chrono::duration<double>(end - start).count());
+	}
+
+	const double tests = double(rays.size()) * numTriangles;
+	printf("%-14s %8.2f ms  %8.1f M tests/s\n", name, result.seconds * 1000.0, tests / result.seconds * 1e-6);
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+
+	const int numTriangles = argc > 1 ? std::max(1, std::atoi(argv[1])) : 4096;
+	const int numRays = argc > 2 ? std::max(1, std::atoi(argv[2])) : 4096;
+	const int runs = 5;
+
+	//Small random triangles in a unit cube, seen from rays that start outside of it
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+	std::vector<glm::vec3> positions;
+	for (int i = 0; i < numTriangles; ++i) {
+		const glm::vec3 center(unit(rng), unit(rng), unit(rng));
+		for (int j = 0; j < 3; ++j) {
+			positions.push_back(center + 0.1f * glm::vec3(unit(rng), unit(rng), unit(rng)));
+		}
+	}
+
+	std::vector<Ray> rays(numRays);
+	for (Ray& ray : rays) {
+		ray.origin = glm::vec3(unit(rng), unit(rng), 3.0f);
+		ray.direction = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) * 0.5f - ray.origin);
+	}
+
+	std::vector<TriangleBlock> blocks((numTriangles + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE);
+	for (TriangleBlock& block : blocks) {
+		clearTriangleBlock(block);
+	}
+	for (int i = 0; i < numTriangles; ++i) {
+		setBlockTriangle(blocks[i / TRIANGLE_BLOCK_SIZE], i % TRIANGLE_BLOCK_SIZE, positions[3 * i], positions[3 * i + 1], positions[3 * i + 2], i);
+	}
+	const int numBlocks = static_cast<int>(blocks.size());
+
+	printf("%d triangles, %d rays, best of %d runs, instruction set: %s\n", numTriangles, numRays, runs, cpuISAName(cpuISA));
+
+	const BenchResult single = benchmark("rayTriangle", [&](const Ray& ray) {
+		float closestDistance = 1e30f;
+		int closest = -1;
+		for (int i = 0; i < numTriangles; ++i) {
+			const float distance = rayTriangle(ray, positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]);
+			if (distance > 0 && distance < closestDistance) {
+				closestDistance = distance;
+				closest = i;
+			}
+		}
+		return closest;
+	}, rays, numTriangles, runs);
+
+	typedef bool (*Kernel)(const glm::vec3&, const glm::vec3&, const TriangleBlock*, const int, float&, int&);
+
+	struct NamedKernel {
+		CpuISA isa;
+		const char* name;
+		Kernel kernel;
+	};
+
+	const NamedKernel kernels[] = {
+		{ CpuISA::Scalar, "blocks scalar", rayTriangleBlocksScalar },
+#ifdef RENDERER_X86
+		{ CpuISA::SSE42, "blocks sse4.2", rayTriangleBlocksSSE42 },
+		{ CpuISA::AVX2, "blocks avx2", rayTriangleBlocksAVX2 },
+		{ CpuISA::AVX512, "blocks avx512", rayTriangleBlocksAVX512 },
+#endif
+	};
+
+	BenchResult scalar, fastest;
+
+	for (const NamedKernel& kernel : kernels) {
+		if (kernel.isa > cpuISA) continue;
+
+		const BenchResult result = benchmark(kernel.name, [&](const Ray& ray) {
+			float distance = -1.0f;
+			int closest = -1;
+			kernel.kernel(ray.origin, ray.direction, blocks.data(), numBlocks, distance, closest);
+			return closest;
+		}, rays, numTriangles, runs);
+
+		//The block kernels have to agree exactly
+		if (kernel.isa == CpuISA::Scalar) {
+			scalar = result;
+		}
+		else if (result.closest != scalar.closest) {
+			std::cerr << "Error: The scalar and the " << cpuISAName(kernel.isa) << " kernel found different triangles\n";
+			return 1;
+		}
+
+		fastest = result;
+	}
+
+	printf("speedup        %.1fx\n", single.seconds / fastest.seconds);
+
+	//`rayTriangle` uses a larger epsilon and may reject a few grazing hits
+	int differentHits = 0;
+	for (int i = 0; i < numRays; ++i) {
+		if (single.closest[i] != fastest.closest[i]) differentHits++;
+	}
+	printf("%d of %d rays hit a different triangle than with rayTriangle\n", differentHits, numRays);
+
+	return 0;
+}
@@ -1,6 +1,7 @@
 #version 330 core
 
-out vec4 fragColor;
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out vec4 fragNormalDepth; // Only written by the feature pass, fragColor holds the albedo then
 
 struct Material {
 	vec3 color;
@@ -17,26 +18,12 @@ struct Sphere {
 	Material material;
 };
 
+// Assembled from the vertex and triangle buffers, edges and normals are derived from the vertices
 struct Triangle {
 	vec3 v0;
-	float pad0;
-	
 	vec3 v1;
-	float pad1;
-	
 	vec3 v2;
-	float pad2;
-
-	vec3 edge1;
-	float pad3;
-
-	vec3 edge2;
-	float pad4;
-
-	vec3 normal;
-	float pad5;
-
-	Material material;
+	int material;
 };
 
 struct Camera {
@@ -64,12 +51,60 @@ layout(std140) uniform ObjectBuffer {
 	float jitterStrenght;
 	int noGUI;
 
-	Camera camera;
+	int frameIndex; // Number of frames (or sample batches) averaged so far
+	int accumulatedSamples; // Number of samples per pixel in the running average
+	ivec2 tileOffset; // Position of the rendered tile in the image
+
+	int numInstances;
+	float noiseThreshold; // Exports stop sampling a pixel once its relative error is below this
+	int numLights;
+	int samplerType; // Where the random numbers come from, one of the SAMPLER_ defines
 
-	Sphere spheres[2];
-	Triangle triangles[30];
+	int featurePass; // 1 to render the first hit features for the denoiser instead of the image
+	int sampleOffset; // Added to every sample index and to the seed of the random stream, a render can go on where another one stopped
+	int countPass; // 1 to draw only the pixels that didn't converge, an occlusion query counts them
+	int pad6;
+
+	Camera camera;
 };
 
+// Running average of the last frames (or of the tile being exported), only read if accumulatedSamples > 0
+uniform sampler2D accumulation;
+
+// The geometry lives in buffer textures sized at runtime, laid out exactly like the structs in src/Structures.h
+// A sphere is 3 RGBA32F texels, a vertex 1 RGBA32F texel, a material 2 RGBA32F texels
+// A triangle is 1 RGBA32I texel holding the indices of its three vertices and of its material
+uniform samplerBuffer sceneSpheres;
+uniform samplerBuffer sceneVertices;
+uniform isamplerBuffer sceneTriangles;
+uniform samplerBuffer sceneMaterials;
+
+// Meshes are instances of geometries, every instance is 4 RGBA32F texels:
+// the first three rows of its world to object matrix and (rootNode, material, -, -) as int bits
+uniform samplerBuffer sceneInstances;
+
+// Two level bounding volume hierarchy, built and uploaded by the CPU (see src/BVH.h)
+// Every node is two texels: (boundsMin, leftFirst) and (boundsMax, count)
+// The top level is built over the instances, its leaves directly reference ranges of sceneInstances
+// The bottom level holds a tree per geometry in object space, its leaves reference triangles through bvhIndices
+uniform samplerBuffer instanceNodes;
+uniform samplerBuffer bvhNodes;
+uniform isamplerBuffer bvhIndices;
+
+// Emissive spheres and triangles for next event estimation, every light is 4 RGBA32F texels (see src/Lights.h):
+// (center, radius) of a sphere or (v0, 0), (v1, area), (v2, -) of a triangle in world space, followed by (emission, -)
+uniform samplerBuffer sceneLights;
+
+// BLUE_NOISE_SIZE x BLUE_NOISE_SIZE texels of blue noise, rows one after another (see src/Sampler.h)
+uniform samplerBuffer blueNoise;
+
+#define BVH_MAX_DEPTH 32
+
+// Bounces every path takes before Russian roulette may terminate it
+#define RUSSIAN_ROULETTE_DEPTH 3
+
+#define PI 3.14159265359
+
 struct Ray {
 	vec3 origin;
 	vec3 direction;
@@ -80,8 +115,26 @@ struct Intersection {
 	float dst;
 	vec3 normal;
 	vec3 position;
+	int sphere; // Index of the hit sphere, -1 for triangles
+	float area; // World space area of the hit triangle, only set if it is emissive
 };
 
+Material getMaterial(samplerBuffer buffer, int texel) {
+	vec4 colorSmoothness = texelFetch(buffer, texel);
+	vec4 emission = texelFetch(buffer, texel + 1);
+	return Material(colorSmoothness.rgb, colorSmoothness.a, emission.rgb, emission.a);
+}
+
+Sphere getSphere(int index) {
+	vec4 centerRadius = texelFetch(sceneSpheres, 3 * index);
+	return Sphere(centerRadius.xyz, centerRadius.w, getMaterial(sceneSpheres, 3 * index + 1));
+}
+
+Triangle getTriangle(int index) {
+	ivec4 indices = texelFetch(sceneTriangles, index);
+	return Triangle(texelFetch(sceneVertices, indices.x).xyz, texelFetch(sceneVertices, indices.y).xyz, texelFetch(sceneVertices, indices.z).xyz, indices.w);
+}
+
 void raySphere(Ray ray, Sphere sphere, inout float distance, inout bool hit) {
 
 	vec3 oc = ray.origin - sphere.center;
@@ -102,8 +155,8 @@ void raySphere(Ray ray, Sphere sphere, inout float distance, inout bool hit) {
 }
 
 void rayTriangle(Ray ray, Triangle triangle, inout float distance, inout bool hit) {
-	vec3 edge1 = triangle.edge1;
-	vec3 edge2 = triangle.edge2;
+	vec3 edge1 = triangle.v1 - triangle.v0;
+	vec3 edge2 = triangle.v2 - triangle.v0;
 
 	vec3 p = cross(ray.direction, edge2);
 	float det = dot(edge1, p);
@@ -133,18 +186,101 @@ void rayTriangle(Ray ray, Triangle triangle, inout float distance, inout bool hi
 	}
 }
 
+// Returns the distance to the box, or 1e30 if it is missed or further away than closest
+float rayAABB(vec3 origin, vec3 invDirection, vec3 boundsMin, vec3 boundsMax, float closest) {
+
+	vec3 t0 = (boundsMin - origin) * invDirection;
+	vec3 t1 = (boundsMax - origin) * invDirection;
+
+	vec3 tMin = min(t0, t1);
+	vec3 tMax = max(t0, t1);
+
+	float tNear = max(max(tMin.x, tMin.y), max(tMin.z, 0.0));
+	float tFar = min(min(tMax.x, tMax.y), min(tMax.z, closest));
+
+	return tNear <= tFar ? tNear : 1e30;
+}
+
+// Walks the bottom level tree of a geometry with a ray in its object space, returns true if a triangle closer than distance was found
+bool rayGeometry(Ray ray, int rootNode, inout float distance, inout int triangleIndex) {
+
+	vec3 invDirection = 1.0 / ray.direction;
+
+	int stack[BVH_MAX_DEPTH];
+	int stackSize = 0;
+	int nodeIndex = rootNode;
+
+	bool hit = false;
+	bool closerHit = false;
+
+	if (rayAABB(ray.origin, invDirection, texelFetch(bvhNodes, 2 * rootNode).xyz, texelFetch(bvhNodes, 2 * rootNode + 1).xyz, distance > 0 ? distance : 1e30) == 1e30) {
+		nodeIndex = -1;
+	}
+
+	while (nodeIndex >= 0) {
+
+		vec4 nodeMin = texelFetch(bvhNodes, 2 * nodeIndex);
+		vec4 nodeMax = texelFetch(bvhNodes, 2 * nodeIndex + 1);
+
+		int leftFirst = floatBitsToInt(nodeMin.w);
+		int count = floatBitsToInt(nodeMax.w);
+
+		if (count > 0) {
+
+			for (int i = 0; i < count; ++i) {
+
+				int index = texelFetch(bvhIndices, leftFirst + i).x;
+
+				rayTriangle(ray, getTriangle(index), distance, hit);
+
+				if (hit) {
+					triangleIndex = index;
+					closerHit = true;
+					hit = false;
+				}
+			}
+
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+			continue;
+		}
+
+		// Visit the closer child first and remember the other one for later
+		float closest = distance > 0 ? distance : 1e30;
+
+		int nearChild = leftFirst;
+		int farChild = leftFirst + 1;
+
+		float nearDistance = rayAABB(ray.origin, invDirection, texelFetch(bvhNodes, 2 * nearChild).xyz, texelFetch(bvhNodes, 2 * nearChild + 1).xyz, closest);
+		float farDistance = rayAABB(ray.origin, invDirection, texelFetch(bvhNodes, 2 * farChild).xyz, texelFetch(bvhNodes, 2 * farChild + 1).xyz, closest);
+
+		if (farDistance < nearDistance) {
+			int tmpChild = nearChild; nearChild = farChild; farChild = tmpChild;
+			float tmpDistance = nearDistance; nearDistance = farDistance; farDistance = tmpDistance;
+		}
+
+		if (nearDistance == 1e30) {
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+		} else {
+			nodeIndex = nearChild;
+			if (farDistance != 1e30) stack[stackSize++] = farChild;
+		}
+	}
+
+	return closerHit;
+}
 
 Intersection rayScene(Ray ray) {
 
 	int closestHitSphereIndex = -1;
 	float closestHitSphereDistance = -1;
 	int closestHitTriangleIndex = -1;
+	int closestHitInstanceIndex = -1;
 	float closestHitTriangleDistance = -1;
 	bool hit = false;
 
 	for (int i = 0; i < numSpheres; ++i) {
 
-		Sphere sphere = spheres[i];
+		Sphere sphere = getSphere(i);
 						
 		raySphere(ray, sphere, closestHitSphereDistance, hit);
 
@@ -155,15 +291,73 @@ Intersection rayScene(Ray ray) {
 		
 	}
 
-	for (int i = 0; i < numTriangles; ++i) {		
-	
-		Triangle triangle = triangles[i];
-	
-		rayTriangle(ray, triangle, closestHitTriangleDistance, hit);
-	
-		if (hit) {
-			closestHitTriangleIndex = i;
-			hit = false;
+	if (numInstances > 0) {
+
+		vec3 invDirection = 1.0 / ray.direction;
+
+		int stack[BVH_MAX_DEPTH];
+		int stackSize = 0;
+		int nodeIndex = 0;
+
+		if (rayAABB(ray.origin, invDirection, texelFetch(instanceNodes, 0).xyz, texelFetch(instanceNodes, 1).xyz, 1e30) == 1e30) {
+			nodeIndex = -1;
+		}
+
+		while (nodeIndex >= 0) {
+
+			vec4 nodeMin = texelFetch(instanceNodes, 2 * nodeIndex);
+			vec4 nodeMax = texelFetch(instanceNodes, 2 * nodeIndex + 1);
+
+			int leftFirst = floatBitsToInt(nodeMin.w);
+			int count = floatBitsToInt(nodeMax.w);
+
+			if (count > 0) {
+
+				for (int i = 0; i < count; ++i) {
+
+					int instanceIndex = leftFirst + i;
+					int rootNode = floatBitsToInt(texelFetch(sceneInstances, 4 * instanceIndex + 3).x);
+
+					if (rootNode < 0) continue;
+
+					// The direction isn't renormalized, so distances in object space are the same as in world space
+					vec4 row0 = texelFetch(sceneInstances, 4 * instanceIndex);
+					vec4 row1 = texelFetch(sceneInstances, 4 * instanceIndex + 1);
+					vec4 row2 = texelFetch(sceneInstances, 4 * instanceIndex + 2);
+
+					Ray objectRay;
+					objectRay.origin = vec3(dot(row0.xyz, ray.origin) + row0.w, dot(row1.xyz, ray.origin) + row1.w, dot(row2.xyz, ray.origin) + row2.w);
+					objectRay.direction = vec3(dot(row0.xyz, ray.direction), dot(row1.xyz, ray.direction), dot(row2.xyz, ray.direction));
+
+					if (rayGeometry(objectRay, rootNode, closestHitTriangleDistance, closestHitTriangleIndex)) {
+						closestHitInstanceIndex = instanceIndex;
+					}
+				}
+
+				nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+				continue;
+			}
+
+			// Visit the closer child first and remember the other one for later
+			float closest = closestHitTriangleDistance > 0 ? closestHitTriangleDistance : 1e30;
+
+			int nearChild = leftFirst;
+			int farChild = leftFirst + 1;
+
+			float nearDistance = rayAABB(ray.origin, invDirection, texelFetch(instanceNodes, 2 * nearChild).xyz, texelFetch(instanceNodes, 2 * nearChild + 1).xyz, closest);
+			float farDistance = rayAABB(ray.origin, invDirection, texelFetch(instanceNodes, 2 * farChild).xyz, texelFetch(instanceNodes, 2 * farChild + 1).xyz, closest);
+
+			if (farDistance < nearDistance) {
+				int tmpChild = nearChild; nearChild = farChild; farChild = tmpChild;
+				float tmpDistance = nearDistance; nearDistance = farDistance; farDistance = tmpDistance;
+			}
+
+			if (nearDistance == 1e30) {
+				nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+			} else {
+				nodeIndex = nearChild;
+				if (farDistance != 1e30) stack[stackSize++] = farChild;
+			}
 		}
 	}
 
@@ -174,13 +368,35 @@ Intersection rayScene(Ray ray) {
 	Intersection intersection;
 
 	if (sphereCloser) {
-		intersection.material = spheres[closestHitSphereIndex].material;
+		Sphere sphere = getSphere(closestHitSphereIndex);
+		intersection.material = sphere.material;
 		intersection.dst = closestHitSphereDistance;
-		intersection.normal = normalize(ray.origin + ray.direction * closestHitSphereDistance - spheres[closestHitSphereIndex].center);
+		intersection.normal = normalize(ray.origin + ray.direction * closestHitSphereDistance - sphere.center);
+		intersection.sphere = closestHitSphereIndex;
+		intersection.area = 0.0;
 	} else if (triangleHit) {
-		intersection.material = triangles[closestHitTriangleIndex].material;
+		Triangle triangle = getTriangle(closestHitTriangleIndex);
+		int instanceMaterial = floatBitsToInt(texelFetch(sceneInstances, 4 * closestHitInstanceIndex + 3).y);
+		vec3 normal = normalize(cross(triangle.v1 - triangle.v0, triangle.v2 - triangle.v0));
+
+		intersection.material = getMaterial(sceneMaterials, 2 * (instanceMaterial >= 0 ? instanceMaterial : triangle.material));
 		intersection.dst = closestHitTriangleDistance;
-		intersection.normal = triangles[closestHitTriangleIndex].normal;
+		// Normals are transformed with the transpose of the inverse, whose columns are the rows of the inverse
+		intersection.normal = normalize(texelFetch(sceneInstances, 4 * closestHitInstanceIndex).xyz * normal.x
+			+ texelFetch(sceneInstances, 4 * closestHitInstanceIndex + 1).xyz * normal.y
+			+ texelFetch(sceneInstances, 4 * closestHitInstanceIndex + 2).xyz * normal.z);
+		intersection.sphere = -1;
+		intersection.area = 0.0;
+
+		// Emission that is hit is weighed against sampling the triangle as a light, which needs its area in world space
+		// With the rows of the inverse transform that is |det A| * |A^-T * (e1 x e2)| / 2, where det A = 1 / det(inverse)
+		if (any(greaterThan(intersection.material.emission, vec3(0.0)))) {
+			vec3 row0 = texelFetch(sceneInstances, 4 * closestHitInstanceIndex).xyz;
+			vec3 row1 = texelFetch(sceneInstances, 4 * closestHitInstanceIndex + 1).xyz;
+			vec3 row2 = texelFetch(sceneInstances, 4 * closestHitInstanceIndex + 2).xyz;
+			vec3 edgeCross = cross(triangle.v1 - triangle.v0, triangle.v2 - triangle.v0);
+			intersection.area = 0.5 * length(row0 * edgeCross.x + row1 * edgeCross.y + row2 * edgeCross.z) / abs(dot(row0, cross(row1, row2)));
+		}
 	} else {
 		intersection.dst = -1;
 	}	
@@ -190,6 +406,161 @@ Intersection rayScene(Ray ray) {
 	return intersection;	
 }
 
+// Like rayGeometry, but stops at the first triangle closer than distance instead of looking for the closest one
+bool occludedGeometry(Ray ray, int rootNode, float distance) {
+
+	vec3 invDirection = 1.0 / ray.direction;
+
+	int stack[BVH_MAX_DEPTH];
+	int stackSize = 0;
+	int nodeIndex = rootNode;
+
+	if (rayAABB(ray.origin, invDirection, texelFetch(bvhNodes, 2 * rootNode).xyz, texelFetch(bvhNodes, 2 * rootNode + 1).xyz, distance) == 1e30) {
+		nodeIndex = -1;
+	}
+
+	while (nodeIndex >= 0) {
+
+		vec4 nodeMin = texelFetch(bvhNodes, 2 * nodeIndex);
+		vec4 nodeMax = texelFetch(bvhNodes, 2 * nodeIndex + 1);
+
+		int leftFirst = floatBitsToInt(nodeMin.w);
+		int count = floatBitsToInt(nodeMax.w);
+
+		if (count > 0) {
+
+			for (int i = 0; i < count; ++i) {
+
+				float closest = distance;
+				bool hit = false;
+
+				rayTriangle(ray, getTriangle(texelFetch(bvhIndices, leftFirst + i).x), closest, hit);
+
+				if (hit) return true;
+			}
+
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+			continue;
+		}
+
+		bool leftHit = rayAABB(ray.origin, invDirection, texelFetch(bvhNodes, 2 * leftFirst).xyz, texelFetch(bvhNodes, 2 * leftFirst + 1).xyz, distance) != 1e30;
+		bool rightHit = rayAABB(ray.origin, invDirection, texelFetch(bvhNodes, 2 * leftFirst + 2).xyz, texelFetch(bvhNodes, 2 * leftFirst + 3).xyz, distance) != 1e30;
+
+		if (leftHit) {
+			nodeIndex = leftFirst;
+			if (rightHit) stack[stackSize++] = leftFirst + 1;
+		} else if (rightHit) {
+			nodeIndex = leftFirst + 1;
+		} else {
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+		}
+	}
+
+	return false;
+}
+
+// Returns true if anything is hit closer than distance, for shadow rays any hit will do
+bool occluded(Ray ray, float distance) {
+
+	for (int i = 0; i < numSpheres; ++i) {
+
+		float closest = distance;
+		bool hit = false;
+
+		raySphere(ray, getSphere(i), closest, hit);
+
+		if (hit) return true;
+	}
+
+	if (numInstances == 0) return false;
+
+	vec3 invDirection = 1.0 / ray.direction;
+
+	int stack[BVH_MAX_DEPTH];
+	int stackSize = 0;
+	int nodeIndex = 0;
+
+	if (rayAABB(ray.origin, invDirection, texelFetch(instanceNodes, 0).xyz, texelFetch(instanceNodes, 1).xyz, distance) == 1e30) {
+		nodeIndex = -1;
+	}
+
+	while (nodeIndex >= 0) {
+
+		vec4 nodeMin = texelFetch(instanceNodes, 2 * nodeIndex);
+		vec4 nodeMax = texelFetch(instanceNodes, 2 * nodeIndex + 1);
+
+		int leftFirst = floatBitsToInt(nodeMin.w);
+		int count = floatBitsToInt(nodeMax.w);
+
+		if (count > 0) {
+
+			for (int i = 0; i < count; ++i) {
+
+				int instanceIndex = leftFirst + i;
+				int rootNode = floatBitsToInt(texelFetch(sceneInstances, 4 * instanceIndex + 3).x);
+
+				if (rootNode < 0) continue;
+
+				vec4 row0 = texelFetch(sceneInstances, 4 * instanceIndex);
+				vec4 row1 = texelFetch(sceneInstances, 4 * instanceIndex + 1);
+				vec4 row2 = texelFetch(sceneInstances, 4 * instanceIndex + 2);
+
+				Ray objectRay;
+				objectRay.origin = vec3(dot(row0.xyz, ray.origin) + row0.w, dot(row1.xyz, ray.origin) + row1.w, dot(row2.xyz, ray.origin) + row2.w);
+				objectRay.direction = vec3(dot(row0.xyz, ray.direction), dot(row1.xyz, ray.direction), dot(row2.xyz, ray.direction));
+
+				if (occludedGeometry(objectRay, rootNode, distance)) return true;
+			}
+
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+			continue;
+		}
+
+		bool leftHit = rayAABB(ray.origin, invDirection, texelFetch(instanceNodes, 2 * leftFirst).xyz, texelFetch(instanceNodes, 2 * leftFirst + 1).xyz, distance) != 1e30;
+		bool rightHit = rayAABB(ray.origin, invDirection, texelFetch(instanceNodes, 2 * leftFirst + 2).xyz, texelFetch(instanceNodes, 2 * leftFirst + 3).xyz, distance) != 1e30;
+
+		if (leftHit) {
+			nodeIndex = leftFirst;
+			if (rightHit) stack[stackSize++] = leftFirst + 1;
+		} else if (rightHit) {
+			nodeIndex = leftFirst + 1;
+		} else {
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+		}
+	}
+
+	return false;
+}
+
+// Samplers, the same as in src/Sampler.h
+#define SAMPLER_RANDOM 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_BLUE_NOISE 2
+
+#define BLUE_NOISE_SIZE 64
+
+// Golden ratio and R2 sequence increments, in 0.32 fixed point
+#define GOLDEN_RATIO_STEP 2654435769u
+#define R2_STEP_X 3242174889u
+#define R2_STEP_Y 2447445413u
+
+struct Sampler {
+	uint seed; // State of the random stream, or the hashed pixel index that scrambles the Sobol points
+	ivec2 pixel; // Position in the image, the blue noise texture is tiled across it
+	uint index; // Sample of the pixel, counted over all frames or batches
+	uint dimension; // Dimensions of the sample drawn so far
+};
+
+uint pcgHash(uint x) {
+	x = x * 747796405u + 2891336453u;
+	x = ((x >> ((x >> 28u) + 4u)) ^ x) * 277803737u;
+	return (x >> 22u) ^ x;
+}
+
+uint hashCombine(uint seed, uint value) {
+	return seed ^ (value + 0x9e3779b9u + (seed << 6u) + (seed >> 2u));
+}
+
 float random(inout uint seed) {
 	seed = seed * 747796405u + 2891336453u;
 	uint res = ((seed >> ((seed >> 28u) + 4u)) ^ seed) * 277803737u;
@@ -197,24 +568,199 @@ float random(inout uint seed) {
 	return res / 4294967296.0;
 }
 
-vec3 randomDirection(inout uint seed) {
-	float z = 1.0 - 2.0 * random(seed);
-	float a = 6.28318530718 * random(seed);
+// bitfieldReverse needs GLSL 4.00
+uint reverseBits(uint x) {
+	x = ((x >> 1u) & 0x55555555u) | ((x & 0x55555555u) << 1u);
+	x = ((x >> 2u) & 0x33333333u) | ((x & 0x33333333u) << 2u);
+	x = ((x >> 4u) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4u);
+	x = ((x >> 8u) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8u);
+	return (x >> 16u) | (x << 16u);
+}
+
+// Owen scrambling with the Laine-Karras hash on the reversed bits
+uint nestedUniformScramble(uint x, uint seed) {
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverseBits(x);
+}
+
+// Second dimension of the Sobol sequence, the first one is the index with its bits reversed
+uint sobol1(uint index) {
+	uint result = 0u;
+	for (uint v = 1u << 31u; index != 0u; index >>= 1u, v ^= v >> 1u) {
+		if ((index & 1u) != 0u) result ^= v;
+	}
+	return result;
+}
+
+// The top 24 bits, so rounding can't reach 1
+float toUnitFloat(uint x) {
+	return float(x >> 8u) * (1.0 / 16777216.0);
+}
+
+// The texel of the pixel in the blue noise texture, shifted by the hash, in 0.32 fixed point
+uint blueNoiseValue(Sampler sampler, uint offsetHash) {
+	int x = (sampler.pixel.x + int(offsetHash & uint(BLUE_NOISE_SIZE - 1))) & (BLUE_NOISE_SIZE - 1);
+	int y = (sampler.pixel.y + int((offsetHash >> 8u) & uint(BLUE_NOISE_SIZE - 1))) & (BLUE_NOISE_SIZE - 1);
+	return uint(texelFetch(blueNoise, y * BLUE_NOISE_SIZE + x).r * 4294967296.0);
+}
+
+// The random stream starts over every frame, the Sobol and blue noise points are only told apart by their index
+Sampler createSampler(ivec2 pixel, uint pixelIndex) {
+	return Sampler(samplerType == SAMPLER_RANDOM ? pixelIndex ^ (uint(frameIndex + sampleOffset) * 2654435761u) : pcgHash(pixelIndex), pixel, 0u, 0u);
+}
+
+void startSample(inout Sampler sampler, uint index) {
+	sampler.index = index;
+	sampler.dimension = 0u;
+}
+
+float sample1D(inout Sampler sampler) {
+
+	if (samplerType == SAMPLER_RANDOM) return random(sampler.seed);
+
+	uint dimension = sampler.dimension++;
+
+	if (samplerType == SAMPLER_BLUE_NOISE) {
+		return toUnitFloat(blueNoiseValue(sampler, pcgHash(2u * dimension)) + sampler.index * GOLDEN_RATIO_STEP);
+	}
+
+	uint dimensionSeed = pcgHash(hashCombine(sampler.seed, dimension));
+	uint index = nestedUniformScramble(sampler.index, dimensionSeed);
+	return toUnitFloat(nestedUniformScramble(reverseBits(index), pcgHash(dimensionSeed)));
+}
+
+vec2 sample2D(inout Sampler sampler) {
+
+	if (samplerType == SAMPLER_RANDOM) {
+		float x = random(sampler.seed);
+		float y = random(sampler.seed);
+		return vec2(x, y);
+	}
+
+	uint dimension = sampler.dimension++;
+
+	if (samplerType == SAMPLER_BLUE_NOISE) {
+		return vec2(toUnitFloat(blueNoiseValue(sampler, pcgHash(2u * dimension)) + sampler.index * R2_STEP_X),
+			toUnitFloat(blueNoiseValue(sampler, pcgHash(2u * dimension + 1u)) + sampler.index * R2_STEP_Y));
+	}
+
+	uint dimensionSeed = pcgHash(hashCombine(sampler.seed, dimension));
+	uint index = nestedUniformScramble(sampler.index, dimensionSeed);
+	return vec2(toUnitFloat(nestedUniformScramble(reverseBits(index), pcgHash(dimensionSeed))),
+		toUnitFloat(nestedUniformScramble(sobol1(index), pcgHash(dimensionSeed + 1u))));
+}
+
+vec3 randomDirection(inout Sampler sampler) {
+	vec2 u = sample2D(sampler);
+	float z = 1.0 - 2.0 * u.x;
+	float a = 6.28318530718 * u.y;
 	float r = sqrt(1.0 - (z * z));
 	return vec3(r * cos(a), r * sin(a), z);
 }
 
-vec2 randomInCircle(inout uint seed) {
-	float r = sqrt(random(seed));
-	float a = 6.28318530718 * random(seed);
+vec2 randomInCircle(inout Sampler sampler) {
+	vec2 u = sample2D(sampler);
+	float r = sqrt(u.x);
+	float a = 6.28318530718 * u.y;
 	return vec2(r * cos(a), r * sin(a));
 }
 
-vec3 trace(Ray ray, inout uint seed) {
+// 1 - cos of the half angle of the cone a sphere covers seen from distance2 away, written so it stays accurate for small cones
+float sphereConeSize(float radius2, float distance2) {
+	float sin2 = radius2 / distance2;
+	return sin2 / (1.0 + sqrt(1.0 - sin2));
+}
+
+// Picks one of the lights uniformly and samples a point on it that is seen from position
+// Returns false if the point can't be seen from there, otherwise the direction and distance to it, its emission and the
+// probability density of having sampled that direction, per solid angle
+bool sampleLight(vec3 position, inout Sampler sampler, out vec3 direction, out float distance, out vec3 emission, out float pdf) {
+
+	int index = min(int(sample1D(sampler) * float(numLights)), numLights - 1);
+	vec2 u = sample2D(sampler);
+	float u1 = u.x;
+	float u2 = u.y;
+
+	vec4 v0 = texelFetch(sceneLights, 4 * index);
+	vec4 v1 = texelFetch(sceneLights, 4 * index + 1);
+	vec4 v2 = texelFetch(sceneLights, 4 * index + 2);
+	emission = texelFetch(sceneLights, 4 * index + 3).rgb;
+
+	if (v0.w > 0.0) {
+		// Spheres are sampled uniformly in the cone of directions they cover
+		vec3 toCenter = v0.xyz - position;
+		float distance2 = dot(toCenter, toCenter);
+		float radius2 = v0.w * v0.w;
+
+		if (distance2 <= radius2) return false;
+
+		float coneSize = sphereConeSize(radius2, distance2);
+		float cosTheta = 1.0 - u1 * coneSize;
+		float sinTheta = sqrt(max(1.0 - cosTheta * cosTheta, 0.0));
+		float phi = 2.0 * PI * u2;
+
+		vec3 w = toCenter / sqrt(distance2);
+		vec3 u = normalize(cross(abs(w.x) > 0.1 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0), w));
+		vec3 v = cross(w, u);
+		direction = (u * cos(phi) + v * sin(phi)) * sinTheta + w * cosTheta;
+
+		float b = dot(toCenter, direction);
+		distance = b - sqrt(max(radius2 - (distance2 - b * b), 0.0));
+		pdf = 1.0 / (2.0 * PI * coneSize);
+	} else {
+		// Triangles are sampled uniformly by area and only emit to the front, the side they can be hit from
+		float s = sqrt(u1);
+		vec3 point = v0.xyz * (1.0 - s) + v1.xyz * (s * (1.0 - u2)) + v2.xyz * (s * u2);
+		vec3 toPoint = point - position;
+		float distance2 = dot(toPoint, toPoint);
+
+		distance = sqrt(distance2);
+		direction = toPoint / distance;
+
+		float cosLight = -dot(normalize(cross(v1.xyz - v0.xyz, v2.xyz - v0.xyz)), direction);
+
+		if (cosLight <= 0.0) return false;
+
+		pdf = distance2 / (cosLight * v1.w);
+	}
+
+	pdf /= float(numLights);
+	return true;
+}
+
+// The density with which sampleLight would have picked the direction towards an emissive hit from position
+float lightPdf(vec3 position, Intersection intersection, vec3 direction) {
+
+	if (intersection.sphere >= 0) {
+		Sphere sphere = getSphere(intersection.sphere);
+		vec3 toCenter = sphere.center - position;
+		float distance2 = dot(toCenter, toCenter);
+		float radius2 = sphere.radius * sphere.radius;
+
+		if (distance2 <= radius2) return 0.0;
+
+		return 1.0 / (2.0 * PI * sphereConeSize(radius2, distance2) * float(numLights));
+	}
+
+	vec3 toHit = intersection.position - position;
+	return dot(toHit, toHit) / (abs(dot(intersection.normal, direction)) * intersection.area * float(numLights));
+}
+
+vec3 trace(Ray ray, inout Sampler sampler) {
 	
 	vec3 rayColor = vec3(1.f);
 	vec3 totalLight = vec3(0.f);
 	Intersection intersection;
+
+	// Set when the previous bounce sampled the lights directly, then emission that is hit is weighed against that
+	bool sampledLights = false;
+	vec3 previousOrigin;
+	float scatterPdf;
 	
 	for (int i = 0; i < maxBounces; ++i) {
 	
@@ -226,40 +772,138 @@ vec3 trace(Ray ray, inout uint seed) {
 
 		Material material = intersection.material;
 
+		// Multiple importance sampling with the power heuristic between bouncing into a light and sampling it
+		float emissionWeight = 1.0;
+		if (sampledLights && any(greaterThan(material.emission, vec3(0.0)))) {
+			float pdf = lightPdf(previousOrigin, intersection, ray.direction);
+			emissionWeight = scatterPdf * scatterPdf / (scatterPdf * scatterPdf + pdf * pdf);
+		}
+
 		ray.origin = intersection.position + intersection.normal * 0.001;
+
+		// Next event estimation: diffuse surfaces also send a shadow ray to a light, unless the path ends here anyway.
+		// The blend of the diffuse and specular direction has no density to weigh against, so only fully diffuse ones do
+		sampledLights = numLights > 0 && material.smoothness == 0.0 && i + 1 < maxBounces;
+
+		if (sampledLights) {
+			vec3 lightDirection;
+			float lightDistance;
+			vec3 lightEmission;
+			float pdf;
+
+			if (sampleLight(ray.origin, sampler, lightDirection, lightDistance, lightEmission, pdf)) {
+				float cosSurface = dot(intersection.normal, lightDirection);
+
+				if (cosSurface > 0.0 && !occluded(Ray(ray.origin, lightDirection), lightDistance * 0.999)) {
+					float bsdfPdf = cosSurface / PI;
+					totalLight += rayColor * material.color * lightEmission * (bsdfPdf / pdf) * (pdf * pdf / (pdf * pdf + bsdfPdf * bsdfPdf));
+				}
+			}
+		}
 		
-		vec3 diffuseDir = normalize(intersection.normal + randomDirection(seed));
+		vec3 diffuseDir = normalize(intersection.normal + randomDirection(sampler));
 		vec3 specularDir = reflect(ray.direction, intersection.normal);
 		ray.direction = mix(diffuseDir, specularDir, material.smoothness);
+
+		if (sampledLights) {
+			previousOrigin = ray.origin;
+			scatterPdf = max(dot(intersection.normal, ray.direction), 0.0) / PI;
+		}
 		
-		totalLight += rayColor * material.emission;
+		totalLight += rayColor * material.emission * emissionWeight;
 		rayColor *= material.color;
 
+		// Russian roulette: a path continues with the probability of its throughput and carries that much more light if it does,
+		// so dark paths stop early and the average stays the same
+		if (i + 1 >= RUSSIAN_ROULETTE_DEPTH && i + 1 < maxBounces) {
+			float survival = min(max(rayColor.r, max(rayColor.g, rayColor.b)), 1.0);
+			if (sample1D(sampler) >= survival) {
+				break;
+			}
+			rayColor /= survival;
+		}
+
 	}
 
 	return totalLight;
 }
 
-vec3 renderRaytraced(inout uint seed, vec2 world) {
+float luminance(vec3 color) {
+	return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// `squaredLuminance` returns the average of the squared luminance of the samples, for adaptive sampling
+vec3 renderRaytraced(inout Sampler sampler, vec2 world, out float squaredLuminance) {
 	vec3 color = vec3(0.0);
+	squaredLuminance = 0.0;
 
 	Ray ray;
 	ray.origin = camera.position; //The ray starts at the camera position
 
 	for (int i = 0; i < numSamples; ++i) {
+
+		// Samples are counted over all frames, so the Sobol and blue noise points go on where the last frame stopped
+		startSample(sampler, uint(sampleOffset + accumulatedSamples + i));
 		 
-		vec2 jitter = randomInCircle(seed) * jitterStrenght;
+		vec2 jitter = randomInCircle(sampler) * jitterStrenght;
 		vec2 jitterWorld = world + jitter;
 	
 		ray.direction = normalize(camera.direction + jitterWorld.x * camera.right + jitterWorld.y * camera.up);
 				
-		color += trace(ray, seed);
+		vec3 radiance = trace(ray, sampler);
+		color += radiance;
+		squaredLuminance += luminance(radiance) * luminance(radiance);
 		
 	}
 
+	squaredLuminance /= float(numSamples);
 	return color / float(numSamples);
 }
 
+// First hit albedo, normal and distance for the denoiser, averaged over the lens jitter of the first samples like the image
+// Returns the albedo, the normal and distance go to normalDepth, rays that hit nothing count as 0
+vec4 renderFeatures(inout Sampler sampler, vec2 world, out vec4 normalDepth) {
+	vec3 albedo = vec3(0.0);
+	normalDepth = vec4(0.0);
+
+	Ray ray;
+	ray.origin = camera.position;
+
+	for (int i = 0; i < numSamples; ++i) {
+
+		startSample(sampler, uint(i));
+
+		vec2 jitterWorld = world + randomInCircle(sampler) * jitterStrenght;
+		ray.direction = normalize(camera.direction + jitterWorld.x * camera.right + jitterWorld.y * camera.up);
+
+		Intersection intersection = rayScene(ray);
+
+		if (intersection.dst > 0.0) {
+			albedo += intersection.material.color;
+			normalDepth += vec4(intersection.normal, intersection.dst);
+		}
+	}
+
+	normalDepth /= float(numSamples);
+	return vec4(albedo / float(numSamples), 1.0);
+}
+
+// Adaptive sampling, the same as in src/Tracer.h
+#define ADAPTIVE_MIN_SAMPLES 64
+#define ADAPTIVE_DARK_LUMINANCE 0.05
+
+bool converged(vec4 average, int numSamples) {
+	// `average` holds the color in rgb and the average squared luminance of the samples in alpha
+	if (numSamples < ADAPTIVE_MIN_SAMPLES) return false;
+
+	// Too few samples to reach the threshold, unless the pixel missed its rare bright paths
+	if (float(numSamples) * noiseThreshold * noiseThreshold < 1.0) return false;
+
+	float mean = luminance(average.rgb);
+	float variance = max(average.a - mean * mean, 0.0);
+	return sqrt(variance / float(numSamples - 1)) / (mean + ADAPTIVE_DARK_LUMINANCE) < noiseThreshold;
+}
+
 int renderMode() {
 	float margin = 15.0;
 	vec2 size = vec2(200.0, 160.0);
@@ -307,11 +951,47 @@ void main() {
 		return;
 	}
 
+	// Converged pixels are dropped, the export counts the rest, its colors aren't written
+	if (countPass == 1) {
+		if (converged(texelFetch(accumulation, ivec2(gl_FragCoord.xy), 0), accumulatedSamples)) discard;
+		fragColor = vec4(0.0);
+		return;
+	}
+
+	// Exports are rendered in tiles, the tile offset turns the fragment coordinate into the position in the image
+	vec2 fragCoord = gl_FragCoord.xy + vec2(tileOffset);
+
 	//World coordinates ranging from (-1,-1) in the bottom left corner of the screen to (1,1) in the top right corner of the screen
-	vec2 world = (gl_FragCoord.xy - resolution / 2.0) / resolution.y;
+	vec2 world = (fragCoord - resolution / 2.0) / resolution.y;
 	
-	uint pixelIndex = uint(gl_FragCoord.x + gl_FragCoord.y * resolution.x);
+	uint pixelIndex = uint(fragCoord.x + fragCoord.y * resolution.x);
+
+	// Every frame needs different random numbers, otherwise averaging them would not converge
+	Sampler sampler = createSampler(ivec2(fragCoord), pixelIndex);
+
+	if (featurePass == 1) {
+		fragColor = renderFeatures(sampler, world, fragNormalDepth);
+		return;
+	}
 	
-	fragColor = vec4(renderRaytraced(pixelIndex, world), 1.0f);
+	vec4 average = accumulatedSamples > 0 ? texelFetch(accumulation, ivec2(gl_FragCoord.xy), 0) : vec4(0.0);
+
+	// Adaptive sampling: a pixel that converged keeps its average
+	if (noiseThreshold > 0.0 && converged(average, accumulatedSamples)) {
+		fragColor = average;
+		return;
+	}
+
+	float squaredLuminance;
+	vec3 color = renderRaytraced(sampler, world, squaredLuminance);
+
+	// Exports keep the average of the squared luminance of the samples in alpha, the noise of the pixel is estimated from it
+	vec4 result = vec4(color, noGUI == 1 ? squaredLuminance : 1.0f);
+
+	if (accumulatedSamples > 0) {
+		result = average + (result - average) * float(numSamples) / float(accumulatedSamples + numSamples);
+	}
+
+	fragColor = result;
 
 }
\ No newline at end of file
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <vector>
+
+#include "TriangleBlocks.h"
+#include "Lights.h"
+
+/*
+	Two level bounding volume hierarchy over the meshes of the object buffer:
+		- Every geometry gets a bottom level tree over its triangles in object space, built once when the geometry is loaded
+		- The top level tree is built over the world space bounds of the instances, it is cheap and rebuilt whenever the scene changes,
+		  so moving a mesh never touches its triangles
+		- Trees are built on the CPU with the surface area heuristic (SAH), evaluated over a fixed number of bins per axis
+		- The children of a node are always stored next to each other (`leftFirst` and `leftFirst + 1`)
+		- Leaves reference a range of `indices`, which in turn reference the primitives, so the triangles never get reordered
+		  and geometry ranges (`Geometry::firstTriangle`, `Geometry::lastTriangle`) stay valid
+		- The node layout is exactly two texels of a RGBA32F buffer texture, so it can be uploaded as is and walked by `trace.frag`
+		- For the CPU the triangles of every bottom level leaf are also copied into blocks for the SIMD kernels of TriangleBlocks.h,
+		  in the order of the leaf's indices, the blocks of a geometry are stored next to each other
+		- The light list (Lights.h) is rebuilt along with the trees, it depends on the same changes
+*/
+
+constexpr int BVH_BINS = 16;
+constexpr int BVH_MAX_LEAF_SIZE = 8;
+constexpr int BVH_MAX_DEPTH = 32; // Must match the traversal stack size in the shader
+
+struct BVHNode {
+	glm::vec3 boundsMin;
+	int leftFirst; // Index of the left child for interior nodes, index of the first primitive for leaves
+
+	glm::vec3 boundsMax;
+	int count; // Number of primitives, 0 for interior nodes
+};
+
+struct BVHTree {
+	std::vector<BVHNode> nodes;
+	std::vector<int> indices;
+};
+
+struct BVH {
+	BVHTree bottomLevel; // The trees of all geometries, node and triangle indices are global, so they can share one buffer
+	std::vector<int> roots; // Root node of every geometry in `bottomLevel`
+	BVHTree topLevel; // Leaves reference instances
+
+	//Only used on the CPU, never uploaded
+	std::vector<TriangleBlock> triangleBlocks;
+	std::vector<int> leafBlocks; // First block of every node of `bottomLevel`, -1 for interior nodes
+	std::vector<glm::ivec2> geometryBlocks; // First block and number of blocks of every geometry
+
+	//Parts that changed since they were last uploaded
+	DirtyRange changedNodes; // Of `bottomLevel.nodes`
+	DirtyRange changedIndices; // Of `bottomLevel.indices`
+	bool topLevelChanged = false;
+};
+
+struct AABB {
+	glm::vec3 min = glm::vec3(1e30f);
+	glm::vec3 max = glm::vec3(-1e30f);
+
+	void grow(const glm::vec3& point) {
+		min = glm::min(min, point);
+		max = glm::max(max, point);
+	}
+
+	void grow(const AABB& other) {
+		min = glm::min(min, other.min);
+		max = glm::max(max, other.max);
+	}
+
+	float area() const {
+		glm::vec3 extent = max - min;
+		return extent.x < 0.0f ? 0.0f : 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+	}
+};
+
+AABB triangleBounds(const ObjectBuffer& objectBuffer, const Triangle& triangle) {
+	AABB bounds;
+	bounds.grow(objectBuffer.vertices[triangle.indices.x].position);
+	bounds.grow(objectBuffer.vertices[triangle.indices.y].position);
+	bounds.grow(objectBuffer.vertices[triangle.indices.z].position);
+	return bounds;
+}
+
+AABB transformBounds(const AABB& bounds, const glm::mat4& transform) {
+	//Bounds of the transformed corners of the box
+	AABB transformed;
+	for (int i = 0; i < 8; ++i) {
+		const glm::vec3 corner((i & 1) ? bounds.max.x : bounds.min.x, (i & 2) ? bounds.max.y : bounds.min.y, (i & 4) ? bounds.max.z : bounds.min.z);
+		transformed.grow(glm::vec3(transform * glm::vec4(corner, 1.0f)));
+	}
+	return transformed;
+}
+
+void updateNodeBounds(BVHTree& bvh, BVHNode& node, const std::vector<AABB>& primitiveBounds) {
+	AABB bounds;
+	for (int i = 0; i < node.count; ++i) {
+		bounds.grow(primitiveBounds[bvh.indices[node.leftFirst + i]]);
+	}
+	node.boundsMin = bounds.min;
+	node.boundsMax = bounds.max;
+}
+
+float findBestSplit(const BVHTree& bvh, const BVHNode& node, const std::vector<AABB>& primitiveBounds, const std::vector<glm::vec3>& centroids, int& bestAxis, float& bestPosition) {
+	//Returns the SAH cost of the best split of the node, or 1e30 if the centroids can't be separated
+
+	float bestCost = 1e30f;
+
+	AABB centroidBounds;
+	for (int i = 0; i < node.count; ++i) {
+		centroidBounds.grow(centroids[bvh.indices[node.leftFirst + i]]);
+	}
+
+	for (int axis = 0; axis < 3; ++axis) {
+
+		const float boundsMin = centroidBounds.min[axis];
+		const float boundsMax = centroidBounds.max[axis];
+
+		if (boundsMin == boundsMax) continue;
+
+		AABB bins[BVH_BINS];
+		int binCounts[BVH_BINS] = {};
+
+		const float scale = BVH_BINS / (boundsMax - boundsMin);
+
+		for (int i = 0; i < node.count; ++i) {
+			const int index = bvh.indices[node.leftFirst + i];
+			const int bin = std::min(BVH_BINS - 1, static_cast<int>((centroids[index][axis] - boundsMin) * scale));
+			binCounts[bin]++;
+			bins[bin].grow(primitiveBounds[index]);
+		}
+
+		//Sweep from both sides to get the area and primitive count left and right of every plane between two bins
+		float leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
+		int leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
+
+		AABB leftBox, rightBox;
+		int leftSum = 0, rightSum = 0;
+
+		for (int i = 0; i < BVH_BINS - 1; ++i) {
+			leftSum += binCounts[i];
+			leftCount[i] = leftSum;
+			leftBox.grow(bins[i]);
+			leftArea[i] = leftBox.area();
+
+			rightSum += binCounts[BVH_BINS - 1 - i];
+			rightCount[BVH_BINS - 2 - i] = rightSum;
+			rightBox.grow(bins[BVH_BINS - 1 - i]);
+			rightArea[BVH_BINS - 2 - i] = rightBox.area();
+		}
+
+		for (int i = 0; i < BVH_BINS - 1; ++i) {
+			if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+
+			const float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestPosition = boundsMin + (i + 1) / scale;
+			}
+		}
+	}
+
+	return bestCost;
+}
+
+void subdivide(BVHTree& bvh, const int nodeIndex, const int depth, const std::vector<AABB>& primitiveBounds, const std::vector<glm::vec3>& centroids) {
+
+	BVHNode& node = bvh.nodes[nodeIndex];
+
+	if (node.count <= 1 || depth >= BVH_MAX_DEPTH - 1) return;
+
+	int axis = 0;
+	float splitPosition = 0.0f;
+	const float splitCost = findBestSplit(bvh, node, primitiveBounds, centroids, axis, splitPosition);
+
+	AABB nodeBounds;
+	nodeBounds.min = node.boundsMin;
+	nodeBounds.max = node.boundsMax;
+	const float leafCost = node.count * nodeBounds.area();
+
+	int first = node.leftFirst;
+	int last = first + node.count - 1;
+	int leftCount = 0;
+
+	if (splitCost < leafCost) {
+		//Partition the indices in place, primitives left of the plane go first
+		int i = first;
+		int j = last;
+		while (i <= j) {
+			if (centroids[bvh.indices[i]][axis] < splitPosition) {
+				i++;
+			}
+			else {
+				std::swap(bvh.indices[i], bvh.indices[j--]);
+			}
+		}
+		leftCount = i - first;
+	}
+	else if (node.count > BVH_MAX_LEAF_SIZE) {
+		//Splitting isn't worth it by SAH (or the centroids all coincide), but the leaf would be too big, so split in the middle
+		leftCount = node.count / 2;
+	}
+	else {
+		return;
+	}
+
+	if (leftCount == 0 || leftCount == node.count) return;
+
+	const int leftChild = static_cast<int>(bvh.nodes.size());
+
+	BVHNode left, right;
+	left.leftFirst = first;
+	left.count = leftCount;
+	right.leftFirst = first + leftCount;
+	right.count = node.count - leftCount;
+
+	node.leftFirst = leftChild;
+	node.count = 0;
+
+	//Careful, `node` is a dangling reference after this
+	bvh.nodes.push_back(left);
+	bvh.nodes.push_back(right);
+
+	updateNodeBounds(bvh, bvh.nodes[leftChild], primitiveBounds);
+	updateNodeBounds(bvh, bvh.nodes[leftChild + 1], primitiveBounds);
+
+	subdivide(bvh, leftChild, depth + 1, primitiveBounds, centroids);
+	subdivide(bvh, leftChild + 1, depth + 1, primitiveBounds, centroids);
+}
+
+void buildTree(BVHTree& bvh, const std::vector<AABB>& primitiveBounds) {
+	//Builds a tree over the primitives `0` to `primitiveBounds.size() - 1`
+
+	const int numPrimitives = static_cast<int>(primitiveBounds.size());
+
+	bvh.nodes.clear();
+	bvh.indices.resize(numPrimitives);
+
+	if (numPrimitives == 0) return;
+
+	std::vector<glm::vec3> centroids(numPrimitives);
+
+	for (int i = 0; i < numPrimitives; ++i) {
+		bvh.indices[i] = i;
+		centroids[i] = (primitiveBounds[i].min + primitiveBounds[i].max) * 0.5f;
+	}
+
+	bvh.nodes.reserve(2 * numPrimitives - 1);
+
+	BVHNode root;
+	root.leftFirst = 0;
+	root.count = numPrimitives;
+	bvh.nodes.push_back(root);
+
+	updateNodeBounds(bvh, bvh.nodes[0], primitiveBounds);
+	subdivide(bvh, 0, 0, primitiveBounds, centroids);
+}
+
+void buildBottomLevel(BVH& bvh, const ObjectBuffer& objectBuffer, const int geometryIndex) {
+	//Builds the tree of a geometry and appends it to the bottom level
+
+	const Geometry& geometry = objectBuffer.geometries[geometryIndex];
+
+	std::vector<AABB> primitiveBounds;
+	primitiveBounds.reserve(geometry.lastTriangle - geometry.firstTriangle + 1);
+	for (int i = geometry.firstTriangle; i <= geometry.lastTriangle; ++i) {
+		primitiveBounds.push_back(triangleBounds(objectBuffer, objectBuffer.triangles[i]));
+	}
+
+	BVHTree tree;
+	buildTree(tree, primitiveBounds);
+
+	//Move the tree behind the ones already built, so every index points into the shared arrays
+	const int nodeOffset = static_cast<int>(bvh.bottomLevel.nodes.size());
+	const int indexOffset = static_cast<int>(bvh.bottomLevel.indices.size());
+
+	for (BVHNode& node : tree.nodes) {
+		node.leftFirst += node.count > 0 ? indexOffset : nodeOffset;
+	}
+	for (int& index : tree.indices) {
+		index += geometry.firstTriangle;
+	}
+
+	bvh.roots.push_back(tree.nodes.empty() ? -1 : nodeOffset);
+	bvh.bottomLevel.nodes.insert(bvh.bottomLevel.nodes.end(), tree.nodes.begin(), tree.nodes.end());
+	bvh.bottomLevel.indices.insert(bvh.bottomLevel.indices.end(), tree.indices.begin(), tree.indices.end());
+
+	//Every leaf gets its own blocks, the last one is padded with degenerate triangles
+	const int firstBlock = static_cast<int>(bvh.triangleBlocks.size());
+
+	for (const BVHNode& node : tree.nodes) {
+		if (node.count == 0) {
+			bvh.leafBlocks.push_back(-1);
+			continue;
+		}
+
+		bvh.leafBlocks.push_back(static_cast<int>(bvh.triangleBlocks.size()));
+
+		for (int i = 0; i < node.count; ++i) {
+			if (i % TRIANGLE_BLOCK_SIZE == 0) {
+				bvh.triangleBlocks.emplace_back();
+				clearTriangleBlock(bvh.triangleBlocks.back());
+			}
+
+			const int index = bvh.bottomLevel.indices[node.leftFirst + i];
+			const Triangle& triangle = objectBuffer.triangles[index];
+			setBlockTriangle(bvh.triangleBlocks.back(), i % TRIANGLE_BLOCK_SIZE, objectBuffer.vertices[triangle.indices.x].position,
+				objectBuffer.vertices[triangle.indices.y].position, objectBuffer.vertices[triangle.indices.z].position, index);
+		}
+	}
+
+	bvh.geometryBlocks.push_back(glm::ivec2(firstBlock, static_cast<int>(bvh.triangleBlocks.size()) - firstBlock));
+
+	bvh.changedNodes.add(nodeOffset, static_cast<int>(bvh.bottomLevel.nodes.size()) - 1);
+	bvh.changedIndices.add(indexOffset, static_cast<int>(bvh.bottomLevel.indices.size()) - 1);
+}
+
+void buildTopLevel(BVH& bvh, ObjectBuffer& objectBuffer) {
+
+	std::vector<AABB> primitiveBounds;
+	primitiveBounds.reserve(objectBuffer.instances.size());
+
+	for (const Instance& instance : objectBuffer.instances) {
+		const int root = bvh.roots[instance.geometry];
+		AABB bounds;
+		if (root >= 0) {
+			bounds.min = bvh.bottomLevel.nodes[root].boundsMin;
+			bounds.max = bvh.bottomLevel.nodes[root].boundsMax;
+			bounds = transformBounds(bounds, instance.transform);
+		}
+		primitiveBounds.push_back(bounds);
+	}
+
+	buildTree(bvh.topLevel, primitiveBounds);
+
+	bvh.topLevelChanged = true;
+	objectBuffer.changes.instances = false;
+}
+
+void buildBVH(BVH& bvh, ObjectBuffer& objectBuffer) {
+
+	bvh.bottomLevel.nodes.clear();
+	bvh.bottomLevel.indices.clear();
+	bvh.roots.clear();
+	bvh.triangleBlocks.clear();
+	bvh.leafBlocks.clear();
+	bvh.geometryBlocks.clear();
+
+	for (int i = 0; i < static_cast<int>(objectBuffer.geometries.size()); ++i) {
+		buildBottomLevel(bvh, objectBuffer, i);
+	}
+
+	buildTopLevel(bvh, objectBuffer);
+	buildLights(objectBuffer);
+}
+
+void updateBVH(BVH& bvh, ObjectBuffer& objectBuffer) {
+	//Builds the trees of new geometries and rebuilds the top level if an instance or a geometry was added or moved
+
+	if (bvh.roots.size() > objectBuffer.geometries.size()) {
+		buildBVH(bvh, objectBuffer);
+		return;
+	}
+
+	const bool newGeometries = bvh.roots.size() < objectBuffer.geometries.size();
+
+	//Emissions change with the materials, emissive spheres and instances can move
+	const bool lightsChanged = newGeometries || objectBuffer.changes.instances || !objectBuffer.changes.spheres.empty() || !objectBuffer.changes.materials.empty();
+
+	for (int i = static_cast<int>(bvh.roots.size()); i < static_cast<int>(objectBuffer.geometries.size()); ++i) {
+		buildBottomLevel(bvh, objectBuffer, i);
+	}
+
+	if (newGeometries || objectBuffer.changes.instances) {
+		buildTopLevel(bvh, objectBuffer);
+	}
+
+	if (lightsChanged) {
+		buildLights(objectBuffer);
+	}
+}
+
+float rayAABB(const glm::vec3& origin, const glm::vec3& invDirection, const glm::vec3& boundsMin, const glm::vec3& boundsMax, const float closest) {
+	//Returns the distance to the box, or 1e30 if it is missed or further away than `closest`
+
+	glm::vec3 t0 = (boundsMin - origin) * invDirection;
+	glm::vec3 t1 = (boundsMax - origin) * invDirection;
+
+	glm::vec3 tMin = glm::min(t0, t1);
+	glm::vec3 tMax = glm::max(t0, t1);
+
+	float tNear = std::max(std::max(tMin.x, tMin.y), std::max(tMin.z, 0.0f));
+	float tFar = std::min(std::min(tMax.x, tMax.y), std::min(tMax.z, closest));
+
+	return tNear <= tFar ? tNear : 1e30f;
+}
@@ -6,207 +6,187 @@
 
 bool createSphere(ObjectBuffer& objectBuffer, const glm::vec3& center, const float radius, const Material& material) {
 
-	if (objectBuffer.numSpheres >= MAX_SPHERES) {
-		std::cerr << "Error: Too many spheres!\n";
-		std::cerr << "Maximum is " << MAX_SPHERES << "\n";
-		return false;
-	}
-
 	Sphere sphere;
 	sphere.center = center;
 	sphere.radius = radius;
 	sphere.material = material;
-	objectBuffer.spheres[objectBuffer.numSpheres++] = sphere;
+	objectBuffer.spheres.push_back(sphere);
+	objectBuffer.numSpheres = static_cast<int>(objectBuffer.spheres.size());
+	objectBuffer.changes.spheres.add(objectBuffer.numSpheres - 1);
 	return true;
 }
 
-bool createTriangle(ObjectBuffer& objectBuffer, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, const Material& material) {
+int createMaterial(ObjectBuffer& objectBuffer, const Material& material) {
+	//Returns the index of the new material
 
-	if (objectBuffer.numTriangles >= MAX_TRIANGLES) {
-		std::cerr << "Error: Too many triangles!\n";
-		std::cerr << "Maximum is " << MAX_TRIANGLES << "\n";
-		return false;
-	}
+	objectBuffer.materials.push_back(material);
+	const int index = static_cast<int>(objectBuffer.materials.size()) - 1;
+	objectBuffer.changes.materials.add(index);
+	return index;
+}
+
+bool createTriangle(ObjectBuffer& objectBuffer, const glm::ivec3& indices, const int material) {
 
 	Triangle triangle;
-	triangle.v0 = v0;
-	triangle.v1 = v1;
-	triangle.v2 = v2;
+	triangle.indices = indices;
 	triangle.material = material;
-	objectBuffer.triangles[objectBuffer.numTriangles++] = triangle;
+	objectBuffer.triangles.push_back(triangle);
+	objectBuffer.numTriangles = static_cast<int>(objectBuffer.triangles.size());
+	objectBuffer.changes.triangles.add(objectBuffer.numTriangles - 1);
 	return true;
 }
 
-void computeTriangles(ObjectBuffer& objectBuffer) {
+void addMesh(ObjectBuffer& objectBuffer, const ObjData& obj, Mesh& mesh) {
+	//Adds a parsed mesh file as a new geometry with an instance of it, white and untransformed
 
-#pragma omp parallel for
-	for (int i = 0; i < objectBuffer.numTriangles; ++i) {
-		Triangle& triangle = objectBuffer.triangles[i];
-		triangle.edge1 = triangle.v1 - triangle.v0;
-		triangle.edge2 = triangle.v2 - triangle.v0;
-		triangle.normal = glm::normalize(glm::cross(triangle.edge1, triangle.edge2));
-	}
-}
+	Geometry geometry;
+	geometry.firstVertex = static_cast<int>(objectBuffer.vertices.size());
+	objectBuffer.vertices.reserve(objectBuffer.vertices.size() + obj.vertices.size());
 
-bool loadMesh(ObjectBuffer& objectBuffer, const char* path, Mesh& mesh) {
-	
-	mesh.wasLoaded = false;
-	std::ifstream meshFile(path);
-	if (!meshFile.is_open()) {
-		std::cout << "Error: Could not open mesh file\n";
-		return false;
+	for (const glm::vec3& position : obj.vertices) {
+		objectBuffer.vertices.push_back(Vertex{ position, 0.f });
 	}
 
-	float* vertices = new float[3 * MAX_TRIANGLES];
-	int* indices = new int[3 * MAX_TRIANGLES];
-	int currentVertex = 0;
-	int currentIndex = 0;
-
-	std::string line;
-	while (std::getline(meshFile, line)) {
-
-		// Get the type of line (v/f, but not vn, ...)
-		std::string type = line.substr(0, line.find(' '));
+	const int material = createMaterial(objectBuffer, Material{ glm::vec3(1.0f, 1.0f, 1.0f), 0.f, glm::vec4(0.f) });
 
-		// Get the first, second, and third arguments
-		std::istringstream iss(line);
-		std::string arg1, arg2, arg3;
-		iss >> type >> arg1 >> arg2 >> arg3;
+	geometry.firstTriangle = objectBuffer.numTriangles;
+	objectBuffer.triangles.reserve(objectBuffer.triangles.size() + obj.indices.size() / 3);
 
-		if (type != "v" && type != "f") {
-			continue;
-		}
-
-		if (type == "v") {
-			vertices[currentVertex++] = std::stof(arg1);
-			vertices[currentVertex++] = std::stof(arg2);
-			vertices[currentVertex++] = std::stof(arg3);
-		}
-		else if (type == "f") {
-			indices[currentIndex++] = std::stoi(arg1) - 1;
-			indices[currentIndex++] = std::stoi(arg2) - 1;
-			indices[currentIndex++] = std::stoi(arg3) - 1;
-		}
-
-		if (currentVertex > 3 * MAX_TRIANGLES || currentIndex > 3 * MAX_TRIANGLES) {
-			delete[] vertices;
-			delete[] indices;
-			std::cerr << "Error: Too many vertices or indices in mesh file\n";
-			std::cerr << "Maximum is " << MAX_TRIANGLES << "\n";
-			return false;
-		}
+	for (size_t i = 0; i + 2 < obj.indices.size(); i += 3) {
+		createTriangle(objectBuffer, glm::ivec3(obj.indices[i], obj.indices[i + 1], obj.indices[i + 2]) + geometry.firstVertex, material);
 	}
 
-	mesh.firstTriangle = objectBuffer.numTriangles;
-
-	for (int i = 0; i < currentIndex; i += 3) {
-		if (!createTriangle(objectBuffer, glm::vec3(vertices[3 * (indices[i])], vertices[3 * (indices[i]) + 1], vertices[3 * (indices[i]) + 2]),
-			glm::vec3(vertices[3 * (indices[i + 1])], vertices[3 * (indices[i + 1]) + 1], vertices[3 * (indices[i + 1]) + 2]),
-			glm::vec3(vertices[3 * (indices[i + 2])], vertices[3 * (indices[i + 2]) + 1], vertices[3 * (indices[i + 2]) + 2]),
-			Material{ glm::vec3(1.0f, 1.0f, 1.0f), 0.f, glm::vec4(0.f) }))
-		{
-			delete[] vertices;
-			delete[] indices;
-			objectBuffer.numTriangles = mesh.firstTriangle;
-			return false;
-		}
-	}
+	geometry.lastTriangle = objectBuffer.numTriangles - 1;
+	geometry.lastVertex = static_cast<int>(objectBuffer.vertices.size()) - 1;
+	objectBuffer.geometries.push_back(geometry);
+	objectBuffer.changes.vertices.add(geometry.firstVertex, geometry.lastVertex);
 
-	printf("Loaded mesh with %d triangles\n", currentIndex / 3);
+	printf("Loaded mesh with %d triangles and %d vertices\n", static_cast<int>(obj.indices.size() / 3), static_cast<int>(obj.vertices.size()));
 	printf("Currently %d triangles in total\n", objectBuffer.numTriangles);
 
-	mesh.lastTriangle = objectBuffer.numTriangles - 1;
+	Instance instance;
+	instance.transform = glm::mat4(1.0f);
+	instance.inverseTransform = glm::mat4(1.0f);
+	instance.geometry = static_cast<int>(objectBuffer.geometries.size()) - 1;
+	instance.material = material;
+	objectBuffer.instances.push_back(instance);
+	objectBuffer.numInstances = static_cast<int>(objectBuffer.instances.size());
+	objectBuffer.changes.instances = true;
+
+	mesh.instance = objectBuffer.numInstances - 1;
 	mesh.wasLoaded = true;
 	mesh.center = glm::vec3(0.f);
+}
 
+bool loadMesh(ObjectBuffer& objectBuffer, const char* path, Mesh& mesh) {
+	
+	mesh.wasLoaded = false;
 
-	delete[] vertices;
-	delete[] indices;
+	ObjData obj;
+	if (!loadObj(path, obj)) {
+		return false;
+	}
+
+	addMesh(objectBuffer, obj, mesh);
 
 	return true;
 }
 
-void scaleMesh(ObjectBuffer& objectBuffer, Mesh& mesh, const glm::vec3& scale, const glm::vec3& center = glm::vec3(0.f)) {
+bool instanceMesh(ObjectBuffer& objectBuffer, const Mesh& source, Mesh& mesh) {
+	//Places another copy of a loaded mesh in the scene, sharing its geometry but with a material of its own
 
-	if (!mesh.wasLoaded) return;
+	mesh.wasLoaded = false;
+
+	if (!source.wasLoaded) return false;
 
-	for (int i = mesh.firstTriangle; i <= mesh.lastTriangle; ++i) {
-		objectBuffer.triangles[i].v0 = (objectBuffer.triangles[i].v0 - center) * scale + center;
-		objectBuffer.triangles[i].v1 = (objectBuffer.triangles[i].v1 - center) * scale + center;
-		objectBuffer.triangles[i].v2 = (objectBuffer.triangles[i].v2 - center) * scale + center;
+	Instance instance = objectBuffer.instances[source.instance];
+	if (instance.material >= 0) {
+		instance.material = createMaterial(objectBuffer, objectBuffer.materials[instance.material]);
 	}
+	objectBuffer.instances.push_back(instance);
+	objectBuffer.numInstances = static_cast<int>(objectBuffer.instances.size());
+	objectBuffer.changes.instances = true;
+
+	mesh.instance = objectBuffer.numInstances - 1;
+	mesh.wasLoaded = true;
+	mesh.center = source.center;
 
-	mesh.center = (mesh.center - center) * scale + center;
+	return true;
 }
 
-void translateMesh(ObjectBuffer& objectBuffer, Mesh& mesh, const glm::vec3& translation) {
+void transformMesh(ObjectBuffer& objectBuffer, Mesh& mesh, const glm::mat4& transform) {
+	//Applies `transform` in world space on top of the current transform of the mesh
 
 	if (!mesh.wasLoaded) return;
 
-	for (int i = mesh.firstTriangle; i <= mesh.lastTriangle; ++i) {
-		objectBuffer.triangles[i].v0 += translation;
-		objectBuffer.triangles[i].v1 += translation;
-		objectBuffer.triangles[i].v2 += translation;
-	}
+	Instance& instance = objectBuffer.instances[mesh.instance];
+	instance.transform = transform * instance.transform;
+	instance.inverseTransform = glm::inverse(instance.transform);
+	objectBuffer.changes.instances = true;
 
-	mesh.center += translation;
+	mesh.center = glm::vec3(transform * glm::vec4(mesh.center, 1.0f));
 }
 
-void rotateMesh(ObjectBuffer& objectBuffer, Mesh& mesh, const float angle, const glm::vec3& axis, const glm::vec3& center = glm::vec3(0.f)) {
-
-	if (!mesh.wasLoaded) return;
-
-	glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), angle, axis);
+void scaleMesh(ObjectBuffer& objectBuffer, Mesh& mesh, const glm::vec3& scale, const glm::vec3& center = glm::vec3(0.f)) {
+	//A negative factor mirrors the mesh, its triangles are still hit from the outside since rays are intersected in object space,
+	//only the world space light triangles have their winding turned back, see `buildLights`
+	transformMesh(objectBuffer, mesh, glm::translate(glm::mat4(1.0f), center) * glm::scale(glm::mat4(1.0f), scale) * glm::translate(glm::mat4(1.0f), -center));
+}
 
-	for (int i = mesh.firstTriangle; i <= mesh.lastTriangle; ++i) {
-		objectBuffer.triangles[i].v0 = glm::vec3(rotation * glm::vec4(objectBuffer.triangles[i].v0 - center, 1.0f)) + center;
-		objectBuffer.triangles[i].v1 = glm::vec3(rotation * glm::vec4(objectBuffer.triangles[i].v1 - center, 1.0f)) + center;
-		objectBuffer.triangles[i].v2 = glm::vec3(rotation * glm::vec4(objectBuffer.triangles[i].v2 - center, 1.0f)) + center;
-	}
+void translateMesh(ObjectBuffer& objectBuffer, Mesh& mesh, const glm::vec3& translation) {
+	transformMesh(objectBuffer, mesh, glm::translate(glm::mat4(1.0f), translation));
+}
 
-	mesh.center = glm::vec3(rotation * glm::vec4(mesh.center - center, 1.0f)) + center;
+void rotateMesh(ObjectBuffer& objectBuffer, Mesh& mesh, const float angle, const glm::vec3& axis, const glm::vec3& center = glm::vec3(0.f)) {
+	transformMesh(objectBuffer, mesh, glm::translate(glm::mat4(1.0f), center) * glm::rotate(glm::mat4(1.0f), angle, axis) * glm::translate(glm::mat4(1.0f), -center));
 }
 
 void setMeshMaterial(ObjectBuffer& objectBuffer, Mesh& mesh, const Material& material) {
 
 	if (!mesh.wasLoaded) return;
 
-	for (int i = mesh.firstTriangle; i <= mesh.lastTriangle; ++i) {
-		objectBuffer.triangles[i].material = material;
+	Instance& instance = objectBuffer.instances[mesh.instance];
+	if (instance.material < 0) {
+		instance.material = createMaterial(objectBuffer, material);
+		objectBuffer.changes.instances = true;
+	}
+	else {
+		objectBuffer.materials[instance.material] = material;
+		objectBuffer.changes.materials.add(instance.material);
 	}
 }
 
 void setMeshColor(ObjectBuffer& objectBuffer, Mesh& mesh, const glm::vec3& color) {
 
-	if (!mesh.wasLoaded) return;
+	if (!mesh.wasLoaded || objectBuffer.instances[mesh.instance].material < 0) return;
 
-	for (int i = mesh.firstTriangle; i <= mesh.lastTriangle; ++i) {
-		objectBuffer.triangles[i].material.color = color;
-	}
+	const int material = objectBuffer.instances[mesh.instance].material;
+	objectBuffer.materials[material].color = color;
+	objectBuffer.changes.materials.add(material);
 }
 
 void setMeshSmoothness(ObjectBuffer& objectBuffer, Mesh& mesh, const float smoothness) {
 
-	if (!mesh.wasLoaded) return;
+	if (!mesh.wasLoaded || objectBuffer.instances[mesh.instance].material < 0) return;
 
-	for (int i = mesh.firstTriangle; i <= mesh.lastTriangle; ++i) {
-		objectBuffer.triangles[i].material.smoothness = smoothness;
-	}
+	const int material = objectBuffer.instances[mesh.instance].material;
+	objectBuffer.materials[material].smoothness = smoothness;
+	objectBuffer.changes.materials.add(material);
 }
 
 void setMeshEmission(ObjectBuffer& objectBuffer, Mesh& mesh, const glm::vec4& emission) {
 
-	if (!mesh.wasLoaded) return;
+	if (!mesh.wasLoaded || objectBuffer.instances[mesh.instance].material < 0) return;
 
-	for (int i = mesh.firstTriangle; i <= mesh.lastTriangle; ++i) {
-		objectBuffer.triangles[i].material.emission = emission;
-	}
+	const int material = objectBuffer.instances[mesh.instance].material;
+	objectBuffer.materials[material].emission = emission;
+	objectBuffer.changes.materials.add(material);
 }
 
-int getMeshOf(const int ROIndex, const ObjectBuffer& objectBuffer, const Mesh* meshes, const int numMeshes) {
+int getMeshOf(const int ROIndex, const Mesh* meshes, const int numMeshes) {
 
 	for (int i = 0; i < numMeshes; ++i) {
-		if (meshes[i].firstTriangle <= ROIndex && meshes[i].lastTriangle >= ROIndex) {
+		if (meshes[i].wasLoaded && meshes[i].instance == ROIndex) {
 			return i;
 		}
 	}
@@ -215,20 +195,20 @@ int getMeshOf(const int ROIndex, const ObjectBuffer& objectBuffer, const Mesh* m
 	
 }
 
-bool isTriangle(const int ROIndex, const ObjectBuffer& objectBuffer) {
-	return ROIndex >= MAX_SPHERES && ROIndex < MAX_SPHERES + MAX_TRIANGLES;
+bool isInstance(const int ROIndex, const ObjectBuffer& objectBuffer) {
+	return ROIndex >= objectBuffer.numSpheres && ROIndex < objectBuffer.numSpheres + objectBuffer.numInstances;
 }
 
-int getSelection(const ObjectBuffer& objectBuffer, Mesh* const meshes, const int numMeshes, const glm::vec2 mousePos) {
+int getSelection(const ObjectBuffer& objectBuffer, const BVH& bvh, Mesh* const meshes, const int numMeshes, const glm::vec2 mousePos) {
 
-	const int clicked = getROIndexAt(mousePos, objectBuffer);
+	const int clicked = getROIndexAt(mousePos, objectBuffer, bvh);
 
 	if (clicked < 0) return -1;
 
-	if (isTriangle(clicked, objectBuffer)) {
-		const int meshIndex = getMeshOf(clicked - MAX_SPHERES, objectBuffer, meshes, numMeshes);
+	if (isInstance(clicked, objectBuffer)) {
+		const int meshIndex = getMeshOf(clicked - objectBuffer.numSpheres, meshes, numMeshes);
 		if (meshIndex < 0) return -1;
-		return meshIndex + MAX_SPHERES;
+		return meshIndex + objectBuffer.numSpheres;
 	}
 
 	return clicked;
@@ -237,11 +217,12 @@ int getSelection(const ObjectBuffer& objectBuffer, Mesh* const meshes, const int
 void translateObject(ObjectBuffer& objectBuffer, Mesh* const meshes, const int index, const glm::vec3& translation) {
 
 	if (index >= 0) {
-		if (index < MAX_SPHERES) {
+		if (index < objectBuffer.numSpheres) {
 			objectBuffer.spheres[index].center += translation;
+			objectBuffer.changes.spheres.add(index);
 		}
 		else {
-			translateMesh(objectBuffer, meshes[index - MAX_SPHERES], translation);
+			translateMesh(objectBuffer, meshes[index - objectBuffer.numSpheres], translation);
 		}
 	}
 }
@@ -249,11 +230,12 @@ void translateObject(ObjectBuffer& objectBuffer, Mesh* const meshes, const int i
 void setObjectColor(ObjectBuffer& objectBuffer, Mesh* const meshes, const int index, const glm::vec3& color) {
 
 	if (index >= 0) {
-		if (index < MAX_SPHERES) {
+		if (index < objectBuffer.numSpheres) {
 			objectBuffer.spheres[index].material.color = color;
+			objectBuffer.changes.spheres.add(index);
 		}
 		else {
-			setMeshColor(objectBuffer, meshes[index - MAX_SPHERES], color);
+			setMeshColor(objectBuffer, meshes[index - objectBuffer.numSpheres], color);
 		}
 	}
 }
\ No newline at end of file
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define RENDERER_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
+
+/*
+	Instruction set of the CPU kernels:
+		- The SIMD kernels are compiled for several instruction sets next to each other, whatever the build targets,
+		  GCC and Clang need the `TARGET_*` attributes for that, MSVC allows the intrinsics anywhere
+		- The best instruction set the CPU (and the operating system) supports is picked once at startup from CPUID
+		- `RENDERER_ISA=scalar|sse4.2|avx2|avx512` forces a lower one, e.g. to compare them in benchmarks
+*/
+
+#if defined(RENDERER_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2")))
+#else
+#define TARGET_SSE42
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+enum class CpuISA {
+	Scalar,
+	SSE42,
+	AVX2,
+	AVX512
+};
+
+const char* cpuISAName(const CpuISA isa) {
+	switch (isa) {
+	case CpuISA::SSE42: return "sse4.2";
+	case CpuISA::AVX2: return "avx2";
+	case CpuISA::AVX512: return "avx512";
+	default: return "scalar";
+	}
+}
+
+CpuISA detectCpuISA() {
+	//Returns the best instruction set the CPU supports and the operating system saves the registers of
+
+#ifdef RENDERER_X86
+	unsigned int registers[4]; // eax, ebx, ecx, edx
+
+	auto cpuid = [&](const unsigned int leaf) {
+#ifdef _MSC_VER
+		__cpuidex(reinterpret_cast<int*>(registers), leaf, 0);
+#else
+		__cpuid_count(leaf, 0, registers[0], registers[1], registers[2], registers[3]);
+#endif
+	};
+
+	cpuid(0);
+	const unsigned int maxLeaf = registers[0];
+
+	cpuid(1);
+	const bool sse42 = registers[2] & (1u << 20);
+	const bool osxsave = registers[2] & (1u << 27);
+	const bool avx = registers[2] & (1u << 28);
+
+	if (!sse42) return CpuISA::Scalar;
+	if (!osxsave || !avx || maxLeaf < 7) return CpuISA::SSE42;
+
+	//Which registers the operating system saves on a context switch: XMM and YMM (bits 1, 2), and for AVX-512 also the opmask and ZMM registers (bits 5 to 7)
+#ifdef _MSC_VER
+	const unsigned long long xcr0 = _xgetbv(0);
+#else
+	unsigned int xcr0Low, xcr0High;
+	__asm__ volatile("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+	const unsigned long long xcr0 = (static_cast<unsigned long long>(xcr0High) << 32) | xcr0Low;
+#endif
+
+	if ((xcr0 & 0x06) != 0x06) return CpuISA::SSE42;
+
+	cpuid(7);
+	const bool avx2 = registers[1] & (1u << 5);
+	const bool avx512 = registers[1] & (1u << 16);
+
+	if (!avx2) return CpuISA::SSE42;
+	if (avx512 && (xcr0 & 0xE6) == 0xE6) return CpuISA::AVX512;
+
+	return CpuISA::AVX2;
+#else
+	return CpuISA::Scalar;
+#endif
+}
+
+CpuISA selectCpuISA() {
+
+	const CpuISA detected = detectCpuISA();
+
+	const char* forced = std::getenv("RENDERER_ISA");
+	if (!forced || !*forced) return detected;
+
+	for (const CpuISA isa : { CpuISA::Scalar, CpuISA::SSE42, CpuISA::AVX2, CpuISA::AVX512 }) {
+		if (std::strcmp(forced, cpuISAName(isa)) != 0) continue;
+
+		if (isa > detected) {
+			std::cerr << "Warning: RENDERER_ISA=" << forced << " is not supported by this CPU, using " << cpuISAName(detected) << "\n";
+			return detected;
+		}
+		return isa;
+	}
+
+	std::cerr << "Warning: Unknown RENDERER_ISA=" << forced << ", expected scalar, sse4.2, avx2 or avx512, using " << cpuISAName(detected) << "\n";
+	return detected;
+}
+
+const CpuISA cpuISA = selectCpuISA(); // Picked once at startup, every kernel dispatches on it
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include "TileScheduler.h"
+
+/*
+	Edge avoiding à-trous wavelet filter (Dammertz et al. 2010), run by exports on the float image before it is written:
+		- Every iteration blurs with a 5x5 B3 spline kernel whose taps are 2^i pixels apart, five iterations cover 125x125 pixels
+		- A tap counts less the more its color, first hit normal, distance and albedo differ from the pixel in the center,
+		  so edges, silhouettes and textures stay sharp while the noise on flat surfaces is averaged away
+		- The color tolerance halves every iteration, what differs after the first ones is detail rather than noise
+		- The features are the first hits of a few jittered primary rays per pixel, rendered by the feature pass of the shader
+		  or by `renderFeatures` on the CPU, they are nearly free of noise
+*/
+
+constexpr int DENOISE_ITERATIONS = 5;
+constexpr int DENOISE_FEATURE_SAMPLES = 8; // Jittered primary rays averaged into the features of a pixel, they antialias the edges
+constexpr int DENOISE_PREVIEW_SAMPLES = 16; // Samples per pixel of a denoised preview export
+
+constexpr float DENOISE_SIGMA_COLOR = 0.5f;
+constexpr float DENOISE_SIGMA_NORMAL = 0.3f;
+constexpr float DENOISE_SIGMA_ALBEDO = 0.1f;
+constexpr float DENOISE_SIGMA_DEPTH = 0.02f; // Relative to the distance of the pixel, per pixel between the taps
+
+//First hit features of an image, bottom row first like the image
+struct Features {
+	std::vector<glm::vec4> albedo; // Color of the material in rgb, alpha is unused
+	std::vector<glm::vec4> normalDepth; // World space normal and distance from the camera, 0 where nothing was hit
+};
+
+void denoise(std::vector<glm::vec3>& image, const Features& features, const int width, const int height) {
+
+	const float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+	std::vector<glm::vec3> filtered(image.size());
+
+	for (int iteration = 0; iteration < DENOISE_ITERATIONS; ++iteration) {
+
+		const int step = 1 << iteration;
+		const float colorSigma = DENOISE_SIGMA_COLOR / float(step);
+
+		const float colorFactor = 1.0f / (colorSigma * colorSigma);
+		const float normalFactor = 1.0f / (DENOISE_SIGMA_NORMAL * DENOISE_SIGMA_NORMAL);
+		const float albedoFactor = 1.0f / (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO);
+
+		scheduleTiles(width, height, 64, 16, [&](const Tile& tile) {
+			for (int y = tile.y; y < tile.y + tile.height; ++y) {
+				for (int x = tile.x; x < tile.x + tile.width; ++x) {
+
+					const int center = y * width + x;
+					const glm::vec3 color = image[center];
+					const glm::vec3 albedo = glm::vec3(features.albedo[center]);
+					const glm::vec4 normalDepth = features.normalDepth[center];
+					const float depthFactor = 1.0f / (DENOISE_SIGMA_DEPTH * normalDepth.w * step + 1e-4f);
+
+					glm::vec3 sum = glm::vec3(0.0f);
+					float weights = 0.0f;
+
+					for (int dy = -2; dy <= 2; ++dy) {
+						const int tapY = y + dy * step;
+						if (tapY < 0 || tapY >= height) continue;
+
+						for (int dx = -2; dx <= 2; ++dx) {
+							const int tapX = x + dx * step;
+							if (tapX < 0 || tapX >= width) continue;
+
+							const int tap = tapY * width + tapX;
+							const glm::vec3 colorDifference = image[tap] - color;
+							const glm::vec3 albedoDifference = glm::vec3(features.albedo[tap]) - albedo;
+							const glm::vec4 normalDepthDifference = features.normalDepth[tap] - normalDepth;
+							const glm::vec3 normalDifference = glm::vec3(normalDepthDifference);
+
+							const float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)] * std::exp(
+								-glm::dot(colorDifference, colorDifference) * colorFactor
+								- glm::dot(normalDifference, normalDifference) * normalFactor
+								- glm::dot(albedoDifference, albedoDifference) * albedoFactor
+								- std::abs(normalDepthDifference.w) * depthFactor);
+
+							sum += image[tap] * weight;
+							weights += weight;
+						}
+					}
+
+					//The center tap always has a weight, so `weights` is never 0
+					filtered[center] = sum / weights;
+				}
+			}
+		});
+
+		image.swap(filtered);
+	}
+}
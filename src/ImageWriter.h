@@ -0,0 +1,139 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Profiler.h"
+
+/*
+	Background image writer, exports hand their image over and go on while it is encoded and written:
+		- The float image is converted to 8 bits on the calling thread, that is quick, encoding the PNG takes seconds for 8K and
+		  runs on the writer thread
+		- At most IMAGE_WRITER_QUEUE images wait to be written, a full queue blocks the next image, so exports that are faster than
+		  the disk can't pile up gigabytes of images
+		- The thread is started by the first image, `stopImageWriter` writes what is still queued and ends it
+		- The images that were written, or failed to, are collected with `takeWrittenImages` under the tag they were queued with
+*/
+
+constexpr size_t IMAGE_WRITER_QUEUE = 2; // 8K images are 100 MB each
+
+struct QueuedImage {
+	std::string filename;
+	int width;
+	int height;
+	std::vector<unsigned char> data; // RGB, bottom row first like the float image
+	int tag;
+};
+
+struct WrittenImage {
+	std::string filename;
+	int tag;
+	bool written; // False if the file couldn't be written
+};
+
+struct ImageWriter {
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable changed; // Of the queue, `busy` and `stopping`
+	std::deque<QueuedImage> queue;
+	std::vector<WrittenImage> written; // Since the last `takeWrittenImages`
+	bool busy = false; // Writing an image taken from the queue
+	bool stopping = false;
+};
+
+ImageWriter imageWriter;
+
+void runImageWriter(ImageWriter& writer) {
+
+	if (profilerEnabled) nameProfileThread("image writer");
+
+	//Only this thread writes images, so the global flag of stb is safe
+	stbi_flip_vertically_on_write(true);
+
+	for (;;) {
+		QueuedImage image;
+		{
+			std::unique_lock<std::mutex> lock(writer.mutex);
+			writer.changed.wait(lock, [&writer] { return !writer.queue.empty() || writer.stopping; });
+			if (writer.queue.empty()) return;
+
+			image = std::move(writer.queue.front());
+			writer.queue.pop_front();
+			writer.busy = true;
+		}
+		writer.changed.notify_all();
+
+		bool written;
+		{
+			ProfileScope scope("encode");
+			written = stbi_write_png(image.filename.c_str(), image.width, image.height, 3, image.data.data(), image.width * 3) != 0;
+		}
+
+		if (written) {
+			std::cout << "Render exported to " << image.filename << std::endl;
+		}
+		else {
+			std::cerr << "Error: Could not write " << image.filename << "\n";
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(writer.mutex);
+			writer.written.push_back(WrittenImage{ image.filename, image.tag, written });
+			writer.busy = false;
+		}
+		writer.changed.notify_all();
+	}
+}
+
+void queueImage(ImageWriter& writer, const std::vector<glm::vec3>& image, const glm::u16vec2 resolution, const std::string& filename, const int tag = -1) {
+	//Converts the image and queues it for writing, waits if the queue is full
+
+	QueuedImage queued{ filename, resolution.x, resolution.y, std::vector<unsigned char>(static_cast<size_t>(resolution.x) * resolution.y * 3), tag };
+	{
+		ProfileScope scope("convert");
+		convertImage(image, queued.data.data());
+	}
+
+	std::unique_lock<std::mutex> lock(writer.mutex);
+
+	if (!writer.thread.joinable()) {
+		writer.stopping = false;
+		writer.thread = std::thread(runImageWriter, std::ref(writer));
+	}
+
+	if (writer.queue.size() >= IMAGE_WRITER_QUEUE) {
+		ProfileScope scope("waitForWriter");
+		writer.changed.wait(lock, [&writer] { return writer.queue.size() < IMAGE_WRITER_QUEUE; });
+	}
+
+	writer.queue.push_back(std::move(queued));
+	lock.unlock();
+	writer.changed.notify_all();
+}
+
+std::vector<WrittenImage> takeWrittenImages(ImageWriter& writer) {
+	std::lock_guard<std::mutex> lock(writer.mutex);
+	std::vector<WrittenImage> written;
+	written.swap(writer.written);
+	return written;
+}
+
+void stopImageWriter(ImageWriter& writer) {
+	//Returns once every queued image is written
+
+	if (!writer.thread.joinable()) return;
+
+	{
+		std::lock_guard<std::mutex> lock(writer.mutex);
+		writer.stopping = true;
+	}
+	writer.changed.notify_all();
+
+	writer.thread.join();
+}
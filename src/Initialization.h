@@ -3,6 +3,124 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
+#include <algorithm>
+
+#include "Profiler.h"
+
+// A buffer texture exposes a buffer object of any size to the shader as a `samplerBuffer`
+struct BufferTexture {
+	GLuint buffer;
+	GLuint texture;
+	GLsizeiptr capacity; // Bytes currently allocated for the buffer
+};
+
+// Scene changes are written to a staging buffer and copied from there into the buffer textures by the GPU
+// The staging buffer is split into segments used round robin, a fence after the copies out of a segment tells when it can be written again
+constexpr int STAGING_SEGMENTS = 3;
+constexpr GLsizeiptr STAGING_SEGMENT_SIZE = 4 << 20;
+
+struct StagingRing {
+	GLuint buffer;
+	char* mapping; // Persistent mapping of the whole buffer, nullptr if ARB_buffer_storage isn't supported
+	GLsync fences[STAGING_SEGMENTS];
+	int segment; // Segment currently written to
+	GLsizeiptr offset; // Bytes already used in the current segment
+};
+
+// Buffer textures holding the scene geometry and the bounding volume hierarchy
+// The texture unit of each one is fixed, see `createSceneBuffers`
+// Only the parts recorded in `ObjectBuffer::changes` and the change ranges of the BVH are uploaded, see `uploadScene`
+struct SceneBuffers {
+	StagingRing staging;
+
+	BufferTexture spheres;
+	BufferTexture vertices;
+	BufferTexture triangles;
+	BufferTexture materials;
+	BufferTexture instances;
+	BufferTexture instanceNodes; // Top level of the BVH
+	BufferTexture bvhNodes; // Bottom level of the BVH
+	BufferTexture bvhIndices;
+	BufferTexture lights; // Emissive spheres and triangles, see Lights.h
+	BufferTexture blueNoise; // Texture of the blue noise sampler, see Sampler.h, it never changes
+};
+
+// An instance as read by the shader, 4 RGBA32F texels
+// Instances are uploaded in the order of the top level leaves, so the leaves can reference them directly
+struct InstanceTexels {
+	glm::vec4 inverseTransform[3]; // First three rows of the world to object matrix
+	int rootNode; // Root of the bottom level tree of the geometry
+	int material;
+	int pad0;
+	int pad1;
+};
+
+// Unit of the texture holding the running average of the last frames
+constexpr GLint ACCUMULATION_TEXTURE_UNIT = 9;
+
+// Two float frame buffers, every frame reads the running average from one and writes the updated average to the other
+struct Accumulation {
+	GLuint frameBuffers[2];
+	GLuint textures[2];
+	int current; // Index of the frame buffer holding the latest average
+	int width;
+	int height;
+};
+
+// GL_TIME_ELAPSED queries for the GPU lane of the profiler, used round robin
+// Their results are only collected once available, a few frames later, so measuring never stalls the pipeline
+// Queries of the same target can't nest, a timer started while another one runs measures nothing
+constexpr int GPU_TIMER_QUERIES = 64;
+
+struct GpuTimers {
+	GLuint queries[GPU_TIMER_QUERIES];
+	const char* names[GPU_TIMER_QUERIES];
+	int64_t starts[GPU_TIMER_QUERIES]; // Profiler time the commands were issued
+	int first = 0; // Oldest query in flight
+	int count = 0; // Queries in flight, when all of them are new timers are dropped instead of waiting
+	bool running = false;
+	int64_t end = 0; // Of the last collected event, the GPU runs the commands one after the other
+};
+
+GpuTimers gpuTimers;
+
+// Frame buffer of the feature pass of exports, the albedo goes to the first texture, the normal and distance to the second
+struct FeatureTarget {
+	GLuint frameBuffer;
+	GLuint textures[2];
+};
+
+// Float read backs of exports go through pixel buffer objects used round robin, the copy to the CPU runs while the GPU goes on
+// A fence after each read tells when its pixels arrived, they are only waited for when the slot is needed again or the export ends
+constexpr int READBACK_SLOTS = 4;
+
+struct ReadbackSlot {
+	GLuint buffer = 0;
+	GLsizeiptr capacity = 0;
+	GLsync fence = NULL; // NULL if no read is in flight
+	float* destination; // Of the first row, the rows are `stride` floats apart
+	int stride;
+	int rowSize; // In bytes
+	int rows;
+};
+
+struct Readback {
+	ReadbackSlot slots[READBACK_SLOTS];
+	int next = 0;
+};
+
+// GL_SAMPLES_PASSED queries counting the pixels the batches of an adaptive export sample, used round robin
+// Like the GPU timers their results are only collected once available, a tile may take a batch or two more than it needs
+constexpr int PIXEL_COUNT_QUERIES = 16;
+
+struct PixelCounts {
+	GLuint queries[PIXEL_COUNT_QUERIES];
+	int numSamples[PIXEL_COUNT_QUERIES]; // Of the counted batch
+	int tiles[PIXEL_COUNT_QUERIES]; // The counted batch belongs to
+	int first = 0; // Oldest query in flight
+	int count = 0; // Queries in flight
+	int convergedTile = -1; // A batch of it sampled no pixel, all of them converged
+};
 
 void createBuffers(ObjectBuffer& objectBuffer, GLuint& VAO, GLuint& VBO, GLuint& EBO, GLuint& UBO, GLuint& UBOIndex, GLuint& shaderProgram) {
 
@@ -44,7 +162,7 @@ void createBuffers(ObjectBuffer& objectBuffer, GLuint& VAO, GLuint& VBO, GLuint&
 	// Generate a uniform buffer object
 	glGenBuffers(1, &UBO);
 	glBindBuffer(GL_UNIFORM_BUFFER, UBO);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(ObjectBuffer), &objectBuffer, GL_DYNAMIC_DRAW);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(UniformData), static_cast<const UniformData*>(&objectBuffer), GL_DYNAMIC_DRAW);
 	
 	// Get the index of the uniform buffer object in the shader program
 	UBOIndex = glGetUniformBlockIndex(shaderProgram, "ObjectBuffer");
@@ -56,6 +174,237 @@ void createBuffers(ObjectBuffer& objectBuffer, GLuint& VAO, GLuint& VBO, GLuint&
 
 }
 
+void createBufferTexture(BufferTexture& bufferTexture, const GLenum format, const GLint textureUnit, const char* samplerName, GLuint& shaderProgram) {
+
+	glGenBuffers(1, &bufferTexture.buffer);
+	glGenTextures(1, &bufferTexture.texture);
+
+	// Buffer textures can't be empty, so there is always room for at least one texel
+	bufferTexture.capacity = 16;
+	glBindBuffer(GL_TEXTURE_BUFFER, bufferTexture.buffer);
+	glBufferData(GL_TEXTURE_BUFFER, bufferTexture.capacity, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	glActiveTexture(GL_TEXTURE0 + textureUnit);
+	glBindTexture(GL_TEXTURE_BUFFER, bufferTexture.texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, format, bufferTexture.buffer);
+	glActiveTexture(GL_TEXTURE0);
+
+	glUniform1i(glGetUniformLocation(shaderProgram, samplerName), textureUnit);
+}
+
+void createStagingRing(StagingRing& ring) {
+
+	const GLsizeiptr size = STAGING_SEGMENTS * STAGING_SEGMENT_SIZE;
+
+	glGenBuffers(1, &ring.buffer);
+	glBindBuffer(GL_COPY_READ_BUFFER, ring.buffer);
+
+	if (GLEW_ARB_buffer_storage) {
+		// Mapped once for the lifetime of the buffer, coherent so writes are visible to copies issued afterwards
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_COPY_READ_BUFFER, size, NULL, flags);
+		ring.mapping = static_cast<char*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, size, flags));
+	}
+	else {
+		glBufferData(GL_COPY_READ_BUFFER, size, NULL, GL_STREAM_DRAW);
+		ring.mapping = nullptr;
+	}
+
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+	for (int i = 0; i < STAGING_SEGMENTS; ++i) {
+		ring.fences[i] = NULL;
+	}
+	ring.segment = 0;
+	ring.offset = 0;
+}
+
+void nextStagingSegment(StagingRing& ring) {
+	//Fences the copies out of the current segment and waits until the GPU is done with the next one
+
+	if (ring.offset == 0) return;
+
+	ring.fences[ring.segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	ring.segment = (ring.segment + 1) % STAGING_SEGMENTS;
+	ring.offset = 0;
+
+	GLsync& fence = ring.fences[ring.segment];
+	if (fence) {
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+		glDeleteSync(fence);
+		fence = NULL;
+	}
+}
+
+void stageCopy(StagingRing& ring, const GLuint destination, GLintptr destinationOffset, const void* data, GLsizeiptr size) {
+	//Copies `size` bytes of `data` to `destination` through the staging ring, in several pieces if it doesn't fit into a segment
+
+	const char* source = static_cast<const char*>(data);
+
+	glBindBuffer(GL_COPY_READ_BUFFER, ring.buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, destination);
+
+	while (size > 0) {
+
+		if (ring.offset == STAGING_SEGMENT_SIZE) {
+			nextStagingSegment(ring);
+		}
+
+		const GLsizeiptr chunk = std::min(size, STAGING_SEGMENT_SIZE - ring.offset);
+		const GLintptr stagingOffset = ring.segment * STAGING_SEGMENT_SIZE + ring.offset;
+
+		if (ring.mapping) {
+			memcpy(ring.mapping + stagingOffset, source, chunk);
+		}
+		else {
+			// The fences already guarantee that the GPU is done with this range, so the driver doesn't have to synchronize
+			void* mapping = glMapBufferRange(GL_COPY_READ_BUFFER, stagingOffset, chunk, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+			memcpy(mapping, source, chunk);
+			glUnmapBuffer(GL_COPY_READ_BUFFER);
+		}
+
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, stagingOffset, destinationOffset, chunk);
+
+		ring.offset += chunk;
+		source += chunk;
+		destinationOffset += chunk;
+		size -= chunk;
+	}
+
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void freeStagingRing(StagingRing& ring) {
+
+	for (int i = 0; i < STAGING_SEGMENTS; ++i) {
+		if (ring.fences[i]) glDeleteSync(ring.fences[i]);
+		ring.fences[i] = NULL;
+	}
+
+	if (ring.mapping) {
+		glBindBuffer(GL_COPY_READ_BUFFER, ring.buffer);
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		ring.mapping = nullptr;
+	}
+
+	glDeleteBuffers(1, &ring.buffer);
+}
+
+template<typename T>
+void uploadBufferTexture(BufferTexture& bufferTexture, StagingRing& staging, const std::vector<T>& data, DirtyRange& changed) {
+	//Uploads the changed elements, or all of them if the buffer had to grow, and clears `changed`
+
+	const GLsizeiptr size = data.size() * sizeof(T);
+
+	if (size > bufferTexture.capacity) {
+		// Grow with some headroom, so adding objects one by one doesn't reallocate every time
+		bufferTexture.capacity = size + size / 2;
+
+		GLint maxTexels;
+		glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+		if (bufferTexture.capacity / 16 > maxTexels) {
+			std::cerr << "Warning: Scene buffer of " << size << " bytes exceeds the maximum buffer texture size of " << maxTexels << " texels\n";
+		}
+
+		glBindBuffer(GL_TEXTURE_BUFFER, bufferTexture.buffer);
+		glBufferData(GL_TEXTURE_BUFFER, bufferTexture.capacity, NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+		// The old contents are gone
+		changed.add(0, static_cast<int>(data.size()) - 1);
+	}
+
+	const int first = std::max(changed.first, 0);
+	const int last = std::min(changed.last, static_cast<int>(data.size()) - 1);
+
+	if (first <= last) {
+		stageCopy(staging, bufferTexture.buffer, first * sizeof(T), &data[first], (last - first + 1) * sizeof(T));
+	}
+
+	changed.clear();
+}
+
+void createSceneBuffers(SceneBuffers& sceneBuffers, GLuint& shaderProgram) {
+	createStagingRing(sceneBuffers.staging);
+
+	// Texture unit 0 is left for regular textures
+	createBufferTexture(sceneBuffers.spheres, GL_RGBA32F, 1, "sceneSpheres", shaderProgram);
+	createBufferTexture(sceneBuffers.vertices, GL_RGBA32F, 2, "sceneVertices", shaderProgram);
+	createBufferTexture(sceneBuffers.triangles, GL_RGBA32I, 3, "sceneTriangles", shaderProgram);
+	createBufferTexture(sceneBuffers.materials, GL_RGBA32F, 4, "sceneMaterials", shaderProgram);
+	createBufferTexture(sceneBuffers.instances, GL_RGBA32F, 5, "sceneInstances", shaderProgram);
+	createBufferTexture(sceneBuffers.instanceNodes, GL_RGBA32F, 6, "instanceNodes", shaderProgram);
+	createBufferTexture(sceneBuffers.bvhNodes, GL_RGBA32F, 7, "bvhNodes", shaderProgram);
+	createBufferTexture(sceneBuffers.bvhIndices, GL_R32I, 8, "bvhIndices", shaderProgram);
+	// Unit 9 is the accumulation texture
+	createBufferTexture(sceneBuffers.lights, GL_RGBA32F, 10, "sceneLights", shaderProgram);
+	createBufferTexture(sceneBuffers.blueNoise, GL_R32F, 11, "blueNoise", shaderProgram);
+
+	const std::vector<float>& noise = blueNoise();
+	sceneBuffers.blueNoise.capacity = noise.size() * sizeof(float);
+	glBindBuffer(GL_TEXTURE_BUFFER, sceneBuffers.blueNoise.buffer);
+	glBufferData(GL_TEXTURE_BUFFER, sceneBuffers.blueNoise.capacity, noise.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void uploadScene(ObjectBuffer& objectBuffer, BVH& bvh, SceneBuffers& sceneBuffers) {
+	//Uploads what changed since the last call, so an unchanged scene costs nothing
+
+	StagingRing& staging = sceneBuffers.staging;
+
+	uploadBufferTexture(sceneBuffers.spheres, staging, objectBuffer.spheres, objectBuffer.changes.spheres);
+	uploadBufferTexture(sceneBuffers.vertices, staging, objectBuffer.vertices, objectBuffer.changes.vertices);
+	uploadBufferTexture(sceneBuffers.triangles, staging, objectBuffer.triangles, objectBuffer.changes.triangles);
+	uploadBufferTexture(sceneBuffers.materials, staging, objectBuffer.materials, objectBuffer.changes.materials);
+	uploadBufferTexture(sceneBuffers.bvhNodes, staging, bvh.bottomLevel.nodes, bvh.changedNodes);
+	uploadBufferTexture(sceneBuffers.bvhIndices, staging, bvh.bottomLevel.indices, bvh.changedIndices);
+	uploadBufferTexture(sceneBuffers.lights, staging, objectBuffer.lights, objectBuffer.changes.lights);
+
+	//The top level is rebuilt as a whole, the instances are stored in the order of its leaves
+	if (bvh.topLevelChanged) {
+
+		std::vector<InstanceTexels> instances(bvh.topLevel.indices.size());
+		for (size_t i = 0; i < instances.size(); ++i) {
+			const Instance& instance = objectBuffer.instances[bvh.topLevel.indices[i]];
+			const glm::mat4 rows = glm::transpose(instance.inverseTransform);
+			instances[i].inverseTransform[0] = rows[0];
+			instances[i].inverseTransform[1] = rows[1];
+			instances[i].inverseTransform[2] = rows[2];
+			instances[i].rootNode = bvh.roots[instance.geometry];
+			instances[i].material = instance.material;
+		}
+
+		DirtyRange allInstances, allNodes;
+		allInstances.add(0, static_cast<int>(instances.size()) - 1);
+		allNodes.add(0, static_cast<int>(bvh.topLevel.nodes.size()) - 1);
+
+		uploadBufferTexture(sceneBuffers.instances, staging, instances, allInstances);
+		uploadBufferTexture(sceneBuffers.instanceNodes, staging, bvh.topLevel.nodes, allNodes);
+
+		bvh.topLevelChanged = false;
+	}
+
+	nextStagingSegment(staging);
+}
+
+void markSceneChanged(ObjectBuffer& objectBuffer, BVH& bvh) {
+	//Marks the whole scene as changed, so the next `uploadScene` replaces whatever scene the buffers held before
+
+	objectBuffer.changes.spheres.add(0, static_cast<int>(objectBuffer.spheres.size()) - 1);
+	objectBuffer.changes.vertices.add(0, static_cast<int>(objectBuffer.vertices.size()) - 1);
+	objectBuffer.changes.triangles.add(0, static_cast<int>(objectBuffer.triangles.size()) - 1);
+	objectBuffer.changes.materials.add(0, static_cast<int>(objectBuffer.materials.size()) - 1);
+	objectBuffer.changes.lights.add(0, static_cast<int>(objectBuffer.lights.size()) - 1);
+
+	bvh.changedNodes.add(0, static_cast<int>(bvh.bottomLevel.nodes.size()) - 1);
+	bvh.changedIndices.add(0, static_cast<int>(bvh.bottomLevel.indices.size()) - 1);
+	bvh.topLevelChanged = true;
+}
+
 void freeBuffers(GLuint& VAO, GLuint& VBO, GLuint& EBO, GLuint& UBO) {
 	glDeleteVertexArrays(1, &VAO);
 	glDeleteBuffers(1, &VBO);
@@ -63,17 +412,307 @@ void freeBuffers(GLuint& VAO, GLuint& VBO, GLuint& EBO, GLuint& UBO) {
 	glDeleteBuffers(1, &UBO);
 }
 
-void initBufferData(ObjectBuffer& objectBuffer, Mesh* const meshes) {
+void freeBufferTexture(BufferTexture& bufferTexture) {
+	glDeleteBuffers(1, &bufferTexture.buffer);
+	glDeleteTextures(1, &bufferTexture.texture);
+}
+
+void freeSceneBuffers(SceneBuffers& sceneBuffers) {
+	freeStagingRing(sceneBuffers.staging);
+	freeBufferTexture(sceneBuffers.spheres);
+	freeBufferTexture(sceneBuffers.vertices);
+	freeBufferTexture(sceneBuffers.triangles);
+	freeBufferTexture(sceneBuffers.materials);
+	freeBufferTexture(sceneBuffers.instances);
+	freeBufferTexture(sceneBuffers.instanceNodes);
+	freeBufferTexture(sceneBuffers.bvhNodes);
+	freeBufferTexture(sceneBuffers.bvhIndices);
+	freeBufferTexture(sceneBuffers.lights);
+	freeBufferTexture(sceneBuffers.blueNoise);
+}
+
+void resizeAccumulation(Accumulation& accumulation, const int width, const int height) {
+
+	for (int i = 0; i < 2; ++i) {
+		glBindTexture(GL_TEXTURE_2D, accumulation.textures[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	accumulation.width = width;
+	accumulation.height = height;
+}
+
+void createAccumulation(Accumulation& accumulation, const int width, const int height, GLuint& shaderProgram) {
+
+	glGenFramebuffers(2, accumulation.frameBuffers);
+	glGenTextures(2, accumulation.textures);
+
+	for (int i = 0; i < 2; ++i) {
+		glBindTexture(GL_TEXTURE_2D, accumulation.textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+
+	resizeAccumulation(accumulation, width, height);
+
+	for (int i = 0; i < 2; ++i) {
+		glBindFramebuffer(GL_FRAMEBUFFER, accumulation.frameBuffers[i]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, accumulation.textures[i], 0);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			std::cerr << "Error: Accumulation frame buffer is not complete!\n";
+		}
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	accumulation.current = 0;
+
+	glUniform1i(glGetUniformLocation(shaderProgram, "accumulation"), ACCUMULATION_TEXTURE_UNIT);
+}
+
+void resetAccumulation(ObjectBuffer& objectBuffer) {
+	//The next frame starts a new running average
+	objectBuffer.frameIndex = 0;
+	objectBuffer.accumulatedSamples = 0;
+}
+
+void freeAccumulation(Accumulation& accumulation) {
+	glDeleteFramebuffers(2, accumulation.frameBuffers);
+	glDeleteTextures(2, accumulation.textures);
+}
+
+void createFeatureTarget(FeatureTarget& target, const int width, const int height) {
+
+	glGenFramebuffers(1, &target.frameBuffer);
+	glGenTextures(2, target.textures);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, target.frameBuffer);
+
+	for (int i = 0; i < 2; ++i) {
+		glBindTexture(GL_TEXTURE_2D, target.textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, target.textures[i], 0);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// fragColor and fragNormalDepth of the shader
+	const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glDrawBuffers(2, drawBuffers);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		std::cerr << "Error: Feature frame buffer is not complete!\n";
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void freeFeatureTarget(FeatureTarget& target) {
+	glDeleteFramebuffers(1, &target.frameBuffer);
+	glDeleteTextures(2, target.textures);
+}
+
+void createReadback(Readback& readback) {
+	for (ReadbackSlot& slot : readback.slots) {
+		glGenBuffers(1, &slot.buffer);
+		slot.capacity = 0;
+		slot.fence = NULL;
+	}
+	readback.next = 0;
+}
+
+bool finishReadback(ReadbackSlot& slot, const bool wait) {
+	//Copies the pixels of the slot to their destination once they arrived, returns false if they didn't and `wait` is false
+
+	if (!slot.fence) return true;
+
+	const GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	if (status == GL_TIMEOUT_EXPIRED) {
+		if (!wait) return false;
+		while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+	}
+
+	glDeleteSync(slot.fence);
+	slot.fence = NULL;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+	const char* pixels = static_cast<const char*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, static_cast<GLsizeiptr>(slot.rowSize) * slot.rows, GL_MAP_READ_BIT));
+
+	if (pixels) {
+		for (int row = 0; row < slot.rows; ++row) {
+			memcpy(slot.destination + static_cast<size_t>(row) * slot.stride, pixels + static_cast<size_t>(row) * slot.rowSize, slot.rowSize);
+		}
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	else {
+		std::cerr << "Error: Could not map a read back buffer\n";
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	return true;
+}
+
+void readPixelsAsync(Readback& readback, const int width, const int height, const GLenum format, float* destination, const int stride) {
+	//Reads the float pixels of the bound read frame buffer into a free slot, `finishReadbacks` copies them to `destination` later
+	//`format` is GL_RGB or GL_RGBA, `stride` is the distance between the rows of `destination` in floats
+
+	ReadbackSlot& slot = readback.slots[readback.next];
+	readback.next = (readback.next + 1) % READBACK_SLOTS;
+
+	//The oldest read is usually done by now
+	finishReadback(slot, true);
+
+	slot.destination = destination;
+	slot.stride = stride;
+	slot.rowSize = width * (format == GL_RGBA ? 4 : 3) * static_cast<int>(sizeof(float));
+	slot.rows = height;
+
+	const GLsizeiptr size = static_cast<GLsizeiptr>(slot.rowSize) * height;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+	if (size > slot.capacity) {
+		slot.capacity = size;
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+	}
+
+	//Tightly packed rows in the buffer, float rows are always aligned to 4 bytes
+	GLint rowLength;
+	glGetIntegerv(GL_PACK_ROW_LENGTH, &rowLength);
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+
+	glReadPixels(0, 0, width, height, format, GL_FLOAT, nullptr);
+
+	glPixelStorei(GL_PACK_ROW_LENGTH, rowLength);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void finishReadbacks(Readback& readback, const bool wait) {
+	//Copies the reads that arrived to their destination, with `wait` all of them
+	for (ReadbackSlot& slot : readback.slots) {
+		finishReadback(slot, wait);
+	}
+}
+
+void freeReadback(Readback& readback) {
+	for (ReadbackSlot& slot : readback.slots) {
+		if (slot.fence) glDeleteSync(slot.fence);
+		slot.fence = NULL;
+		glDeleteBuffers(1, &slot.buffer);
+	}
+}
+
+void createPixelCounts(PixelCounts& counts) {
+	glGenQueries(PIXEL_COUNT_QUERIES, counts.queries);
+	counts.first = 0;
+	counts.count = 0;
+	counts.convergedTile = -1;
+}
+
+void freePixelCounts(PixelCounts& counts) {
+	glDeleteQueries(PIXEL_COUNT_QUERIES, counts.queries);
+}
+
+void createGpuTimers(GpuTimers& timers) {
+	glGenQueries(GPU_TIMER_QUERIES, timers.queries);
+}
+
+bool beginGpuTimer(GpuTimers& timers, const char* name) {
+	//Returns whether the timer started
+
+	if (!profilerEnabled || timers.running || timers.count == GPU_TIMER_QUERIES) return false;
+
+	const int query = (timers.first + timers.count) % GPU_TIMER_QUERIES;
+	timers.names[query] = name;
+	timers.starts[query] = profileNow();
+	glBeginQuery(GL_TIME_ELAPSED, timers.queries[query]);
+	timers.running = true;
+
+	return true;
+}
+
+void endGpuTimer(GpuTimers& timers) {
+	glEndQuery(GL_TIME_ELAPSED);
+	timers.running = false;
+	timers.count++;
+}
+
+void collectGpuTimers(GpuTimers& timers) {
+	//Records the finished queries on the GPU lane of the profiler, in the order they were issued
+	//The GPU only reports durations, an event starts when it was issued or when the one before it ended, whichever is later
+
+	while (timers.count > 0) {
+		const GLuint query = timers.queries[timers.first];
+
+		GLint available = 0;
+		glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) break;
+
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+
+		const int64_t start = std::max(timers.starts[timers.first], timers.end);
+		recordProfileEvent(profileRings().gpu, timers.names[timers.first], start, static_cast<int64_t>(elapsed));
+		timers.end = start + static_cast<int64_t>(elapsed);
+
+		timers.first = (timers.first + 1) % GPU_TIMER_QUERIES;
+		timers.count--;
+	}
+}
+
+void freeGpuTimers(GpuTimers& timers) {
+	glDeleteQueries(GPU_TIMER_QUERIES, timers.queries);
+	timers.first = 0;
+	timers.count = 0;
+}
+
+// Measures the GL commands issued during its lifetime on the GPU lane of the profiler
+struct GpuTimerScope {
+	GpuTimers& timers;
+	bool started;
+
+	GpuTimerScope(GpuTimers& timers, const char* name) : timers(timers), started(beginGpuTimer(timers, name)) {}
+
+	~GpuTimerScope() {
+		if (started) endGpuTimer(timers);
+	}
+
+	GpuTimerScope(const GpuTimerScope&) = delete;
+	GpuTimerScope& operator=(const GpuTimerScope&) = delete;
+};
+
+void initBufferData(ObjectBuffer& objectBuffer) {
 	objectBuffer.resolution = glm::vec2(windowWidth, windowHeight);
 	objectBuffer.numSpheres = 0;
 	objectBuffer.numTriangles = 0;
+	objectBuffer.numInstances = 0;
+	objectBuffer.numLights = 0;
+	objectBuffer.spheres.clear();
+	objectBuffer.vertices.clear();
+	objectBuffer.triangles.clear();
+	objectBuffer.materials.clear();
+	objectBuffer.geometries.clear();
+	objectBuffer.instances.clear();
+	objectBuffer.lights.clear();
+	objectBuffer.changes = SceneChanges();
 
 	objectBuffer.maxBounces = MAX_BOUNCES;
+	objectBuffer.sampler = SAMPLER_BLUE_NOISE; // Exports switch to Sobol points
 	objectBuffer.numSamples = NUM_SAMPLES;
+	objectBuffer.noiseThreshold = 0.0f; // Only exports sample adaptively
+	objectBuffer.featurePass = 0;
+	objectBuffer.countPass = 0;
+	objectBuffer.sampleOffset = 0;
 
 	objectBuffer.jitterStrenght = .9f / windowWidth;
 
 	objectBuffer.noGUI = 0;
+	objectBuffer.frameIndex = 0;
+	objectBuffer.accumulatedSamples = 0;
+	objectBuffer.tileOffset = glm::ivec2(0);
 
 	//Camera facing forward
 	objectBuffer.camera.position = glm::vec3(0.0f, 0.0f, 0.0f);
@@ -83,17 +722,29 @@ void initBufferData(ObjectBuffer& objectBuffer, Mesh* const meshes) {
 
 }
 
-void initGL(GLFWwindow*& window) {
+bool initGL(GLFWwindow*& window, const bool visible = true) {
+	// Batch renders on the GPU still need a context, they get it from a window that is never shown
+	// Returns false if there is no display or no OpenGL 3.3
+
 	// Initialize GLFW library
-	glfwInit();
+	if (!glfwInit()) {
+		std::cerr << "Error: Could not initialize GLFW\n";
+		return false;
+	}
 
 	// Set OpenGL version and profile to use
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
 
 	// Create window and make it the current OpenGL context
 	window = glfwCreateWindow(windowWidth, windowHeight, "OpenGL", nullptr, nullptr);
+	if (!window) {
+		std::cerr << "Error: Could not create an OpenGL 3.3 context\n";
+		glfwTerminate();
+		return false;
+	}
 	glfwMakeContextCurrent(window);
 
 	// Set window callbacks
@@ -114,4 +765,6 @@ void initGL(GLFWwindow*& window) {
 
 	// Set the viewport to the size of the window
 	glViewport(0, 0, windowWidth, windowHeight);
+
+	return true;
 }
\ No newline at end of file
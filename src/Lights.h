@@ -0,0 +1,58 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <utility>
+#include <vector>
+
+/*
+	Light list for next event estimation:
+		- Every sphere and every triangle with an emission is a light, the triangles of instances are transformed to world space
+		- It is derived from the scene like the BVH and rebuilt along with it, whenever a sphere, a material or an instance changed
+		- Instances with an emissive material of their own don't have to be scanned triangle by triangle, only the rest of them does
+		- The layout is exactly four texels of a RGBA32F buffer texture, so it can be uploaded as is and sampled by `trace.frag`
+*/
+
+bool isEmissive(const Material& material) {
+	return material.emission.r > 0.0f || material.emission.g > 0.0f || material.emission.b > 0.0f;
+}
+
+void buildLights(ObjectBuffer& objectBuffer) {
+
+	objectBuffer.lights.clear();
+
+	for (const Sphere& sphere : objectBuffer.spheres) {
+		if (!isEmissive(sphere.material)) continue;
+
+		objectBuffer.lights.push_back(Light{ glm::vec4(sphere.center, sphere.radius), glm::vec4(0.0f), glm::vec4(0.0f), glm::vec4(sphere.material.emission, 0.0f) });
+	}
+
+	for (const Instance& instance : objectBuffer.instances) {
+		if (instance.material >= 0 && !isEmissive(objectBuffer.materials[instance.material])) continue;
+
+		const Geometry& geometry = objectBuffer.geometries[instance.geometry];
+
+		for (int i = geometry.firstTriangle; i <= geometry.lastTriangle; ++i) {
+			const Triangle& triangle = objectBuffer.triangles[i];
+			const Material& material = objectBuffer.materials[instance.material >= 0 ? instance.material : triangle.material];
+
+			if (!isEmissive(material)) continue;
+
+			const glm::vec3 v0 = glm::vec3(instance.transform * glm::vec4(objectBuffer.vertices[triangle.indices.x].position, 1.0f));
+			glm::vec3 v1 = glm::vec3(instance.transform * glm::vec4(objectBuffer.vertices[triangle.indices.y].position, 1.0f));
+			glm::vec3 v2 = glm::vec3(instance.transform * glm::vec4(objectBuffer.vertices[triangle.indices.z].position, 1.0f));
+
+			//A mirroring transform turns the winding around, but not the side the triangle is hit from
+			if (glm::determinant(glm::mat3(instance.transform)) < 0.0f) std::swap(v1, v2);
+
+			const float area = 0.5f * glm::length(glm::cross(v1 - v0, v2 - v0));
+			if (area <= 0.0f) continue;
+
+			objectBuffer.lights.push_back(Light{ glm::vec4(v0, 0.0f), glm::vec4(v1, area), glm::vec4(v2, 0.0f), glm::vec4(material.emission, 0.0f) });
+		}
+	}
+
+	objectBuffer.numLights = static_cast<int>(objectBuffer.lights.size());
+
+	objectBuffer.changes.lights.clear();
+	if (objectBuffer.numLights > 0) objectBuffer.changes.lights.add(0, objectBuffer.numLights - 1);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//A read only view of a whole file, the operating system pages it in on demand instead of copying it through a stream
+struct MappedFile {
+	const char* data = nullptr;
+	size_t size = 0;
+
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int file = -1;
+#endif
+};
+
+void unmapFile(MappedFile& mappedFile) {
+
+#ifdef _WIN32
+	if (mappedFile.data) UnmapViewOfFile(mappedFile.data);
+	if (mappedFile.mapping) CloseHandle(mappedFile.mapping);
+	if (mappedFile.file != INVALID_HANDLE_VALUE) CloseHandle(mappedFile.file);
+	mappedFile.file = INVALID_HANDLE_VALUE;
+	mappedFile.mapping = NULL;
+#else
+	if (mappedFile.data) munmap(const_cast<char*>(mappedFile.data), mappedFile.size);
+	if (mappedFile.file >= 0) close(mappedFile.file);
+	mappedFile.file = -1;
+#endif
+
+	mappedFile.data = nullptr;
+	mappedFile.size = 0;
+}
+
+bool mapFile(const char* path, MappedFile& mappedFile) {
+	//Returns false if the file can't be opened, empty files are mapped to `data == nullptr` and `size == 0`
+
+	unmapFile(mappedFile);
+
+#ifdef _WIN32
+	mappedFile.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (mappedFile.file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mappedFile.file, &size)) {
+		unmapFile(mappedFile);
+		return false;
+	}
+	mappedFile.size = static_cast<size_t>(size.QuadPart);
+
+	if (mappedFile.size == 0) return true;
+
+	mappedFile.mapping = CreateFileMappingA(mappedFile.file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mappedFile.mapping) {
+		unmapFile(mappedFile);
+		return false;
+	}
+
+	mappedFile.data = static_cast<const char*>(MapViewOfFile(mappedFile.mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!mappedFile.data) {
+		unmapFile(mappedFile);
+		return false;
+	}
+#else
+	mappedFile.file = open(path, O_RDONLY);
+	if (mappedFile.file < 0) return false;
+
+	struct stat status;
+	if (fstat(mappedFile.file, &status) != 0) {
+		unmapFile(mappedFile);
+		return false;
+	}
+	mappedFile.size = static_cast<size_t>(status.st_size);
+
+	if (mappedFile.size == 0) return true;
+
+	void* data = mmap(nullptr, mappedFile.size, PROT_READ, MAP_PRIVATE, mappedFile.file, 0);
+	if (data == MAP_FAILED) {
+		mappedFile.size = 0;
+		unmapFile(mappedFile);
+		return false;
+	}
+	mappedFile.data = static_cast<const char*>(data);
+
+	//Files are usually read in full, so start paging everything in right away
+	madvise(data, mappedFile.size, MADV_WILLNEED);
+#endif
+
+	return true;
+}
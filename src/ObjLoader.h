@@ -0,0 +1,300 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "MappedFile.h"
+
+/*
+	Wavefront OBJ loader:
+		- The file is memory mapped and split into one chunk per hardware thread, every chunk starts at the beginning of a line
+		- Every chunk is parsed on its own thread with the hand written number parsers below, then the chunks are stitched together
+		- Only `v` and `f` lines are used, faces can use any of the `v`, `v/vt`, `v//vn` and `v/vt/vn` forms
+		- Negative (relative) indices are resolved against the vertices defined before the face, even across chunks
+		- Polygons are split into a fan of triangles
+		- Malformed `v` and `f` lines are skipped with a warning that names the first one
+*/
+
+constexpr size_t OBJ_MIN_CHUNK_SIZE = 1 << 20; // Smaller files aren't worth the threads
+
+struct ObjData {
+	std::vector<glm::vec3> vertices;
+	std::vector<int> indices; // Three per triangle, zero based
+};
+
+struct ObjChunk {
+	std::vector<glm::vec3> vertices;
+	std::vector<int> indices;
+	std::vector<size_t> relativeIndices; // Positions in `indices` that were negative and still need the vertex offset of the chunk
+	size_t malformedLines = 0;
+	size_t firstMalformedLine = 0; // Counted from 1 within the chunk, 0 if every line was fine
+	size_t lines = 0;
+};
+
+inline bool isLineEnd(const char c) {
+	return c == '\n' || c == '\r';
+}
+
+inline const char* skipSpaces(const char* p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+	return p;
+}
+
+inline const char* skipLine(const char* p, const char* end) {
+	while (p < end && *p != '\n') p++;
+	return p < end ? p + 1 : end;
+}
+
+const char* parseInt(const char* p, const char* end, int& value) {
+	//Returns the position after the number, or nullptr if there is no number or it doesn't fit into an int
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+	if (p >= end || *p < '0' || *p > '9') return nullptr;
+
+	//One more than INT_MAX, so INT_MIN can be written
+	const int64_t limit = static_cast<int64_t>(INT_MAX) + (negative ? 1 : 0);
+
+	int64_t result = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		result = result * 10 + (*p++ - '0');
+		if (result > limit) return nullptr;
+	}
+
+	value = static_cast<int>(negative ? -result : result);
+	return p;
+}
+
+const char* parseFloat(const char* p, const char* end, float& value) {
+	//Returns the position after the number, or nullptr if there is no number
+	//The first 19 significant digits are accumulated as an integer and scaled by a power of ten once, which is exact for typical OBJ values
+
+	static const double powersOfTen[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+	uint64_t mantissa = 0;
+	int significantDigits = 0;
+	int exponent = 0;
+	bool anyDigits = false;
+
+	while (p < end && *p >= '0' && *p <= '9') {
+		if (significantDigits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa) significantDigits++;
+		}
+		else {
+			exponent++;
+		}
+		anyDigits = true;
+		p++;
+	}
+
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && *p >= '0' && *p <= '9') {
+			if (significantDigits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa) significantDigits++;
+				exponent--;
+			}
+			anyDigits = true;
+			p++;
+		}
+	}
+
+	if (!anyDigits) return nullptr;
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		int explicitExponent;
+		const char* next = parseInt(p + 1, end, explicitExponent);
+		if (next) {
+			//Far beyond the range of a float either way, but adding it must not overflow
+			exponent += std::max(-1000, std::min(explicitExponent, 1000));
+			p = next;
+		}
+		else if (p + 1 < end && p[1] >= '0' && p[1] <= '9') {
+			return nullptr; // Too many digits
+		}
+	}
+
+	double result = static_cast<double>(mantissa);
+	if (exponent < 0) {
+		result = exponent >= -22 ? result / powersOfTen[-exponent] : result * std::pow(10.0, exponent);
+	}
+	else if (exponent > 0) {
+		result = exponent <= 22 ? result * powersOfTen[exponent] : result * std::pow(10.0, exponent);
+	}
+
+	value = static_cast<float>(negative ? -result : result);
+	return p;
+}
+
+void parseObjChunk(const char* p, const char* end, ObjChunk& chunk) {
+
+	std::vector<int> polygon;
+
+	const auto skipMalformedLine = [&chunk]() {
+		if (chunk.malformedLines++ == 0) chunk.firstMalformedLine = chunk.lines;
+	};
+
+	while (p < end) {
+
+		chunk.lines++;
+		p = skipSpaces(p, end);
+
+		if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+
+			glm::vec3 vertex;
+			const char* next = p + 2;
+			for (int i = 0; i < 3 && next; ++i) {
+				next = parseFloat(skipSpaces(next, end), end, vertex[i]);
+			}
+
+			if (next) {
+				chunk.vertices.push_back(vertex);
+			}
+			else {
+				skipMalformedLine();
+			}
+		}
+		else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+
+			polygon.clear();
+
+			const char* next = skipSpaces(p + 2, end);
+			while (next < end && !isLineEnd(*next)) {
+
+				int index;
+				next = parseInt(next, end, index);
+				if (!next) break;
+
+				//Indices start at 1, a 0 makes the whole face malformed rather than ending it early
+				if (index == 0) {
+					next = nullptr;
+					break;
+				}
+
+				polygon.push_back(index);
+
+				//Skip the texture coordinate and normal indices
+				while (next < end && *next != ' ' && *next != '\t' && !isLineEnd(*next)) next++;
+				next = skipSpaces(next, end);
+			}
+
+			if (!next || polygon.size() < 3) {
+				skipMalformedLine();
+			}
+			else {
+				const int localVertices = static_cast<int>(chunk.vertices.size());
+
+				for (size_t i = 1; i + 1 < polygon.size(); ++i) {
+					const int corners[3] = { polygon[0], polygon[i], polygon[i + 1] };
+					for (const int index : corners) {
+						if (index < 0) {
+							//Relative to the vertices defined so far, the vertices of the previous chunks are added later
+							chunk.relativeIndices.push_back(chunk.indices.size());
+							chunk.indices.push_back(localVertices + index);
+						}
+						else {
+							chunk.indices.push_back(index - 1);
+						}
+					}
+				}
+			}
+		}
+
+		p = skipLine(p, end);
+	}
+}
+
+bool loadObj(const char* path, ObjData& obj) {
+
+	obj.vertices.clear();
+	obj.indices.clear();
+
+	MappedFile file;
+	if (!mapFile(path, file)) {
+		std::cerr << "Error: Could not open mesh file " << path << "\n";
+		return false;
+	}
+
+	const char* begin = file.data;
+	const char* end = file.data + file.size;
+
+	const size_t maxChunks = std::max(1u, std::thread::hardware_concurrency());
+	const size_t numChunks = std::max<size_t>(1, std::min(maxChunks, file.size / OBJ_MIN_CHUNK_SIZE));
+
+	//Every chunk starts right after a line break, so no line is split between two chunks
+	std::vector<const char*> boundaries(numChunks + 1, end);
+	boundaries[0] = begin;
+	for (size_t i = 1; i < numChunks; ++i) {
+		const char* boundary = std::max(boundaries[i - 1], begin + file.size * i / numChunks);
+		while (boundary < end && boundary[-1] != '\n') boundary++;
+		boundaries[i] = boundary;
+	}
+
+	std::vector<ObjChunk> chunks(numChunks);
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < numChunks; ++i) {
+		threads.emplace_back(parseObjChunk, boundaries[i], boundaries[i + 1], std::ref(chunks[i]));
+	}
+	if (begin) parseObjChunk(boundaries[0], boundaries[1], chunks[0]);
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	unmapFile(file);
+
+	size_t numVertices = 0, numIndices = 0, malformedLines = 0, firstMalformedLine = 0, lines = 0;
+	for (const ObjChunk& chunk : chunks) {
+		numVertices += chunk.vertices.size();
+		numIndices += chunk.indices.size();
+		if (malformedLines == 0 && chunk.malformedLines > 0) firstMalformedLine = lines + chunk.firstMalformedLine;
+		malformedLines += chunk.malformedLines;
+		lines += chunk.lines;
+	}
+
+	if (malformedLines) {
+		std::cerr << "Warning: Skipped " << malformedLines << " malformed lines in mesh file " << path << ", the first one is line " << firstMalformedLine << "\n";
+	}
+
+	obj.vertices.reserve(numVertices);
+	obj.indices.reserve(numIndices);
+
+	for (ObjChunk& chunk : chunks) {
+		const int vertexOffset = static_cast<int>(obj.vertices.size());
+
+		for (const size_t position : chunk.relativeIndices) {
+			chunk.indices[position] += vertexOffset;
+		}
+
+		obj.vertices.insert(obj.vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+		obj.indices.insert(obj.indices.end(), chunk.indices.begin(), chunk.indices.end());
+	}
+
+	for (const int index : obj.indices) {
+		if (index < 0 || index >= static_cast<int>(numVertices)) {
+			std::cerr << "Error: Face references a vertex that does not exist in mesh file " << path << "\n";
+			obj.vertices.clear();
+			obj.indices.clear();
+			return false;
+		}
+	}
+
+	return true;
+}
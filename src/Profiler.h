@@ -0,0 +1,192 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+	Scoped profiler, records how long named parts of a frame or an export took:
+		- A `ProfileScope` records one event from its construction to its destruction, it costs two clock reads and a store while
+		  profiling and a branch otherwise. The names must be string literals, only the pointers are stored
+		- Every thread writes to its own ring of the last PROFILE_RING_EVENTS events, without locks. Every slot has a sequence number
+		  like a seqlock, so a dump skips the events that are overwritten while it reads them instead of writing torn ones. A ring is taken when a thread records
+		  its first event and given back when the thread ends, the worker threads of the next render reuse it, so the rings are bounded
+		  and every ring is a lane in the trace
+		- The GPU has a lane of its own, filled by the timer queries of `GpuTimers` in Initialization.h
+		- `writeProfile` dumps all rings as Chrome trace JSON, open it in chrome://tracing or https://ui.perfetto.dev
+*/
+
+constexpr size_t PROFILE_RING_EVENTS = 1 << 16; // Per thread, a power of two, older events are overwritten
+
+bool profilerEnabled = false; // Set before the first event, scopes record nothing while it is false
+
+//The fields are atomics, a dump may read them while the owner of the ring writes them
+struct ProfileEvent {
+	std::atomic<uint64_t> sequence{ 0 }; // 2 * index + 1 while the event with this index is written, 2 * index + 2 once it is complete
+	std::atomic<const char*> name{ nullptr };
+	std::atomic<int64_t> start{ 0 }; // Nanoseconds since the profiler started
+	std::atomic<int64_t> duration{ 0 };
+};
+
+struct ProfileRing {
+	std::vector<ProfileEvent> events = std::vector<ProfileEvent>(PROFILE_RING_EVENTS);
+	std::atomic<uint64_t> written{ 0 }; // Events recorded so far, the slot of the next one is `written % PROFILE_RING_EVENTS`
+	std::string name; // Of the lane in the trace
+};
+
+struct ProfileRings {
+	std::mutex mutex; // Only taken to hand out rings and to dump them
+	std::vector<std::unique_ptr<ProfileRing>> rings;
+	std::vector<ProfileRing*> freeRings; // Of threads that ended
+	ProfileRing gpu; // Only written by the thread that owns the GL context
+	int threads = 0;
+
+	ProfileRings() {
+		gpu.name = "GPU";
+	}
+};
+
+ProfileRings& profileRings() {
+	static ProfileRings rings;
+	return rings;
+}
+
+int64_t profileNow() {
+	static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+//Hands the ring of a thread back once the thread ends
+struct ThreadProfileRing {
+	ProfileRing* ring = nullptr;
+
+	~ThreadProfileRing() {
+		if (!ring) return;
+		ProfileRings& rings = profileRings();
+		std::lock_guard<std::mutex> lock(rings.mutex);
+		rings.freeRings.push_back(ring);
+	}
+};
+
+ProfileRing& threadProfileRing() {
+	static thread_local ThreadProfileRing threadRing;
+	if (threadRing.ring) return *threadRing.ring;
+
+	ProfileRings& rings = profileRings();
+	std::lock_guard<std::mutex> lock(rings.mutex);
+
+	if (!rings.freeRings.empty()) {
+		threadRing.ring = rings.freeRings.back();
+		rings.freeRings.pop_back();
+	}
+	else {
+		rings.rings.push_back(std::make_unique<ProfileRing>());
+		threadRing.ring = rings.rings.back().get();
+		threadRing.ring->name = "thread " + std::to_string(rings.threads++);
+	}
+
+	return *threadRing.ring;
+}
+
+void nameProfileThread(const char* name) {
+	//Names the lane of the calling thread in the trace, threads that take its ring after it ended keep the name
+	ProfileRing& ring = threadProfileRing();
+	std::lock_guard<std::mutex> lock(profileRings().mutex);
+	ring.name = name;
+}
+
+void recordProfileEvent(ProfileRing& ring, const char* name, const int64_t start, const int64_t duration) {
+	//Only the owner of the ring writes to it, `written` publishes the event to `writeProfile`
+	const uint64_t index = ring.written.load(std::memory_order_relaxed);
+	ProfileEvent& event = ring.events[index & (PROFILE_RING_EVENTS - 1)];
+
+	//Odd while the fields change, the fence keeps their stores after it
+	event.sequence.store(2 * index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	event.name.store(name, std::memory_order_relaxed);
+	event.start.store(start, std::memory_order_relaxed);
+	event.duration.store(duration, std::memory_order_relaxed);
+
+	event.sequence.store(2 * index + 2, std::memory_order_release);
+	ring.written.store(index + 1, std::memory_order_release);
+}
+
+struct ProfileScope {
+	const char* name;
+	int64_t start;
+
+	explicit ProfileScope(const char* name) : name(name), start(profilerEnabled ? profileNow() : -1) {}
+
+	~ProfileScope() {
+		if (start >= 0) recordProfileEvent(threadProfileRing(), name, start, profileNow() - start);
+	}
+
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+void writeProfileRing(std::ofstream& file, const ProfileRing& ring, const int lane, bool& first) {
+
+	char entry[256];
+	snprintf(entry, sizeof(entry), "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+		first ? "" : ",", lane, ring.name.c_str());
+	file << entry;
+	first = false;
+
+	//Events written while dumping are left for the next dump, only a ring that wraps around meanwhile loses some
+	const uint64_t written = ring.written.load(std::memory_order_acquire);
+	const uint64_t oldest = written > PROFILE_RING_EVENTS ? written - PROFILE_RING_EVENTS : 0;
+
+	for (uint64_t i = oldest; i < written; ++i) {
+		const ProfileEvent& event = ring.events[i & (PROFILE_RING_EVENTS - 1)];
+
+		//Skipped if the slot already holds a newer event or changes while it is read
+		const uint64_t sequence = event.sequence.load(std::memory_order_acquire);
+		if (sequence != 2 * i + 2) continue;
+
+		const char* name = event.name.load(std::memory_order_relaxed);
+		const int64_t start = event.start.load(std::memory_order_relaxed);
+		const int64_t duration = event.duration.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (event.sequence.load(std::memory_order_relaxed) != sequence) continue;
+
+		//Chrome traces are in microseconds
+		snprintf(entry, sizeof(entry), ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+			name, lane, start * 1e-3, duration * 1e-3);
+		file << entry;
+	}
+}
+
+bool writeProfile(const char* path) {
+	//Dumps the events of every ring as Chrome trace JSON, can be called at any time from any thread
+
+	std::ofstream file(path);
+	if (!file.is_open()) {
+		std::cerr << "Error: Could not write profile " << path << "\n";
+		return false;
+	}
+
+	ProfileRings& rings = profileRings();
+	std::lock_guard<std::mutex> lock(rings.mutex);
+
+	file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+
+	bool first = true;
+	for (size_t i = 0; i < rings.rings.size(); ++i) {
+		writeProfileRing(file, *rings.rings[i], static_cast<int>(i), first);
+	}
+	writeProfileRing(file, rings.gpu, static_cast<int>(rings.rings.size()), first);
+
+	file << "\n]}\n";
+
+	return true;
+}
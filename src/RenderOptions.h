@@ -0,0 +1,118 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+	Options of a render, from the command line of `main` or from a job sent to the render server (see RenderServer.h):
+		--cpu, --gpu                           where the export is traced
+		--headless                             render the export and exit without opening a window, on the CPU unless `--gpu` is passed
+		--serve <socket>                       take render jobs over a Unix domain socket instead, see RenderServer.h
+		--scene <file.scene>                   another scene than the default one, see SceneFile.h
+		--output <image.png>                   where the image is written, named after the settings by default
+		--resolution <width>x<height>, --spp <samples>, --bounces <bounces>
+		--noise-threshold <relative error>     sample adaptively, `--spp` samples per pixel is the budget, what converged pixels save goes to the noisiest
+		--sampler <random|sobol|blue-noise>    where the random numbers of the export come from
+		--denoise                              filter a preview of DENOISE_PREVIEW_SAMPLES samples instead of tracing them all
+		--priority <n>                         jobs of the render server with a higher priority go first
+		--profile <trace.json>                 profile frames and exports, the trace is written with P and at exit
+	The options override the render settings of the scene file, which override the defaults below
+*/
+
+constexpr int DEFAULT_EXPORT_SAMPLES = 1000;
+constexpr int DEFAULT_EXPORT_BOUNCES = 2;
+constexpr glm::u16vec2 DEFAULT_EXPORT_RESOLUTION = glm::u16vec2(7680, 4320);
+
+// Where the export is traced, the CPU backend needs no GPU and can run on headless nodes
+enum class Backend {
+	GPU,
+	CPU
+};
+
+//Negative, 0 and empty values weren't given, `resolveRenderOptions` fills them in
+struct RenderOptions {
+	Backend backend = Backend::GPU;
+	bool backendChosen = false;
+	bool headless = false;
+	std::string servePath;
+	std::string scenePath;
+	std::string outputPath;
+	std::string profilePath;
+	glm::u16vec2 resolution = glm::u16vec2(0);
+	int samples = 0;
+	bool samplesChosen = false;
+	int bounces = 0;
+	float noiseThreshold = -1.0f;
+	int sampler = -1;
+	bool denoise = false;
+	int priority = 0;
+};
+
+bool parseRenderOptions(const std::vector<std::string>& arguments, RenderOptions& options) {
+	//Returns false with an error if an option is unknown or its value is invalid
+
+	for (size_t i = 0; i < arguments.size(); ++i) {
+		const std::string& option = arguments[i];
+		const bool hasValue = i + 1 < arguments.size();
+
+		if (option == "--cpu" || option == "--gpu") {
+			options.backend = option == "--cpu" ? Backend::CPU : Backend::GPU;
+			options.backendChosen = true;
+		}
+		else if (option == "--headless") options.headless = true;
+		else if (option == "--denoise") options.denoise = true;
+		else if (option == "--serve" && hasValue) options.servePath = arguments[++i];
+		else if (option == "--scene" && hasValue) options.scenePath = arguments[++i];
+		else if (option == "--output" && hasValue) options.outputPath = arguments[++i];
+		else if (option == "--profile" && hasValue) options.profilePath = arguments[++i];
+		else if (option == "--spp" && hasValue) {
+			options.samples = std::atoi(arguments[++i].c_str());
+			options.samplesChosen = options.samples > 0;
+		}
+		else if (option == "--bounces" && hasValue) options.bounces = std::atoi(arguments[++i].c_str());
+		else if (option == "--priority" && hasValue) options.priority = std::atoi(arguments[++i].c_str());
+		else if (option == "--noise-threshold" && hasValue) options.noiseThreshold = static_cast<float>(std::atof(arguments[++i].c_str()));
+		else if (option == "--resolution" && hasValue) {
+			const std::string& resolution = arguments[++i];
+			int width = 0, height = 0;
+			if (std::sscanf(resolution.c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0 || width > 65535 || height > 65535) {
+				std::cerr << "Error: Invalid resolution " << resolution << ", expected <width>x<height>\n";
+				return false;
+			}
+			options.resolution = glm::u16vec2(width, height);
+		}
+		else if (option == "--sampler" && hasValue) {
+			const std::string& name = arguments[++i];
+			options.sampler = samplerFromName(name.c_str());
+			if (options.sampler < 0) {
+				std::cerr << "Error: Unknown sampler " << name << ", expected random, sobol or blue-noise\n";
+				return false;
+			}
+		}
+		else {
+			std::cerr << "Error: Unknown option " << option << (hasValue ? "" : " or it is missing its value") << "\n";
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void resolveRenderOptions(RenderOptions& options, const RenderSettings& settings) {
+	//Fills in what the options don't say from the render settings of the scene, then from the defaults
+
+	if (options.samples <= 0) options.samples = settings.samples > 0 ? settings.samples : DEFAULT_EXPORT_SAMPLES;
+	if (options.bounces <= 0) options.bounces = settings.bounces > 0 ? settings.bounces : DEFAULT_EXPORT_BOUNCES;
+	if (options.resolution.x == 0) options.resolution = settings.resolution.x > 0 ? settings.resolution : DEFAULT_EXPORT_RESOLUTION;
+	if (options.sampler < 0) options.sampler = settings.sampler >= 0 ? settings.sampler : SAMPLER_SOBOL;
+	if (options.noiseThreshold < 0.0f) options.noiseThreshold = std::max(settings.noiseThreshold, 0.0f);
+	options.denoise |= settings.denoise;
+
+	//A denoised preview doesn't need the samples of a full render, unless they were asked for
+	if (options.denoise && !options.samplesChosen) options.samples = std::min(options.samples, DENOISE_PREVIEW_SAMPLES);
+}
@@ -0,0 +1,419 @@
+#pragma once
+
+#ifndef _WIN32
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "RenderOptions.h"
+
+/*
+	Render server, a long lived process that takes render jobs over a Unix domain socket, so a pipeline can queue many small renders
+	without paying for the start of a process, the GL context, the shader and the scene every time:
+		- Clients send one command per line:
+			render <options>    queues a job, the options are the ones of the command line, see RenderOptions.h, `--priority <n>` orders the jobs
+			cancel <id>         drops a queued or running job, once its image is being written it is too late and the job still ends with `done`
+			shutdown            takes no more jobs and exits once the queued ones are done
+		- The server answers on the connection that sent the job, one line per event:
+			queued <id>, started <id>, progress <id> <percent>, preempted <id> by <id>, resumed <id>, done <id> <image>,
+			failed <id> <reason>, cancelled <id>, and `error <message>` for commands it doesn't understand
+		- Jobs run in slices of a few samples per pixel, between them the socket is polled and a job with a higher priority takes over,
+		  the preempted job goes on where it stopped once it is the most important one again. Jobs of the same priority run in order
+		- The slices of a job continue the sample sequence (see `sampleOffset`), so with the Sobol and blue noise samplers the image
+		  is the one a single export would render, up to rounding
+		- The last SERVER_WARM_SCENES scenes stay loaded, a scene whose file or meshes changed on disk is loaded again, changes are
+		  found by hashing the contents of the files like the scene cache does, so edits within the same second aren't missed
+		- A finished job is done once the image writer wrote its image (see ImageWriter.h), the next job renders meanwhile
+		- Jobs outlive their connection, their image is still written
+		- The sockets of the clients never block, their messages are buffered and sent from `pollRenderServer`, a client that stops
+		  reading can't stall the renders
+*/
+
+constexpr int SERVER_WARM_SCENES = 4; // Scenes kept loaded, the least recently used one is dropped
+constexpr int SERVER_MAX_LINE = 4096; // Longer commands are refused and the connection is closed
+constexpr int SERVER_WRITE_POLL_MILLISECONDS = 20; // How often written images are checked for while nothing renders
+constexpr size_t SERVER_MAX_OUTPUT = 1 << 20; // Messages a client didn't read yet, a client that falls further behind is dropped
+
+struct ServerClient {
+	int socket;
+	std::string input; // Received but not yet complete line
+	std::string output; // Messages not yet sent
+	bool closing = false; // Closed once `output` is sent, nothing more is read or queued
+};
+
+struct WarmScene;
+
+struct ServerJob {
+	int id;
+	int client; // Socket of the connection that queued the job, -1 once it closed
+	RenderOptions options; // Resolved against the settings of the scene once the job starts
+	uint64_t order; // Of arrival, jobs with the same priority run first come first served
+
+	bool started = false;
+	std::shared_ptr<WarmScene> scene; // Of the first slice, pins the scene so the job never sees another version of it
+	std::vector<glm::vec3> image; // Average of the slices so far
+	int samplesDone = 0;
+	bool writing = false; // Rendered, the image writer has its image
+};
+
+struct RenderServer {
+	int socket = -1;
+	std::string path;
+	std::vector<ServerClient> clients;
+	std::vector<std::unique_ptr<ServerJob>> jobs;
+	int nextJobId = 1;
+	uint64_t nextOrder = 0;
+	bool shuttingDown = false;
+	Backend backend = Backend::CPU; // Of the server, jobs can only ask for the GPU if the server has a context
+	bool hasGL = false;
+};
+
+//A scene kept loaded between jobs, with everything the renderer needs of it
+struct WarmScene {
+	std::string path;
+	uint64_t key; // Content hash of the scene file and its meshes when it was loaded, see `hashScene`
+	uint64_t lastUsed;
+	ObjectBuffer objectBuffer;
+	BVH bvh;
+	std::vector<Mesh> meshes;
+	RenderSettings settings;
+};
+
+//Scenes are shared with the jobs that render them, a scene a job holds on to is pinned and never dropped
+struct WarmScenes {
+	std::vector<std::shared_ptr<WarmScene>> scenes;
+	uint64_t uses = 0;
+};
+
+std::shared_ptr<WarmScene> acquireScene(WarmScenes& warm, const std::string& path) {
+	//Returns the loaded scene at `path`, loading it again if the file or one of its meshes changed since it was loaded
+	//A changed scene that is still pinned stays with its jobs, only new jobs get the new version
+	//Returns nullptr if the scene can't be loaded
+
+	uint64_t key;
+	if (!hashScene(path.c_str(), key)) return nullptr;
+
+	const auto found = std::find_if(warm.scenes.begin(), warm.scenes.end(), [&](const std::shared_ptr<WarmScene>& scene) { return scene->path == path; });
+
+	if (found != warm.scenes.end()) {
+		if ((*found)->key == key) {
+			(*found)->lastUsed = ++warm.uses;
+			return *found;
+		}
+		warm.scenes.erase(found);
+	}
+
+	std::shared_ptr<WarmScene> scene = std::make_shared<WarmScene>();
+	scene->path = path;
+	scene->lastUsed = ++warm.uses;
+
+	//The key of the files that were loaded, they may have changed again since they were hashed above
+	initBufferData(scene->objectBuffer);
+	if (!loadScene(path.c_str(), scene->objectBuffer, scene->bvh, scene->meshes, scene->settings, &scene->key)) return nullptr;
+
+	//The least recently used scene that no job holds goes, if all are pinned there are more than SERVER_WARM_SCENES for a while
+	if (static_cast<int>(warm.scenes.size()) >= SERVER_WARM_SCENES) {
+		auto oldest = warm.scenes.end();
+		for (auto it = warm.scenes.begin(); it != warm.scenes.end(); ++it) {
+			if (it->use_count() == 1 && (oldest == warm.scenes.end() || (*it)->lastUsed < (*oldest)->lastUsed)) oldest = it;
+		}
+		if (oldest != warm.scenes.end()) warm.scenes.erase(oldest);
+	}
+
+	warm.scenes.push_back(scene);
+	return scene;
+}
+
+bool socketInUse(const sockaddr_un& address) {
+	//Whether a server accepts connections on the socket at `address`
+
+	const int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe < 0) return false;
+	const bool connected = ::connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+	::close(probe);
+	return connected;
+}
+
+bool openRenderServer(RenderServer& server, const std::string& path) {
+	//Listens on the Unix domain socket at `path`, the socket file of a server that is gone is replaced
+	//Returns false with an error if another server listens there or the path is taken by something else than a socket
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		std::cerr << "Error: Socket path " << path << " is too long\n";
+		return false;
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	struct stat status;
+	if (::lstat(path.c_str(), &status) == 0) {
+		if (!S_ISSOCK(status.st_mode)) {
+			std::cerr << "Error: " << path << " exists and is not a socket\n";
+			return false;
+		}
+		if (socketInUse(address)) {
+			std::cerr << "Error: Another render server listens on " << path << "\n";
+			return false;
+		}
+		::unlink(path.c_str());
+	}
+
+	server.socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server.socket < 0) {
+		std::cerr << "Error: Could not create a socket: " << std::strerror(errno) << "\n";
+		return false;
+	}
+
+	if (::bind(server.socket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || ::listen(server.socket, 16) != 0) {
+		std::cerr << "Error: Could not listen on " << path << ": " << std::strerror(errno) << "\n";
+		::close(server.socket);
+		server.socket = -1;
+		return false;
+	}
+
+	server.path = path;
+	return true;
+}
+
+bool flushClient(ServerClient& client) {
+	//Sends what the socket takes without blocking, returns false if the connection broke
+
+	while (!client.output.empty()) {
+		const ssize_t sent = ::send(client.socket, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+		if (sent <= 0) return false;
+		client.output.erase(0, static_cast<size_t>(sent));
+	}
+	return true;
+}
+
+void closeRenderServer(RenderServer& server) {
+
+	//The last messages, like the `done` of the last job, get a moment to go out
+	for (ServerClient& client : server.clients) {
+		timeval timeout = { 1, 0 };
+		::fcntl(client.socket, F_SETFL, ::fcntl(client.socket, F_GETFL) & ~O_NONBLOCK);
+		::setsockopt(client.socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		flushClient(client);
+		::close(client.socket);
+	}
+	server.clients.clear();
+
+	if (server.socket >= 0) {
+		::close(server.socket);
+		::unlink(server.path.c_str());
+		server.socket = -1;
+	}
+}
+
+void sendToClient(RenderServer& server, const int socket, const std::string& line) {
+	//Queues a message, messages to closed connections are dropped, a client that went away doesn't stop its jobs
+
+	const auto client = std::find_if(server.clients.begin(), server.clients.end(), [socket](const ServerClient& client) { return client.socket == socket; });
+	if (client == server.clients.end() || client->closing) return;
+
+	client->output += line;
+	client->output += '\n';
+
+	if (!flushClient(*client)) {
+		client->output.clear();
+		client->closing = true;
+	}
+	else if (client->output.size() > SERVER_MAX_OUTPUT) {
+		std::cerr << "Warning: Dropping a render client that doesn't read its messages\n";
+		client->output.clear();
+		client->closing = true;
+	}
+}
+
+void sendJobStatus(RenderServer& server, const ServerJob& job, const std::string& status) {
+	sendToClient(server, job.client, status + " " + std::to_string(job.id));
+}
+
+ServerJob* findServerJob(RenderServer& server, const int id) {
+	for (const std::unique_ptr<ServerJob>& job : server.jobs) {
+		if (job->id == id) return job.get();
+	}
+	return nullptr;
+}
+
+ServerJob* nextServerJob(RenderServer& server) {
+	//The job to render, the one with the highest priority and the oldest of them, or nullptr if there are none
+	ServerJob* next = nullptr;
+	for (const std::unique_ptr<ServerJob>& job : server.jobs) {
+		if (job->writing) continue;
+		if (!next || job->options.priority > next->options.priority || (job->options.priority == next->options.priority && job->order < next->order)) {
+			next = job.get();
+		}
+	}
+	return next;
+}
+
+void removeServerJob(RenderServer& server, const int id) {
+	server.jobs.erase(std::remove_if(server.jobs.begin(), server.jobs.end(), [id](const std::unique_ptr<ServerJob>& job) { return job->id == id; }), server.jobs.end());
+}
+
+void queueServerJob(RenderServer& server, const int client, const std::string& arguments) {
+
+	std::vector<std::string> words;
+	std::istringstream stream(arguments);
+	for (std::string word; stream >> word;) words.push_back(word);
+
+	std::unique_ptr<ServerJob> job = std::make_unique<ServerJob>();
+	job->options.scenePath = DEFAULT_SCENE_PATH;
+	job->options.backend = server.backend;
+
+	if (!parseRenderOptions(words, job->options)) {
+		sendToClient(server, client, "error invalid render options");
+		return;
+	}
+	if (job->options.headless || !job->options.servePath.empty() || !job->options.profilePath.empty()) {
+		sendToClient(server, client, "error --headless, --serve and --profile are options of the server");
+		return;
+	}
+	if (job->options.backend == Backend::GPU && !server.hasGL) {
+		sendToClient(server, client, "error the server has no GPU backend, start it with --gpu");
+		return;
+	}
+
+	job->id = server.nextJobId++;
+	job->client = client;
+	job->order = server.nextOrder++;
+
+	sendJobStatus(server, *job, "queued");
+	server.jobs.push_back(std::move(job));
+}
+
+void handleServerCommand(RenderServer& server, const int client, const std::string& line) {
+
+	std::istringstream stream(line);
+	std::string command;
+	stream >> command;
+
+	std::string arguments;
+	std::getline(stream, arguments);
+
+	if (command.empty()) return;
+
+	if (command == "render") {
+		if (server.shuttingDown) sendToClient(server, client, "error the server is shutting down");
+		else queueServerJob(server, client, arguments);
+	}
+	else if (command == "cancel") {
+		const int id = std::atoi(arguments.c_str());
+		ServerJob* job = findServerJob(server, id);
+		if (!job) {
+			sendToClient(server, client, "error no job " + std::to_string(id));
+			return;
+		}
+		//The image writer has the image already, it is written either way
+		if (job->writing) {
+			sendToClient(server, client, "error job " + std::to_string(id) + " is already being written");
+			return;
+		}
+		sendJobStatus(server, *job, "cancelled");
+		removeServerJob(server, job->id);
+	}
+	else if (command == "shutdown") {
+		server.shuttingDown = true;
+	}
+	else {
+		sendToClient(server, client, "error unknown command " + command);
+	}
+}
+
+void closeServerClient(RenderServer& server, const size_t index) {
+	const int socket = server.clients[index].socket;
+	for (const std::unique_ptr<ServerJob>& job : server.jobs) {
+		if (job->client == socket) job->client = -1;
+	}
+	::close(socket);
+	server.clients.erase(server.clients.begin() + index);
+}
+
+void pollRenderServer(RenderServer& server, const int timeoutMilliseconds) {
+	//Accepts new connections, sends the queued messages and handles the commands that arrived
+	//Waits up to `timeoutMilliseconds` for any of that, -1 waits forever
+
+	//Backwards, so closing a connection doesn't move the ones still to be checked
+	for (size_t i = server.clients.size(); i-- > 0;) {
+		if (server.clients[i].closing && server.clients[i].output.empty()) closeServerClient(server, i);
+	}
+
+	std::vector<pollfd> sockets;
+	sockets.push_back(pollfd{ server.socket, POLLIN, 0 });
+	for (const ServerClient& client : server.clients) {
+		const short events = static_cast<short>((client.closing ? 0 : POLLIN) | (client.output.empty() ? 0 : POLLOUT));
+		sockets.push_back(pollfd{ client.socket, events, 0 });
+	}
+
+	if (::poll(sockets.data(), sockets.size(), timeoutMilliseconds) <= 0) return;
+
+	for (size_t i = sockets.size() - 1; i > 0; --i) {
+		const size_t index = i - 1;
+		ServerClient& client = server.clients[index];
+
+		if ((sockets[i].revents & POLLOUT) && !flushClient(client)) {
+			closeServerClient(server, index);
+			continue;
+		}
+
+		if (client.closing) {
+			if (client.output.empty() || (sockets[i].revents & (POLLHUP | POLLERR))) closeServerClient(server, index);
+			continue;
+		}
+
+		if (!(sockets[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+		char buffer[4096];
+		const ssize_t received = ::recv(client.socket, buffer, sizeof(buffer), 0);
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+		if (received <= 0) {
+			closeServerClient(server, index);
+			continue;
+		}
+
+		client.input.append(buffer, static_cast<size_t>(received));
+
+		for (size_t end; !client.closing && (end = client.input.find('\n')) != std::string::npos;) {
+			std::string line = client.input.substr(0, end);
+			client.input.erase(0, end + 1);
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			handleServerCommand(server, client.socket, line);
+		}
+
+		if (client.input.size() > SERVER_MAX_LINE) {
+			sendToClient(server, client.socket, "error command too long");
+			client.closing = true;
+		}
+	}
+
+	if (sockets[0].revents & POLLIN) {
+		const int client = ::accept(server.socket, nullptr, nullptr);
+		if (client >= 0) {
+			::fcntl(client, F_SETFL, ::fcntl(client, F_GETFL) | O_NONBLOCK);
+			server.clients.push_back(ServerClient{ client, std::string(), std::string() });
+		}
+	}
+}
+
+#endif
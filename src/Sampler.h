@@ -0,0 +1,258 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+	Samplers, every random number a path uses comes from one of them, exactly like in `shaders/trace.frag`:
+		- SAMPLER_RANDOM: the PCG hash stream seeded by pixel and frame, independent random numbers
+		- SAMPLER_SOBOL: Owen scrambled Sobol points, used by exports. Every sample of a pixel is the next point of the sequence,
+		  every dimension the sample takes is a 1D or 2D Sobol point whose index is shuffled and whose bits are scrambled per pixel
+		  and dimension (Burley 2020, "Practical Hash-based Owen Scrambling"). So the samples of a pixel are stratified in every
+		  dimension and pair of dimensions, without correlation between the dimensions or the pixels
+		- SAMPLER_BLUE_NOISE: a tiled blue noise texture, offset per dimension and advanced along a golden ratio sequence with
+		  every sample, used by interactive frames. A single sample per pixel already spreads its error evenly across the screen,
+		  and consecutive frames don't repeat it
+		- A sample starts with `startSample` and draws its dimensions in a fixed order: lens, then per bounce the light,
+		  the point on it, the direction and the roulette. Both backends draw the same numbers that way
+*/
+
+constexpr int SAMPLER_RANDOM = 0;
+constexpr int SAMPLER_SOBOL = 1;
+constexpr int SAMPLER_BLUE_NOISE = 2;
+
+int samplerFromName(const char* name) {
+	//Returns the SAMPLER_ constant named `random`, `sobol` or `blue-noise`, or -1
+	if (std::strcmp(name, "random") == 0) return SAMPLER_RANDOM;
+	if (std::strcmp(name, "sobol") == 0) return SAMPLER_SOBOL;
+	if (std::strcmp(name, "blue-noise") == 0) return SAMPLER_BLUE_NOISE;
+	return -1;
+}
+
+constexpr int BLUE_NOISE_SIZE = 64; // Side of the blue noise texture, a power of two, it tiles the screen
+
+//Golden ratio and R2 sequence increments, in 0.32 fixed point
+constexpr uint32_t GOLDEN_RATIO_STEP = 2654435769u;
+constexpr uint32_t R2_STEP_X = 3242174889u;
+constexpr uint32_t R2_STEP_Y = 2447445413u;
+
+struct Sampler {
+	int type;
+	uint32_t seed; // State of the random stream, or the hashed pixel index that scrambles the Sobol points
+	glm::ivec2 pixel; // Position in the image, the blue noise texture is tiled across it
+	uint32_t index; // Sample of the pixel, counted over all batches
+	uint32_t dimension; // Dimensions of the sample drawn so far
+};
+
+uint32_t pcgHash(uint32_t x) {
+	//PCG hash, the same step `random` takes
+	x = x * 747796405u + 2891336453u;
+	x = ((x >> ((x >> 28u) + 4u)) ^ x) * 277803737u;
+	return (x >> 22u) ^ x;
+}
+
+uint32_t hashCombine(const uint32_t seed, const uint32_t value) {
+	return seed ^ (value + 0x9e3779b9u + (seed << 6u) + (seed >> 2u));
+}
+
+float random(uint32_t& seed) {
+	seed = seed * 747796405u + 2891336453u;
+	uint32_t res = ((seed >> ((seed >> 28u) + 4u)) ^ seed) * 277803737u;
+	res = (res >> 22u) ^ res;
+	return res / 4294967296.0f;
+}
+
+uint32_t reverseBits(uint32_t x) {
+	x = ((x >> 1u) & 0x55555555u) | ((x & 0x55555555u) << 1u);
+	x = ((x >> 2u) & 0x33333333u) | ((x & 0x33333333u) << 2u);
+	x = ((x >> 4u) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4u);
+	x = ((x >> 8u) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8u);
+	return (x >> 16u) | (x << 16u);
+}
+
+uint32_t nestedUniformScramble(uint32_t x, const uint32_t seed) {
+	//Owen scrambling: flips every bit depending on the bits above it, the Laine-Karras hash does that for the bits below,
+	//so it works on the reversed bits
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverseBits(x);
+}
+
+uint32_t sobol1(uint32_t index) {
+	//Second dimension of the Sobol sequence, the first one is the index with its bits reversed
+	uint32_t result = 0;
+	for (uint32_t v = 1u << 31u; index != 0; index >>= 1u, v ^= v >> 1u) {
+		if (index & 1u) result ^= v;
+	}
+	return result;
+}
+
+float toUnitFloat(const uint32_t x) {
+	//The top 24 bits, so rounding can't reach 1
+	return float(x >> 8u) * (1.0f / 16777216.0f);
+}
+
+const std::vector<float>& blueNoise() {
+	//Void and cluster (Ulichney 1993): ranks the texels of a tile that wraps around, so that every set of the lowest ranks is evenly spread
+	//Built once, with a fixed seed, the GPU gets a copy of it in `createSceneBuffers`
+
+	static const std::vector<float> texture = [] {
+		constexpr int size = BLUE_NOISE_SIZE;
+		constexpr int count = size * size;
+		constexpr float sigma = 1.9f;
+
+		//Energy a set texel adds to the texels around it
+		std::vector<float> kernel(count);
+		for (int y = 0; y < size; ++y) {
+			for (int x = 0; x < size; ++x) {
+				const float dx = float(std::min(x, size - x));
+				const float dy = float(std::min(y, size - y));
+				kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+			}
+		}
+
+		std::vector<char> pattern(count, 0);
+		std::vector<float> energy(count, 0.0f);
+
+		auto toggle = [&](const int texel, const bool set) {
+			pattern[texel] = set;
+			const float sign = set ? 1.0f : -1.0f;
+			for (int y = 0; y < size; ++y) {
+				for (int x = 0; x < size; ++x) {
+					energy[y * size + x] += sign * kernel[((y - texel / size) & (size - 1)) * size + ((x - texel % size) & (size - 1))];
+				}
+			}
+		};
+
+		//The set texel with the most energy and the empty one with the least
+		auto tightestCluster = [&]() {
+			int best = -1;
+			for (int i = 0; i < count; ++i) {
+				if (pattern[i] && (best < 0 || energy[i] > energy[best])) best = i;
+			}
+			return best;
+		};
+
+		auto largestVoid = [&]() {
+			int best = -1;
+			for (int i = 0; i < count; ++i) {
+				if (!pattern[i] && (best < 0 || energy[i] < energy[best])) best = i;
+			}
+			return best;
+		};
+
+		//A tenth of the texels at random, relaxed until moving the tightest cluster into the largest void changes nothing
+		const int initialCount = count / 10;
+		uint32_t seed = 1;
+		for (int set = 0; set < initialCount;) {
+			const int texel = pcgHash(seed++) % count;
+			if (pattern[texel]) continue;
+			toggle(texel, true);
+			set++;
+		}
+
+		while (true) {
+			const int cluster = tightestCluster();
+			toggle(cluster, false);
+			const int emptiest = largestVoid();
+			toggle(emptiest, true);
+			if (emptiest == cluster) break;
+		}
+
+		std::vector<int> rank(count);
+
+		//Below the initial pattern the tightest clusters are taken away one by one, above it the largest voids are filled
+		const std::vector<char> initialPattern = pattern;
+		const std::vector<float> initialEnergy = energy;
+
+		for (int r = initialCount - 1; r >= 0; --r) {
+			const int cluster = tightestCluster();
+			toggle(cluster, false);
+			rank[cluster] = r;
+		}
+
+		pattern = initialPattern;
+		energy = initialEnergy;
+
+		for (int r = initialCount; r < count; ++r) {
+			const int emptiest = largestVoid();
+			toggle(emptiest, true);
+			rank[emptiest] = r;
+		}
+
+		std::vector<float> values(count);
+		for (int i = 0; i < count; ++i) {
+			values[i] = (rank[i] + 0.5f) / count;
+		}
+		return values;
+	}();
+
+	return texture;
+}
+
+uint32_t blueNoiseValue(const Sampler& sampler, const uint32_t offsetHash) {
+	//The texel of the pixel in the blue noise texture, shifted by the hash, in 0.32 fixed point
+	const int x = (sampler.pixel.x + int(offsetHash & (BLUE_NOISE_SIZE - 1))) & (BLUE_NOISE_SIZE - 1);
+	const int y = (sampler.pixel.y + int((offsetHash >> 8u) & (BLUE_NOISE_SIZE - 1))) & (BLUE_NOISE_SIZE - 1);
+	return uint32_t(blueNoise()[y * BLUE_NOISE_SIZE + x] * 4294967296.0f);
+}
+
+Sampler createSampler(const int type, const glm::ivec2 pixel, const uint32_t pixelIndex, const int frameIndex) {
+	//The random stream starts over every frame (or batch), the Sobol and blue noise points are only told apart by their index
+	Sampler sampler;
+	sampler.type = type;
+	sampler.seed = type == SAMPLER_RANDOM ? pixelIndex ^ (static_cast<uint32_t>(frameIndex) * 2654435761u) : pcgHash(pixelIndex);
+	sampler.pixel = pixel;
+	sampler.index = 0;
+	sampler.dimension = 0;
+	return sampler;
+}
+
+void startSample(Sampler& sampler, const uint32_t index) {
+	sampler.index = index;
+	sampler.dimension = 0;
+}
+
+float sample1D(Sampler& sampler) {
+
+	if (sampler.type == SAMPLER_RANDOM) return random(sampler.seed);
+
+	const uint32_t dimension = sampler.dimension++;
+
+	if (sampler.type == SAMPLER_BLUE_NOISE) {
+		return toUnitFloat(blueNoiseValue(sampler, pcgHash(2u * dimension)) + sampler.index * GOLDEN_RATIO_STEP);
+	}
+
+	const uint32_t dimensionSeed = pcgHash(hashCombine(sampler.seed, dimension));
+	const uint32_t index = nestedUniformScramble(sampler.index, dimensionSeed);
+	return toUnitFloat(nestedUniformScramble(reverseBits(index), pcgHash(dimensionSeed)));
+}
+
+glm::vec2 sample2D(Sampler& sampler) {
+
+	if (sampler.type == SAMPLER_RANDOM) {
+		const float x = random(sampler.seed);
+		const float y = random(sampler.seed);
+		return glm::vec2(x, y);
+	}
+
+	const uint32_t dimension = sampler.dimension++;
+
+	if (sampler.type == SAMPLER_BLUE_NOISE) {
+		return glm::vec2(toUnitFloat(blueNoiseValue(sampler, pcgHash(2u * dimension)) + sampler.index * R2_STEP_X),
+			toUnitFloat(blueNoiseValue(sampler, pcgHash(2u * dimension + 1u)) + sampler.index * R2_STEP_Y));
+	}
+
+	const uint32_t dimensionSeed = pcgHash(hashCombine(sampler.seed, dimension));
+	const uint32_t index = nestedUniformScramble(sampler.index, dimensionSeed);
+	return glm::vec2(toUnitFloat(nestedUniformScramble(reverseBits(index), pcgHash(dimensionSeed))),
+		toUnitFloat(nestedUniformScramble(sobol1(index), pcgHash(dimensionSeed + 1u))));
+}
@@ -0,0 +1,406 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "MappedFile.h"
+
+/*
+	Binary scene cache, so a scene that was built before can be used again without parsing meshes or building the BVH:
+		- Holds everything `loadMesh`, `createSphere` & co. and `buildBVH` produce: the object buffer arrays, the meshes and both BVH levels
+		- The file is a header followed by one raw array per section, the sections are memory mapped and copied straight into the vectors
+		- It is keyed by a hash of the contents of every source asset and a description of the scene, so editing a mesh invalidates it
+		- `SCENE_CACHE_VERSION` has to be bumped whenever the layout of a cached structure changes, the element sizes are checked as well
+		- Loading checks that every index in the file points into its sections, so a corrupt cache is ignored instead of read out of bounds
+*/
+
+constexpr uint32_t SCENE_CACHE_VERSION = 1;
+constexpr char SCENE_CACHE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+constexpr uint32_t SCENE_CACHE_BYTE_ORDER = 0x01020304; // Reads back differently on a machine with the other byte order
+constexpr uint64_t SCENE_CACHE_ALIGNMENT = 64; // Of every section in the file
+
+enum SceneCacheSection {
+	CACHE_SPHERES,
+	CACHE_VERTICES,
+	CACHE_TRIANGLES,
+	CACHE_MATERIALS,
+	CACHE_GEOMETRIES,
+	CACHE_INSTANCES,
+	CACHE_MESHES,
+	CACHE_BOTTOM_LEVEL_NODES,
+	CACHE_BOTTOM_LEVEL_INDICES,
+	CACHE_ROOTS,
+	CACHE_TRIANGLE_BLOCKS,
+	CACHE_LEAF_BLOCKS,
+	CACHE_GEOMETRY_BLOCKS,
+	CACHE_TOP_LEVEL_NODES,
+	CACHE_TOP_LEVEL_INDICES,
+	NUM_CACHE_SECTIONS
+};
+
+struct SceneCacheSectionEntry {
+	uint64_t offset; // From the start of the file
+	uint64_t count;
+	uint64_t elementSize;
+};
+
+struct SceneCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint64_t key;
+	SceneCacheSectionEntry sections[NUM_CACHE_SECTIONS];
+};
+
+uint64_t mixHash(uint64_t value) {
+	//Finalizer of splitmix64, every input bit affects every output bit
+	value ^= value >> 30;
+	value *= 0xBF58476D1CE4E5B9ull;
+	value ^= value >> 27;
+	value *= 0x94D049BB133111EBull;
+	value ^= value >> 31;
+	return value;
+}
+
+uint64_t hashBytes(const void* data, const size_t size, uint64_t hash = 0x9E3779B97F4A7C15ull) {
+	//Not cryptographic, only used to notice changed files, reads 8 bytes at a time
+
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		std::memcpy(&word, bytes + i, 8);
+		hash = (hash ^ mixHash(word)) * 0x9E3779B97F4A7C15ull;
+	}
+
+	uint64_t tail = 0;
+	if (size > i) std::memcpy(&tail, bytes + i, size - i); // `data` may be null for an empty file
+	hash = (hash ^ mixHash(tail)) * 0x9E3779B97F4A7C15ull;
+
+	return mixHash(hash ^ size);
+}
+
+bool hashSceneAssets(const std::vector<std::string>& assets, const std::string& description, uint64_t& key) {
+	//Combines the contents of every asset file, their paths and the description of the scene (everything that isn't in a file) into the cache key
+	//Returns false if an asset can't be read
+
+	key = hashBytes(description.data(), description.size(), SCENE_CACHE_VERSION);
+
+	for (const std::string& asset : assets) {
+		MappedFile file;
+		if (!mapFile(asset.c_str(), file)) {
+			std::cerr << "Error: Could not open " << asset << "\n";
+			return false;
+		}
+
+		key = hashBytes(asset.data(), asset.size(), key);
+		key = hashBytes(file.data, file.size, key);
+
+		unmapFile(file);
+	}
+
+	return true;
+}
+
+template<typename T>
+void setCacheSection(SceneCacheHeader& header, const SceneCacheSection section, const std::vector<T>& elements, uint64_t& offset) {
+	header.sections[section].offset = offset;
+	header.sections[section].count = elements.size();
+	header.sections[section].elementSize = sizeof(T);
+
+	offset += elements.size() * sizeof(T);
+	offset = (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+}
+
+template<typename T>
+void writeCacheSection(std::ofstream& file, const SceneCacheHeader& header, const SceneCacheSection section, const std::vector<T>& elements) {
+	//Pads the file up to the offset of the section first
+
+	static const char padding[SCENE_CACHE_ALIGNMENT] = {};
+
+	const uint64_t position = static_cast<uint64_t>(file.tellp());
+	file.write(padding, header.sections[section].offset - position);
+	file.write(reinterpret_cast<const char*>(elements.data()), elements.size() * sizeof(T));
+}
+
+template<typename T>
+bool readCacheSection(const MappedFile& file, const SceneCacheHeader& header, const SceneCacheSection section, std::vector<T>& elements) {
+
+	const SceneCacheSectionEntry& entry = header.sections[section];
+
+	if (entry.elementSize != sizeof(T)) return false;
+	if (entry.offset > file.size || entry.count > (file.size - entry.offset) / sizeof(T)) return false;
+
+	elements.resize(entry.count);
+	if (entry.count > 0) {
+		std::memcpy(elements.data(), file.data + entry.offset, entry.count * sizeof(T));
+	}
+
+	return true;
+}
+
+bool validCacheTree(const BVHTree& tree, const size_t numPrimitives) {
+	//Every node and index has to point into its arrays, children come after their parent, which rules out cycles,
+	//and no interior node may be so deep that walking it overflows the traversal stack
+
+	const int numNodes = static_cast<int>(tree.nodes.size());
+	const int numIndices = static_cast<int>(tree.indices.size());
+
+	for (const int index : tree.indices) {
+		if (index < 0 || static_cast<size_t>(index) >= numPrimitives) return false;
+	}
+
+	std::vector<int> depths(tree.nodes.size(), 0);
+
+	for (int i = 0; i < numNodes; ++i) {
+		const BVHNode& node = tree.nodes[i];
+
+		if (node.count < 0 || node.leftFirst < 0) return false;
+
+		if (node.count > 0) {
+			if (node.leftFirst > numIndices - node.count) return false;
+			continue;
+		}
+
+		if (node.leftFirst <= i || node.leftFirst >= numNodes - 1 || depths[i] + 1 >= BVH_MAX_DEPTH) return false;
+		depths[node.leftFirst] = std::max(depths[node.leftFirst], depths[i] + 1);
+		depths[node.leftFirst + 1] = std::max(depths[node.leftFirst + 1], depths[i] + 1);
+	}
+
+	return true;
+}
+
+bool validCacheScene(const ObjectBuffer& scene, const BVH& bvh, const std::vector<Mesh>& meshes) {
+	//The sections are only checked to fit each other, a cache that passes can still hold a different scene than its key says,
+	//but nothing that uses it reads out of bounds
+
+	const int numVertices = static_cast<int>(scene.vertices.size());
+	const int numTriangles = static_cast<int>(scene.triangles.size());
+	const int numMaterials = static_cast<int>(scene.materials.size());
+	const int numGeometries = static_cast<int>(scene.geometries.size());
+	const int numInstances = static_cast<int>(scene.instances.size());
+	const int numNodes = static_cast<int>(bvh.bottomLevel.nodes.size());
+	const int numBlocks = static_cast<int>(bvh.triangleBlocks.size());
+
+	for (const Triangle& triangle : scene.triangles) {
+		if (glm::any(glm::lessThan(triangle.indices, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(triangle.indices, glm::ivec3(numVertices)))) return false;
+		if (triangle.material < 0 || triangle.material >= numMaterials) return false;
+	}
+
+	for (const Geometry& geometry : scene.geometries) {
+		if (geometry.firstTriangle < 0 || geometry.lastTriangle < geometry.firstTriangle - 1 || geometry.lastTriangle >= numTriangles) return false;
+		if (geometry.firstVertex < 0 || geometry.lastVertex < geometry.firstVertex - 1 || geometry.lastVertex >= numVertices) return false;
+	}
+
+	for (const Instance& instance : scene.instances) {
+		if (instance.geometry < 0 || instance.geometry >= numGeometries) return false;
+		if (instance.material < -1 || instance.material >= numMaterials) return false;
+	}
+
+	for (const Mesh& mesh : meshes) {
+		if (mesh.wasLoaded && (mesh.instance < 0 || mesh.instance >= numInstances)) return false;
+	}
+
+	if (bvh.roots.size() != scene.geometries.size() || bvh.geometryBlocks.size() != scene.geometries.size() || bvh.leafBlocks.size() != bvh.bottomLevel.nodes.size()) return false;
+
+	for (const int root : bvh.roots) {
+		if (root < -1 || root >= numNodes) return false;
+	}
+
+	if (!validCacheTree(bvh.bottomLevel, scene.triangles.size()) || !validCacheTree(bvh.topLevel, scene.instances.size())) return false;
+
+	//The blocks of a leaf hold its triangles in groups of `TRIANGLE_BLOCK_SIZE`
+	for (int i = 0; i < numNodes; ++i) {
+		const int count = bvh.bottomLevel.nodes[i].count;
+		if (count == 0) continue;
+
+		const int first = bvh.leafBlocks[i];
+		if (first < 0 || first > numBlocks - (count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE) return false;
+	}
+
+	for (const glm::ivec2& blocks : bvh.geometryBlocks) {
+		if (blocks.x < 0 || blocks.y < 0 || blocks.x > numBlocks - blocks.y) return false;
+	}
+
+	for (const TriangleBlock& block : bvh.triangleBlocks) {
+		for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; ++lane) {
+			if (block.triangle[lane] < -1 || block.triangle[lane] >= numTriangles) return false;
+		}
+	}
+
+	return true;
+}
+
+bool saveSceneCache(const char* path, const uint64_t key, const ObjectBuffer& objectBuffer, const BVH& bvh, const std::vector<Mesh>& meshes) {
+	//Written to a temporary file first, so a crash never leaves half a cache behind
+
+	SceneCacheHeader header = {};
+	std::memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+	header.version = SCENE_CACHE_VERSION;
+	header.byteOrder = SCENE_CACHE_BYTE_ORDER;
+	header.key = key;
+
+	//The bytes between `wasLoaded` and `center` are padding, they are zeroed so the same scene always gives the same file
+	std::vector<Mesh> cachedMeshes(meshes.size());
+	std::memset(static_cast<void*>(cachedMeshes.data()), 0, cachedMeshes.size() * sizeof(Mesh));
+	for (size_t i = 0; i < meshes.size(); ++i) {
+		cachedMeshes[i].instance = meshes[i].instance;
+		cachedMeshes[i].wasLoaded = meshes[i].wasLoaded;
+		cachedMeshes[i].center = meshes[i].center;
+	}
+
+	uint64_t offset = (sizeof(SceneCacheHeader) + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+
+	setCacheSection(header, CACHE_SPHERES, objectBuffer.spheres, offset);
+	setCacheSection(header, CACHE_VERTICES, objectBuffer.vertices, offset);
+	setCacheSection(header, CACHE_TRIANGLES, objectBuffer.triangles, offset);
+	setCacheSection(header, CACHE_MATERIALS, objectBuffer.materials, offset);
+	setCacheSection(header, CACHE_GEOMETRIES, objectBuffer.geometries, offset);
+	setCacheSection(header, CACHE_INSTANCES, objectBuffer.instances, offset);
+	setCacheSection(header, CACHE_MESHES, cachedMeshes, offset);
+	setCacheSection(header, CACHE_BOTTOM_LEVEL_NODES, bvh.bottomLevel.nodes, offset);
+	setCacheSection(header, CACHE_BOTTOM_LEVEL_INDICES, bvh.bottomLevel.indices, offset);
+	setCacheSection(header, CACHE_ROOTS, bvh.roots, offset);
+	setCacheSection(header, CACHE_TRIANGLE_BLOCKS, bvh.triangleBlocks, offset);
+	setCacheSection(header, CACHE_LEAF_BLOCKS, bvh.leafBlocks, offset);
+	setCacheSection(header, CACHE_GEOMETRY_BLOCKS, bvh.geometryBlocks, offset);
+	setCacheSection(header, CACHE_TOP_LEVEL_NODES, bvh.topLevel.nodes, offset);
+	setCacheSection(header, CACHE_TOP_LEVEL_INDICES, bvh.topLevel.indices, offset);
+
+	//Named after the process and the save, so renders that save the same scene at once don't write into each other's file,
+	//the last one to finish replaces the cache
+	static std::atomic<unsigned int> saves{ 0 };
+#ifdef _WIN32
+	const unsigned long processId = GetCurrentProcessId();
+#else
+	const unsigned long processId = static_cast<unsigned long>(getpid());
+#endif
+	const std::string temporaryPath = std::string(path) + "." + std::to_string(processId) + "." + std::to_string(saves++) + ".tmp";
+
+	std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		std::cerr << "Error: Could not write scene cache " << temporaryPath << "\n";
+		return false;
+	}
+
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	writeCacheSection(file, header, CACHE_SPHERES, objectBuffer.spheres);
+	writeCacheSection(file, header, CACHE_VERTICES, objectBuffer.vertices);
+	writeCacheSection(file, header, CACHE_TRIANGLES, objectBuffer.triangles);
+	writeCacheSection(file, header, CACHE_MATERIALS, objectBuffer.materials);
+	writeCacheSection(file, header, CACHE_GEOMETRIES, objectBuffer.geometries);
+	writeCacheSection(file, header, CACHE_INSTANCES, objectBuffer.instances);
+	writeCacheSection(file, header, CACHE_MESHES, cachedMeshes);
+	writeCacheSection(file, header, CACHE_BOTTOM_LEVEL_NODES, bvh.bottomLevel.nodes);
+	writeCacheSection(file, header, CACHE_BOTTOM_LEVEL_INDICES, bvh.bottomLevel.indices);
+	writeCacheSection(file, header, CACHE_ROOTS, bvh.roots);
+	writeCacheSection(file, header, CACHE_TRIANGLE_BLOCKS, bvh.triangleBlocks);
+	writeCacheSection(file, header, CACHE_LEAF_BLOCKS, bvh.leafBlocks);
+	writeCacheSection(file, header, CACHE_GEOMETRY_BLOCKS, bvh.geometryBlocks);
+	writeCacheSection(file, header, CACHE_TOP_LEVEL_NODES, bvh.topLevel.nodes);
+	writeCacheSection(file, header, CACHE_TOP_LEVEL_INDICES, bvh.topLevel.indices);
+
+	file.close();
+	if (file.fail()) {
+		std::cerr << "Error: Could not write scene cache " << temporaryPath << "\n";
+		std::remove(temporaryPath.c_str());
+		return false;
+	}
+
+	std::remove(path); // Renaming onto an existing file fails on Windows
+	if (std::rename(temporaryPath.c_str(), path) != 0) {
+		std::cerr << "Error: Could not replace scene cache " << path << "\n";
+		std::remove(temporaryPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool loadSceneCache(const char* path, const uint64_t key, ObjectBuffer& objectBuffer, BVH& bvh, std::vector<Mesh>& meshes) {
+	//Returns false if there is no cache for `key`, the object buffer and the BVH are left alone then
+	//On success the scene replaces the one in the object buffer and everything is marked as changed, so it gets uploaded
+
+	MappedFile file;
+	if (!mapFile(path, file)) return false;
+
+	SceneCacheHeader header;
+	if (file.size < sizeof(header)) {
+		unmapFile(file);
+		return false;
+	}
+	std::memcpy(&header, file.data, sizeof(header));
+
+	if (std::memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != SCENE_CACHE_VERSION ||
+		header.byteOrder != SCENE_CACHE_BYTE_ORDER || header.key != key) {
+		unmapFile(file);
+		return false;
+	}
+
+	ObjectBuffer scene;
+	BVH sceneBVH;
+	std::vector<Mesh> sceneMeshes;
+
+	const bool valid =
+		readCacheSection(file, header, CACHE_SPHERES, scene.spheres) &&
+		readCacheSection(file, header, CACHE_VERTICES, scene.vertices) &&
+		readCacheSection(file, header, CACHE_TRIANGLES, scene.triangles) &&
+		readCacheSection(file, header, CACHE_MATERIALS, scene.materials) &&
+		readCacheSection(file, header, CACHE_GEOMETRIES, scene.geometries) &&
+		readCacheSection(file, header, CACHE_INSTANCES, scene.instances) &&
+		readCacheSection(file, header, CACHE_MESHES, sceneMeshes) &&
+		readCacheSection(file, header, CACHE_BOTTOM_LEVEL_NODES, sceneBVH.bottomLevel.nodes) &&
+		readCacheSection(file, header, CACHE_BOTTOM_LEVEL_INDICES, sceneBVH.bottomLevel.indices) &&
+		readCacheSection(file, header, CACHE_ROOTS, sceneBVH.roots) &&
+		readCacheSection(file, header, CACHE_TRIANGLE_BLOCKS, sceneBVH.triangleBlocks) &&
+		readCacheSection(file, header, CACHE_LEAF_BLOCKS, sceneBVH.leafBlocks) &&
+		readCacheSection(file, header, CACHE_GEOMETRY_BLOCKS, sceneBVH.geometryBlocks) &&
+		readCacheSection(file, header, CACHE_TOP_LEVEL_NODES, sceneBVH.topLevel.nodes) &&
+		readCacheSection(file, header, CACHE_TOP_LEVEL_INDICES, sceneBVH.topLevel.indices);
+
+	unmapFile(file);
+
+	if (!valid || !validCacheScene(scene, sceneBVH, sceneMeshes)) {
+		std::cerr << "Warning: Ignoring the corrupt scene cache " << path << "\n";
+		return false;
+	}
+
+	objectBuffer.spheres = std::move(scene.spheres);
+	objectBuffer.vertices = std::move(scene.vertices);
+	objectBuffer.triangles = std::move(scene.triangles);
+	objectBuffer.materials = std::move(scene.materials);
+	objectBuffer.geometries = std::move(scene.geometries);
+	objectBuffer.instances = std::move(scene.instances);
+
+	objectBuffer.numSpheres = static_cast<int>(objectBuffer.spheres.size());
+	objectBuffer.numTriangles = static_cast<int>(objectBuffer.triangles.size());
+	objectBuffer.numInstances = static_cast<int>(objectBuffer.instances.size());
+
+	objectBuffer.changes.spheres.add(0, objectBuffer.numSpheres - 1);
+	objectBuffer.changes.vertices.add(0, static_cast<int>(objectBuffer.vertices.size()) - 1);
+	objectBuffer.changes.triangles.add(0, objectBuffer.numTriangles - 1);
+	objectBuffer.changes.materials.add(0, static_cast<int>(objectBuffer.materials.size()) - 1);
+	objectBuffer.changes.instances = false; // The cached top level already matches the instances
+
+	bvh = std::move(sceneBVH);
+	bvh.changedNodes.add(0, static_cast<int>(bvh.bottomLevel.nodes.size()) - 1);
+	bvh.changedIndices.add(0, static_cast<int>(bvh.bottomLevel.indices.size()) - 1);
+	bvh.topLevelChanged = true;
+
+	//The light list is cheap to derive, so it isn't cached
+	buildLights(objectBuffer);
+
+	meshes = std::move(sceneMeshes);
+
+	return true;
+}
@@ -0,0 +1,369 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+	Scene files, plain text describing a scene and how to render it:
+		- One statement per line, a keyword followed by named properties, vectors are written as separate numbers, `#` starts a comment
+			material <name> color r g b [smoothness s] [emission r g b]
+			sphere center x y z radius r [material <name>]
+			mesh path <file.obj> [material <name>] [translate x y z] [rotate degrees x y z] [scale x y z] ...
+			camera [position x y z] [direction x y z] [up x y z]
+			render [samples n] [bounces n] [resolution width height] [sampler random|sobol|blue-noise] [noise-threshold t] [denoise]
+		- Materials have to be defined before they are used, objects without one are white
+		- The transforms of a mesh apply in the order they are written, each one in world space on top of the ones before,
+		  rotations and scales are about the center of the mesh, which starts at the origin and moves with it
+		- Mesh paths are relative to the scene file. Every mesh file is parsed once, on its own thread, the meshes are added to
+		  the scene in the order of the file afterwards, and meshes that use the same file share its geometry
+		- The built scene is cached next to the scene file, keyed by the contents of the scene file and of every mesh file
+*/
+
+//Render settings of a scene file, the command line overrides them. What a file doesn't set is 0 or -1
+struct RenderSettings {
+	int samples = 0;
+	int bounces = 0;
+	glm::u16vec2 resolution = glm::u16vec2(0);
+	int sampler = -1;
+	float noiseThreshold = -1.0f;
+	bool denoise = false;
+};
+
+enum class SceneTransformType {
+	Translate,
+	Rotate,
+	Scale
+};
+
+struct SceneTransform {
+	SceneTransformType type;
+	glm::vec3 vector; // Translation, axis or scale
+	float angle; // In degrees
+};
+
+struct SceneMeshDescription {
+	std::string path; // Resolved against the directory of the scene file
+	int material; // Into `SceneDescription::materials`, -1 for white
+	std::vector<SceneTransform> transforms; // In the order they apply
+};
+
+struct SceneDescription {
+	std::vector<Material> materials;
+	std::unordered_map<std::string, int> materialNames;
+	std::vector<Sphere> spheres;
+	std::vector<SceneMeshDescription> meshes;
+	bool hasCamera = false;
+	Camera camera;
+	RenderSettings settings;
+};
+
+bool readSceneValues(std::istringstream& line, float* values, const int count) {
+	for (int i = 0; i < count; ++i) {
+		if (!(line >> values[i])) return false;
+	}
+	return true;
+}
+
+bool readSceneVector(std::istringstream& line, glm::vec3& vector) {
+	return readSceneValues(line, &vector.x, 3);
+}
+
+bool parseScene(const char* path, SceneDescription& scene) {
+	//Returns false with an error naming the line if the file can't be read or a statement is malformed
+
+	std::ifstream file(path);
+	if (!file.is_open()) {
+		std::cerr << "Error: Could not open scene file " << path << "\n";
+		return false;
+	}
+
+	const std::string scenePath = path;
+	const size_t separator = scenePath.find_last_of("/\\");
+	const std::string directory = separator == std::string::npos ? "" : scenePath.substr(0, separator + 1);
+
+	const Material white = Material{ glm::vec3(1.0f), 0.0f, glm::vec3(0.0f) };
+
+	std::string text;
+	for (int lineNumber = 1; std::getline(file, text); ++lineNumber) {
+
+		const size_t comment = text.find('#');
+		if (comment != std::string::npos) text.erase(comment);
+
+		std::istringstream line(text);
+		std::string keyword;
+		if (!(line >> keyword)) continue;
+
+		auto fail = [&](const std::string& message) {
+			std::cerr << "Error: " << path << ":" << lineNumber << ": " << message << "\n";
+			return false;
+		};
+
+		auto readMaterial = [&](int& material) {
+			std::string name;
+			if (!(line >> name)) return false;
+			const auto found = scene.materialNames.find(name);
+			if (found == scene.materialNames.end()) return false;
+			material = found->second;
+			return true;
+		};
+
+		std::string property;
+
+		if (keyword == "material") {
+			std::string name;
+			if (!(line >> name)) return fail("material without a name");
+
+			Material material = white;
+			while (line >> property) {
+				bool valid = false;
+				if (property == "color") valid = readSceneVector(line, material.color);
+				else if (property == "smoothness") valid = readSceneValues(line, &material.smoothness, 1);
+				else if (property == "emission") valid = readSceneVector(line, material.emission);
+				if (!valid) return fail("invalid material property " + property);
+			}
+
+			scene.materialNames[name] = static_cast<int>(scene.materials.size());
+			scene.materials.push_back(material);
+		}
+		else if (keyword == "sphere") {
+			Sphere sphere;
+			sphere.center = glm::vec3(0.0f);
+			sphere.radius = 1.0f;
+			sphere.material = white;
+
+			while (line >> property) {
+				bool valid = false;
+				int material = -1;
+				if (property == "center") valid = readSceneVector(line, sphere.center);
+				else if (property == "radius") valid = readSceneValues(line, &sphere.radius, 1) && sphere.radius > 0.0f;
+				else if (property == "material" && (valid = readMaterial(material))) sphere.material = scene.materials[material];
+				if (!valid) return fail("invalid or unknown sphere property " + property);
+			}
+
+			scene.spheres.push_back(sphere);
+		}
+		else if (keyword == "mesh") {
+			SceneMeshDescription mesh;
+			mesh.material = -1;
+
+			while (line >> property) {
+				bool valid = false;
+				SceneTransform transform = SceneTransform{ SceneTransformType::Translate, glm::vec3(0.0f), 0.0f };
+				if (property == "path") {
+					valid = static_cast<bool>(line >> mesh.path);
+					if (valid) mesh.path = directory + mesh.path;
+				}
+				else if (property == "material") valid = readMaterial(mesh.material);
+				else if (property == "translate") {
+					valid = readSceneVector(line, transform.vector);
+				}
+				else if (property == "rotate") {
+					transform.type = SceneTransformType::Rotate;
+					valid = readSceneValues(line, &transform.angle, 1) && readSceneVector(line, transform.vector) && glm::length(transform.vector) > 0.0f;
+				}
+				else if (property == "scale") {
+					transform.type = SceneTransformType::Scale;
+					valid = readSceneVector(line, transform.vector);
+				}
+				if (!valid) return fail("invalid or unknown mesh property " + property);
+
+				if (property == "translate" || property == "rotate" || property == "scale") mesh.transforms.push_back(transform);
+			}
+
+			if (mesh.path.empty()) return fail("mesh without a path");
+
+			scene.meshes.push_back(mesh);
+		}
+		else if (keyword == "camera") {
+			glm::vec3 position = glm::vec3(0.0f);
+			glm::vec3 direction = glm::vec3(0.0f, 0.0f, -1.0f);
+			glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
+
+			while (line >> property) {
+				bool valid = false;
+				if (property == "position") valid = readSceneVector(line, position);
+				else if (property == "direction") valid = readSceneVector(line, direction) && glm::length(direction) > 0.0f;
+				else if (property == "up") valid = readSceneVector(line, up);
+				if (!valid) return fail("invalid camera property " + property);
+			}
+
+			//The camera looks down `direction`, `up` only has to point somewhere above it
+			direction = glm::normalize(direction);
+			const glm::vec3 right = glm::cross(direction, up);
+			if (glm::length(right) < 1e-6f) return fail("camera up is parallel to its direction");
+
+			scene.camera.position = position;
+			scene.camera.direction = direction;
+			scene.camera.right = glm::normalize(right);
+			scene.camera.up = glm::cross(scene.camera.right, direction);
+			scene.hasCamera = true;
+		}
+		else if (keyword == "render") {
+			RenderSettings& settings = scene.settings;
+
+			while (line >> property) {
+				bool valid = false;
+				if (property == "samples") valid = (line >> settings.samples) && settings.samples > 0;
+				else if (property == "bounces") valid = (line >> settings.bounces) && settings.bounces > 0;
+				else if (property == "resolution") {
+					int width, height;
+					valid = (line >> width >> height) && width > 0 && height > 0 && width <= 65535 && height <= 65535;
+					if (valid) settings.resolution = glm::u16vec2(width, height);
+				}
+				else if (property == "sampler") {
+					std::string name;
+					valid = (line >> name) && (settings.sampler = samplerFromName(name.c_str())) >= 0;
+				}
+				else if (property == "noise-threshold") valid = readSceneValues(line, &settings.noiseThreshold, 1);
+				else if (property == "denoise") {
+					settings.denoise = true;
+					valid = true;
+				}
+				if (!valid) return fail("invalid render setting " + property);
+			}
+		}
+		else {
+			return fail("unknown statement " + keyword);
+		}
+	}
+
+	return true;
+}
+
+void collectMeshFiles(const SceneDescription& scene, std::vector<std::string>& meshFiles, std::vector<int>& meshFileOf) {
+	//Every mesh file once, in the order of their first use, and the file of every mesh
+
+	meshFiles.clear();
+	meshFileOf.resize(scene.meshes.size());
+	for (size_t i = 0; i < scene.meshes.size(); ++i) {
+		const auto found = std::find(meshFiles.begin(), meshFiles.end(), scene.meshes[i].path);
+		meshFileOf[i] = static_cast<int>(found - meshFiles.begin());
+		if (found == meshFiles.end()) meshFiles.push_back(scene.meshes[i].path);
+	}
+}
+
+bool hashSceneFiles(const char* path, const std::vector<std::string>& meshFiles, uint64_t& key) {
+	//The key of the scene cache, it changes whenever the scene file or one of its meshes does
+	std::vector<std::string> assets = meshFiles;
+	assets.push_back(path);
+	return hashSceneAssets(assets, "scene file", key);
+}
+
+bool hashScene(const char* path, uint64_t& key) {
+	//The key `loadScene` would use for the scene file at `path`, without loading it
+	//Returns false if the file or one of its meshes can't be read
+
+	SceneDescription scene;
+	if (!parseScene(path, scene)) return false;
+
+	std::vector<std::string> meshFiles;
+	std::vector<int> meshFileOf;
+	collectMeshFiles(scene, meshFiles, meshFileOf);
+
+	return hashSceneFiles(path, meshFiles, key);
+}
+
+bool loadScene(const char* path, ObjectBuffer& objectBuffer, BVH& bvh, std::vector<Mesh>& meshes, RenderSettings& settings, uint64_t* key = nullptr) {
+	//Replaces the scene in the object buffer (which has to be empty) with the one described by the scene file at `path`
+	//`key` is set to the content hash of the files the scene was loaded from, see `hashScene`
+	//Returns false if the file or one of its meshes can't be loaded
+
+	SceneDescription scene;
+	if (!parseScene(path, scene)) return false;
+
+	settings = scene.settings;
+	if (scene.hasCamera) objectBuffer.camera = scene.camera;
+
+	std::vector<std::string> meshFiles;
+	std::vector<int> meshFileOf;
+	collectMeshFiles(scene, meshFiles, meshFileOf);
+
+	uint64_t sceneKey = 0;
+	const std::string cachePath = std::string(path) + ".cache";
+	if (!hashSceneFiles(path, meshFiles, sceneKey)) return false;
+	if (key) *key = sceneKey;
+
+	if (loadSceneCache(cachePath.c_str(), sceneKey, objectBuffer, bvh, meshes)) {
+		std::cout << "Loaded scene from " << cachePath << "\n";
+		return true;
+	}
+
+	//Large files are split across threads by `loadObj` as well, small ones are parsed by one thread each
+	std::vector<ObjData> objs(meshFiles.size());
+	std::vector<char> loaded(meshFiles.size(), 0);
+	std::atomic<size_t> nextFile(0);
+
+	auto loadFiles = [&]() {
+		for (size_t file = nextFile++; file < meshFiles.size(); file = nextFile++) {
+			loaded[file] = loadObj(meshFiles[file].c_str(), objs[file]);
+		}
+	};
+
+	const size_t numThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), meshFiles.size());
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < numThreads; ++i) {
+		threads.emplace_back(loadFiles);
+	}
+	loadFiles();
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	if (std::find(loaded.begin(), loaded.end(), 0) != loaded.end()) return false;
+
+	for (const Sphere& sphere : scene.spheres) {
+		createSphere(objectBuffer, sphere.center, sphere.radius, sphere.material);
+	}
+
+	meshes.assign(scene.meshes.size(), Mesh());
+	std::vector<int> firstMeshOf(meshFiles.size(), -1);
+
+	for (size_t i = 0; i < scene.meshes.size(); ++i) {
+		const SceneMeshDescription& description = scene.meshes[i];
+		int& first = firstMeshOf[meshFileOf[i]];
+
+		if (first < 0) {
+			addMesh(objectBuffer, objs[meshFileOf[i]], meshes[i]);
+			first = static_cast<int>(i);
+		}
+		else {
+			//The first use of the file isn't transformed yet, so the copy starts out untransformed as well
+			instanceMesh(objectBuffer, meshes[first], meshes[i]);
+		}
+
+		setMeshMaterial(objectBuffer, meshes[i], description.material >= 0 ? scene.materials[description.material] : Material{ glm::vec3(1.0f), 0.0f, glm::vec3(0.0f) });
+	}
+
+	for (size_t i = 0; i < scene.meshes.size(); ++i) {
+		Mesh& mesh = meshes[i];
+		for (const SceneTransform& transform : scene.meshes[i].transforms) {
+			switch (transform.type) {
+			case SceneTransformType::Translate:
+				translateMesh(objectBuffer, mesh, transform.vector);
+				break;
+			case SceneTransformType::Rotate:
+				rotateMesh(objectBuffer, mesh, glm::radians(transform.angle), glm::normalize(transform.vector), mesh.center);
+				break;
+			case SceneTransformType::Scale:
+				scaleMesh(objectBuffer, mesh, transform.vector, mesh.center);
+				break;
+			}
+		}
+	}
+
+	buildBVH(bvh, objectBuffer);
+
+	saveSceneCache(cachePath.c_str(), sceneKey, objectBuffer, bvh, meshes);
+
+	return true;
+}
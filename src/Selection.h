@@ -23,29 +23,32 @@ float raySphere(const Ray& ray, const Sphere& sphere) {
 	
 }
 
-float rayTriangle(const Ray& ray, const Triangle& triangle) {
+float rayTriangle(const Ray& ray, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2) {
 	//Returns the distance to the intersection point
 	//Returns -1 if there is no intersection
 
-	glm::vec3 pvec = glm::cross(ray.direction, triangle.edge2);
-	float det = glm::dot(triangle.edge1, pvec);
+	glm::vec3 edge1 = v1 - v0;
+	glm::vec3 edge2 = v2 - v0;
+
+	glm::vec3 pvec = glm::cross(ray.direction, edge2);
+	float det = glm::dot(edge1, pvec);
 
 	if (det < 0.0001f) return -1;
 
 	float invDet = 1.0f / det;
 
-	glm::vec3 tvec = ray.origin - triangle.v0;
+	glm::vec3 tvec = ray.origin - v0;
 	float u = glm::dot(tvec, pvec) * invDet;
 	if (u < 0.0f || u > 1.0f) return -1;
 
-	glm::vec3 qvec = glm::cross(tvec, triangle.edge1);
+	glm::vec3 qvec = glm::cross(tvec, edge1);
 	float v = glm::dot(ray.direction, qvec) * invDet;
 	if (v < 0.0f || u + v > 1.0f) return -1;
 
-	return glm::dot(triangle.edge2, qvec) * invDet;
+	return glm::dot(edge2, qvec) * invDet;
 }
 
-int getROIndexAt(const glm::vec2 coordinate, const ObjectBuffer& objectBuffer) {
+int getROIndexAt(const glm::vec2 coordinate, const ObjectBuffer& objectBuffer, const BVH& bvh) {
 	//Returns the index of the closet clicked render object
 	int closestObject = -1;
 	float closestDistance = 10e10f;
@@ -62,11 +65,22 @@ int getROIndexAt(const glm::vec2 coordinate, const ObjectBuffer& objectBuffer) {
 		}
 	}
 
-	for (int i = 0; i < objectBuffer.numTriangles; i++) {
-		float distance = rayTriangle(ray, objectBuffer.triangles[i]);
-		if (distance > 0 && distance < closestDistance) {
-			closestDistance = distance;
-			closestObject = i + MAX_SPHERES;
+	for (int i = 0; i < objectBuffer.numInstances; i++) {
+		const Instance& instance = objectBuffer.instances[i];
+
+		//Geometries loaded since the BVH was last updated can't be picked yet
+		if (instance.geometry >= static_cast<int>(bvh.geometryBlocks.size())) continue;
+
+		//Intersect in object space, distances stay the same since the direction isn't renormalized
+		Ray objectRay;
+		objectRay.origin = glm::vec3(instance.inverseTransform * glm::vec4(ray.origin, 1.0f));
+		objectRay.direction = glm::vec3(instance.inverseTransform * glm::vec4(ray.direction, 0.0f));
+
+		//Every triangle of the geometry, the blocks are stored next to each other so the widest kernel can be used
+		const glm::ivec2 blocks = bvh.geometryBlocks[instance.geometry];
+		int triangle = -1;
+		if (blocks.y > 0 && rayTriangleBlocks(objectRay.origin, objectRay.direction, &bvh.triangleBlocks[blocks.x], blocks.y, closestDistance, triangle)) {
+			closestObject = i + objectBuffer.numSpheres;
 		}
 	}
 	
@@ -13,6 +13,10 @@
 #include <iostream>
 #include <chrono>
 #include <unordered_map>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <functional>
 
 /*
 	Small docs:
@@ -23,11 +27,18 @@
 */
 
 int windowWidth = 800, windowHeight = 600;
-constexpr int MAX_SPHERES = 2;
-constexpr int MAX_TRIANGLES = 30;
+bool animateScene = true; // Toggled with space, the viewport only converges while nothing moves
+bool dumpProfile = false; // Set with P, the main loop writes the profile
+constexpr int MAX_BOUNCES = 8; // Russian roulette ends most paths long before
+constexpr int NUM_SAMPLES = 4; // Per frame, the viewport keeps averaging frames until something changes
 
-constexpr int MAX_BOUNCES = 2;
-constexpr int NUM_SAMPLES = 100;
+// Exports are split into tiles and batches of samples, so no single draw call runs long enough to trip the driver's watchdog
+constexpr int EXPORT_TILE_SIZE = 512;
+constexpr int EXPORT_BATCH_SAMPLES = 16;
+constexpr int EXPORT_BATCHES_IN_FLIGHT = 2; // Queued on the GPU at once, it never idles between batches but the driver's queue stays short
+
+// Opened unless `--scene` names another scene file, see SceneFile.h
+constexpr const char* DEFAULT_SCENE_PATH = "scenes/default.scene";
 
 constexpr glm::vec2  p720 = glm::vec2(1280, 720);
 constexpr glm::vec2  p1080 = glm::vec2(1920, 1080);
@@ -35,16 +46,20 @@ constexpr glm::vec2  p1440 = glm::vec2(2560, 1440);
 constexpr glm::vec2  p4k = glm::vec2(3840, 2160);
 constexpr glm::vec2 p8k = glm::vec2(7680, 4320);
 
-void glfwErrorCallback(int error, const char* description) {
+void glfwErrorCallback(int /*error*/, const char* description) {
 	std::cerr << "GLFW Error: " << description << "\n";
 }
 
-void glfwKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+void glfwKeyCallback(GLFWwindow* window, int key, int /*scancode*/, int action, int /*mods*/) {
 	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, GL_TRUE);
+	if (key == GLFW_KEY_SPACE && action == GLFW_PRESS)
+		animateScene = !animateScene;
+	if (key == GLFW_KEY_P && action == GLFW_PRESS)
+		dumpProfile = true;
 }
 
-void glfwFramebufferSizeCallback(GLFWwindow* window, int width, int height) {
+void glfwFramebufferSizeCallback(GLFWwindow* /*window*/, int width, int height) {
 	glViewport(0, 0, width, height);
 	windowWidth = width;
 	windowHeight = height;
@@ -52,21 +67,31 @@ void glfwFramebufferSizeCallback(GLFWwindow* window, int width, int height) {
 
 #include "Structures.h"
 #include "Shader.h"
+#include "BVH.h"
+#include "Sampler.h"
 #include "Initialization.h"
 #include "Selection.h"
+#include "Tracer.h"
+#include "ObjLoader.h"
+#include "SceneCache.h"
 #include "Bodies.h"
+#include "SceneFile.h"
+#include "ImageWriter.h"
+#include "RenderOptions.h"
+#include "RenderServer.h"
 #include "Gui.h"
 
-void updateCamera() {
+bool updateCamera() {
 	
-
+	return false;
 }
 
-void updateScene(ObjectBuffer& objectBuffer, Mesh* const meshes, int numMeshes) {
+bool updateScene(ObjectBuffer& objectBuffer, Mesh* const meshes, int numMeshes) {
 
-	if (!numMeshes) return;
+	if (!numMeshes || !animateScene) return false;
 	
-	rotateMesh(objectBuffer, meshes[0], 0.01f, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, -3.0f));
+	rotateMesh(objectBuffer, meshes[0], 0.01f, glm::vec3(0.0f, 1.0f, 0.0f), meshes[0].center);
+	return true;
 }
 
 void processKeyboardInput(GLFWwindow* const window, ObjectBuffer& objectBuffer, Mesh* const meshes, const int selectedObject) {
@@ -86,9 +111,14 @@ void processKeyboardInput(GLFWwindow* const window, ObjectBuffer& objectBuffer,
 			translateObject(objectBuffer, meshes, selectedObject, direction * moveSpeed);
 }
 
-void update(GLFWwindow* const window, ObjectBuffer& objectBuffer, Mesh* const meshes, const int numMeshes) {
+bool update(GLFWwindow* const window, ObjectBuffer& objectBuffer, BVH& bvh, Mesh* const meshes, const int numMeshes) {
+	//Returns whether the scene or the camera changed, in which case the accumulated frames are outdated
+	ProfileScope scope("update");
+
 	static bool isFirstMousePress = true;
-	static int selectedObject = -1; // -1 = no object selected, 0 -> first sphere, until MAX_SPHERES, then meshes
+	static int selectedObject = -1; // -1 = no object selected, 0 -> first sphere, until numSpheres, then meshes
+
+	bool changed = false;
 
 	double mouseX, mouseY;
 	glfwGetCursorPos(window, &mouseX, &mouseY);
@@ -99,16 +129,12 @@ void update(GLFWwindow* const window, ObjectBuffer& objectBuffer, Mesh* const me
 		bool colorSelected = selectColor(mouseX, mouseY, color);
 
 		if (!colorSelected && isFirstMousePress) {
-			selectedObject = getSelection(objectBuffer, meshes, numMeshes, (glm::vec2(mouseX, mouseY) - glm::vec2(windowWidth / 2, windowHeight / 2)) / windowHeight);
+			selectedObject = getSelection(objectBuffer, bvh, meshes, numMeshes, (glm::vec2(mouseX, mouseY) - glm::vec2(windowWidth / 2, windowHeight / 2)) / windowHeight);
 		}
 
 		if (colorSelected && selectedObject >= 0) {
-			if (selectedObject < MAX_SPHERES) {
-				objectBuffer.spheres[selectedObject].material.color = color;
-			}
-			else {
-				setMeshColor(objectBuffer, meshes[selectedObject - MAX_SPHERES], color);
-			}
+			setObjectColor(objectBuffer, meshes, selectedObject, color);
+			changed = true;
 		}
 
 		isFirstMousePress = false;
@@ -119,174 +145,821 @@ void update(GLFWwindow* const window, ObjectBuffer& objectBuffer, Mesh* const me
 
 	if (selectedObject >= 0) {
 
-		if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-			if (selectedObject < MAX_SPHERES)
-				objectBuffer.spheres[selectedObject].center += glm::vec3(0.0f, 0.0f, 0.1f);
-			else
-				translateMesh(objectBuffer, meshes[selectedObject - MAX_SPHERES], glm::vec3(0.0f, 0.0f, 0.1f));
-		if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-			if (selectedObject < MAX_SPHERES)
-				objectBuffer.spheres[selectedObject].center += glm::vec3(0.0f, 0.0f, -0.1f);
-			else
-				translateMesh(objectBuffer, meshes[selectedObject - MAX_SPHERES], glm::vec3(0.0f, 0.0f, -0.1f));
-		if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-			if (selectedObject < MAX_SPHERES)
-				objectBuffer.spheres[selectedObject].center += glm::vec3(-0.1f, 0.0f, 0.0f);
-			else
-				translateMesh(objectBuffer, meshes[selectedObject - MAX_SPHERES], glm::vec3(-0.1f, 0.0f, 0.0f));
-		if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-			if (selectedObject < MAX_SPHERES)
-				objectBuffer.spheres[selectedObject].center += glm::vec3(0.1f, 0.0f, 0.0f);
-			else
-				translateMesh(objectBuffer, meshes[selectedObject - MAX_SPHERES], glm::vec3(0.1f, 0.0f, 0.0f));
-		if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
-			if (selectedObject < MAX_SPHERES)
-				objectBuffer.spheres[selectedObject].center += glm::vec3(0.0f, 0.1f, 0.0f);
-			else
-				translateMesh(objectBuffer, meshes[selectedObject - MAX_SPHERES], glm::vec3(0.0f, 0.1f, 0.0f));
-		if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
-			if (selectedObject < MAX_SPHERES)
-				objectBuffer.spheres[selectedObject].center += glm::vec3(0.0f, -0.1f, 0.0f);
-			else
-				translateMesh(objectBuffer, meshes[selectedObject - MAX_SPHERES], glm::vec3(0.0f, -0.1f, 0.0f));
+		if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
+			translateObject(objectBuffer, meshes, selectedObject, glm::vec3(0.0f, 0.0f, 0.1f));
+			changed = true;
+		}
+		if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
+			translateObject(objectBuffer, meshes, selectedObject, glm::vec3(0.0f, 0.0f, -0.1f));
+			changed = true;
+		}
+		if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
+			translateObject(objectBuffer, meshes, selectedObject, glm::vec3(-0.1f, 0.0f, 0.0f));
+			changed = true;
+		}
+		if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
+			translateObject(objectBuffer, meshes, selectedObject, glm::vec3(0.1f, 0.0f, 0.0f));
+			changed = true;
+		}
+		if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) {
+			translateObject(objectBuffer, meshes, selectedObject, glm::vec3(0.0f, 0.1f, 0.0f));
+			changed = true;
+		}
+		if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) {
+			translateObject(objectBuffer, meshes, selectedObject, glm::vec3(0.0f, -0.1f, 0.0f));
+			changed = true;
+		}
+
+	}
+
+	changed |= updateCamera();
+
+	{
+		ProfileScope scope("updateScene");
+		changed |= updateScene(objectBuffer, meshes, numMeshes);
+	}
 
+	if (changed) {
+		ProfileScope scope("updateBVH");
+		updateBVH(bvh, objectBuffer);
 	}
 
-	updateCamera();
-	updateScene(objectBuffer, meshes, numMeshes);
-	computeTriangles(objectBuffer);
+	if (objectBuffer.resolution != glm::vec2(windowWidth, windowHeight)) {
+		objectBuffer.resolution = glm::vec2(windowWidth, windowHeight);
+		changed = true;
+	}
 
-	objectBuffer.resolution = glm::vec2(windowWidth, windowHeight);
+	return changed;
 }
 
 
-void render(GLFWwindow* window, ObjectBuffer& objectBuffer, GLuint& VAO, GLuint& UBO, GLuint& UBOIndex, GLuint& shaderProgram) {
+void render(GLFWwindow* window, ObjectBuffer& objectBuffer, BVH& bvh, SceneBuffers& sceneBuffers, Accumulation& accumulation) {
+
+	// The timings of earlier frames that the GPU finished by now
+	collectGpuTimers(gpuTimers);
+
+	if (accumulation.width != windowWidth || accumulation.height != windowHeight) {
+		resizeAccumulation(accumulation, windowWidth, windowHeight);
+		resetAccumulation(objectBuffer);
+	}
+
+	// Read the running average from the last frame and write the updated one to the other frame buffer
+	const int previous = accumulation.current;
+	const int next = 1 - previous;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, accumulation.frameBuffers[next]);
+	glActiveTexture(GL_TEXTURE0 + ACCUMULATION_TEXTURE_UNIT);
+	glBindTexture(GL_TEXTURE_2D, accumulation.textures[previous]);
+	glActiveTexture(GL_TEXTURE0);
+
 	// Clear the screen buffer
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	// Pass data to the uniform buffer object
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(ObjectBuffer), &objectBuffer);
+	// The uniform data changes every frame, the geometry only where the scene was edited
+	{
+		ProfileScope scope("uploadUniforms");
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(UniformData), static_cast<const UniformData*>(&objectBuffer));
+	}
+	{
+		ProfileScope scope("uploadScene");
+		uploadScene(objectBuffer, bvh, sceneBuffers);
+	}
 
 	// Draw the elements using the bound buffers and shader program
-	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+	{
+		ProfileScope scope("draw");
+		GpuTimerScope gpuScope(gpuTimers, "trace");
+		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+	}
+
+	// Copy the running average to the screen
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, accumulation.frameBuffers[next]);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, 0, windowWidth, windowHeight, 0, 0, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	accumulation.current = next;
+	objectBuffer.frameIndex++;
+	objectBuffer.accumulatedSamples += objectBuffer.numSamples;
 		
 	// Swap the back and front buffers to display the rendered frame
+	ProfileScope scope("swapBuffers");
 	glfwSwapBuffers(window);
 }
 
-void exportRender(ObjectBuffer& objectBuffer, GLuint& VAO, GLuint& UBO, GLuint& UBOIndex, GLuint& shaderProgram, int numSamples, int maxBounces, glm::u16vec2 resolution) {
-	
-	//In order to export the render, we need to create a new frame buffer and texture to render to
-	GLuint frameBuffer;
-	glGenFramebuffers(1, &frameBuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
-	
-	GLuint texture;
-	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, resolution.x, resolution.y, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
-	
-	//We now check if the frame buffer is complete
-	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-		std::cerr << "Error: Frame buffer is not complete!\n";
-		return;
+void waitForFence(GLsync& fence) {
+	//Returns once the GPU passed the fence, which is deleted
+	while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+	glDeleteSync(fence);
+	fence = NULL;
+}
+
+void collectPixelCounts(PixelCounts& counts, const bool wait, uint64_t& samples) {
+	//Adds the samples of the counted batches whose counts arrived to `samples`, with `wait` of all of them
+
+	while (counts.count > 0) {
+		const GLuint query = counts.queries[counts.first];
+
+		if (!wait) {
+			GLuint available;
+			glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) break;
+		}
+
+		GLuint pixels;
+		glGetQueryObjectuiv(query, GL_QUERY_RESULT, &pixels);
+
+		samples += static_cast<uint64_t>(pixels) * counts.numSamples[counts.first];
+		if (pixels == 0) counts.convergedTile = counts.tiles[counts.first];
+
+		counts.first = (counts.first + 1) % PIXEL_COUNT_QUERIES;
+		counts.count--;
+	}
+}
+
+void countActivePixels(ObjectBuffer& objectBuffer, PixelCounts& counts, const int tile, uint64_t& samples) {
+	//Counts the pixels of the tile the next batch samples, the ones that didn't converge yet, `collectPixelCounts` adds them up
+	//Draws into the frame buffer the batch is going to write, reading the average the batch reads, so call it right before the batch
+
+	if (counts.count == PIXEL_COUNT_QUERIES) collectPixelCounts(counts, true, samples);
+
+	const int query = (counts.first + counts.count) % PIXEL_COUNT_QUERIES;
+	counts.numSamples[query] = objectBuffer.numSamples;
+	counts.tiles[query] = tile;
+	counts.count++;
+
+	objectBuffer.countPass = 1;
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(UniformData), static_cast<const UniformData*>(&objectBuffer));
+	objectBuffer.countPass = 0;
+
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glBeginQuery(GL_SAMPLES_PASSED, counts.queries[query]);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+	glEndQuery(GL_SAMPLES_PASSED);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
+
+bool renderTiled(ObjectBuffer& objectBuffer, BVH& bvh, SceneBuffers& sceneBuffers, GLuint& shaderProgram, std::vector<glm::vec3>& image, const std::function<bool(float)>& progress, uint64_t& samples) {
+	//Renders the image tile by tile, every tile accumulates its samples batch by batch in a small pair of float frame buffers
+	//The tiles are read back as floats into `image`, bottom row first like on the CPU
+	//With a noise threshold converged pixels take no more samples and a tile stops once all of them did, `samples` returns the samples taken of all pixels
+	//The pixels that didn't converge are counted on the GPU, a tile learns that all of them did a batch or two late, those batches pass the average through
+	//The samples the converged pixels saved then refine the noisiest tiles, planned like on the CPU, `progress` stays at 1 meanwhile
+	//Returns false if `progress` cancelled the render
+
+	const int width = static_cast<int>(objectBuffer.resolution.x);
+	const int height = static_cast<int>(objectBuffer.resolution.y);
+	const int numSamples = objectBuffer.numSamples;
+	const size_t numPixels = static_cast<size_t>(width) * height;
+
+	const int tilesX = (width + EXPORT_TILE_SIZE - 1) / EXPORT_TILE_SIZE;
+	const int tilesY = (height + EXPORT_TILE_SIZE - 1) / EXPORT_TILE_SIZE;
+	const int batchesPerTile = (numSamples + EXPORT_BATCH_SAMPLES - 1) / EXPORT_BATCH_SAMPLES;
+	const int totalBatches = tilesX * tilesY * batchesPerTile;
+
+	image.resize(numPixels);
+
+	//An adaptive export reads the averages back with their squared luminance, the refinement goes on from them
+	const bool adaptive = objectBuffer.noiseThreshold > 0.0f;
+	std::vector<glm::vec4> averages(adaptive ? numPixels : 0);
+
+	Accumulation accumulation;
+	createAccumulation(accumulation, EXPORT_TILE_SIZE, EXPORT_TILE_SIZE, shaderProgram);
+
+	//A tile arrives in the image while the next one renders
+	Readback readback;
+	createReadback(readback);
+
+	PixelCounts counts;
+	createPixelCounts(counts);
+
+	uploadScene(objectBuffer, bvh, sceneBuffers);
+
+	//Alpha holds the average squared luminance while exporting, it must not blend
+	const GLboolean blend = glIsEnabled(GL_BLEND);
+	glDisable(GL_BLEND);
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+	//A fence after every batch, the next batch waits for the oldest once EXPORT_BATCHES_IN_FLIGHT are queued
+	GLsync batchFences[EXPORT_BATCHES_IN_FLIGHT];
+	int firstFence = 0;
+	int numFences = 0;
+
+	int finishedBatches = 0; // Queued, the progress runs at most EXPORT_BATCHES_IN_FLIGHT ahead of the GPU
+
+	samples = 0;
+
+	auto sampleTile = [&](const int tileWidth, const int tileHeight, const int tile, const int maxSamples) {
+		//Takes batches of the tile set up in the object buffer until its pixels took `maxSamples` or converged, returns false if cancelled
+
+		while (objectBuffer.accumulatedSamples < maxSamples && counts.convergedTile != tile) {
+
+			objectBuffer.numSamples = std::min(EXPORT_BATCH_SAMPLES, maxSamples - objectBuffer.accumulatedSamples);
+
+			const int previous = accumulation.current;
+			const int next = 1 - previous;
+
+			glBindFramebuffer(GL_FRAMEBUFFER, accumulation.frameBuffers[next]);
+			glActiveTexture(GL_TEXTURE0 + ACCUMULATION_TEXTURE_UNIT);
+			glBindTexture(GL_TEXTURE_2D, accumulation.textures[previous]);
+			glActiveTexture(GL_TEXTURE0);
+
+			//Before the minimum every pixel is sampled
+			if (adaptive && objectBuffer.accumulatedSamples >= ADAPTIVE_MIN_SAMPLES) {
+				countActivePixels(objectBuffer, counts, tile, samples);
+			}
+			else {
+				samples += static_cast<uint64_t>(tileWidth) * tileHeight * objectBuffer.numSamples;
+			}
+
+			glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(UniformData), static_cast<const UniformData*>(&objectBuffer));
+			{
+				GpuTimerScope gpuScope(gpuTimers, "exportBatch");
+				glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+			}
+
+			batchFences[(firstFence + numFences) % EXPORT_BATCHES_IN_FLIGHT] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			numFences++;
+
+			if (numFences == EXPORT_BATCHES_IN_FLIGHT) {
+				ProfileScope scope("exportBatch");
+				waitForFence(batchFences[firstFence]);
+				firstFence = (firstFence + 1) % EXPORT_BATCHES_IN_FLIGHT;
+				numFences--;
+			}
+			collectGpuTimers(gpuTimers);
+			finishReadbacks(readback, false);
+			collectPixelCounts(counts, false, samples);
+
+			accumulation.current = next;
+			objectBuffer.frameIndex++;
+			objectBuffer.accumulatedSamples += objectBuffer.numSamples;
+			++finishedBatches;
+
+			if (progress && !progress(std::min(float(finishedBatches) / totalBatches, 1.0f))) return false;
+		}
+
+		return true;
+	};
+
+	bool cancelled = false;
+	int tile = 0;
+
+	for (int tileY = 0; tileY < height && !cancelled; tileY += EXPORT_TILE_SIZE) {
+		for (int tileX = 0; tileX < width && !cancelled; tileX += EXPORT_TILE_SIZE, ++tile) {
+
+			const int tileWidth = std::min(EXPORT_TILE_SIZE, width - tileX);
+			const int tileHeight = std::min(EXPORT_TILE_SIZE, height - tileY);
+
+			glViewport(0, 0, tileWidth, tileHeight);
+			objectBuffer.tileOffset = glm::ivec2(tileX, tileY);
+			resetAccumulation(objectBuffer);
+
+			cancelled = !sampleTile(tileWidth, tileHeight, tile, numSamples);
+
+			if (!cancelled) {
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, accumulation.frameBuffers[accumulation.current]);
+				if (adaptive) {
+					readPixelsAsync(readback, tileWidth, tileHeight, GL_RGBA, &averages[static_cast<size_t>(tileY) * width + tileX].x, 4 * width);
+				}
+				else {
+					readPixelsAsync(readback, tileWidth, tileHeight, GL_RGB, &image[static_cast<size_t>(tileY) * width + tileX].x, 3 * width);
+				}
+
+				//The batches a converged tile skipped count as finished
+				finishedBatches = tile * batchesPerTile + batchesPerTile;
+			}
+		}
+	}
+
+	if (adaptive && !cancelled) {
+		//Every pixel converged or took `numSamples`, what is left of the budget goes to the noisiest tiles
+		{
+			ProfileScope scope("readback");
+			finishReadbacks(readback, true);
+		}
+		collectPixelCounts(counts, true, samples);
+
+		std::vector<float> averageSquared(numPixels);
+		for (size_t i = 0; i < numPixels; ++i) {
+			image[i] = glm::vec3(averages[i]);
+			averageSquared[i] = averages[i].a;
+		}
+
+		objectBuffer.numSamples = numSamples;
+		const std::vector<RefinedTile> refined = planRefinement(objectBuffer, image, averageSquared, static_cast<uint64_t>(numPixels) * numSamples - samples);
+
+		//The averages of a tile are uploaded out of the rows of the whole image
+		GLint rowLength;
+		glGetIntegerv(GL_UNPACK_ROW_LENGTH, &rowLength);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+
+		for (size_t i = 0; i < refined.size() && !cancelled; ++i) {
+			const Tile& area = refined[i].tile;
+
+			glViewport(0, 0, area.width, area.height);
+			objectBuffer.tileOffset = glm::ivec2(area.x, area.y);
+
+			//The noisy pixels took every batch of the first pass, they go on with the next one
+			objectBuffer.frameIndex = batchesPerTile;
+			objectBuffer.accumulatedSamples = numSamples;
+
+			glActiveTexture(GL_TEXTURE0 + ACCUMULATION_TEXTURE_UNIT);
+			glBindTexture(GL_TEXTURE_2D, accumulation.textures[accumulation.current]);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, area.width, area.height, GL_RGBA, GL_FLOAT, &averages[static_cast<size_t>(area.y) * width + area.x].x);
+			glActiveTexture(GL_TEXTURE0);
+
+			cancelled = !sampleTile(area.width, area.height, tile + static_cast<int>(i), refined[i].maxSamples);
+
+			if (!cancelled) {
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, accumulation.frameBuffers[accumulation.current]);
+				readPixelsAsync(readback, area.width, area.height, GL_RGB, &image[static_cast<size_t>(area.y) * width + area.x].x, 3 * width);
+			}
+		}
+
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLength);
+	}
+
+	for (; numFences > 0; --numFences) {
+		waitForFence(batchFences[firstFence]);
+		firstFence = (firstFence + 1) % EXPORT_BATCHES_IN_FLIGHT;
+	}
+
+	{
+		ProfileScope scope("readback");
+		finishReadbacks(readback, true);
+	}
+	collectPixelCounts(counts, true, samples);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if (blend) glEnable(GL_BLEND);
+
+	objectBuffer.numSamples = numSamples;
+	objectBuffer.tileOffset = glm::ivec2(0);
+
+	freeAccumulation(accumulation);
+	freeReadback(readback);
+	freePixelCounts(counts);
+
+	return !cancelled;
+}
+
+void renderFeaturesTiled(ObjectBuffer& objectBuffer, BVH& bvh, SceneBuffers& sceneBuffers, Features& features) {
+	//The first hit features for the denoiser, one pass of the shader per tile into both attachments of a feature frame buffer
+	//Averaged over `objectBuffer.numSamples` jittered primary rays, like `renderFeatures` on the CPU
+
+	const int width = static_cast<int>(objectBuffer.resolution.x);
+	const int height = static_cast<int>(objectBuffer.resolution.y);
+
+	features.albedo.resize(static_cast<size_t>(width) * height);
+	features.normalDepth.resize(static_cast<size_t>(width) * height);
+
+	FeatureTarget target;
+	createFeatureTarget(target, EXPORT_TILE_SIZE, EXPORT_TILE_SIZE);
+
+	Readback readback;
+	createReadback(readback);
+
+	uploadScene(objectBuffer, bvh, sceneBuffers);
+
+	//The distance is in alpha, it must not blend
+	const GLboolean blend = glIsEnabled(GL_BLEND);
+	glDisable(GL_BLEND);
+
+	objectBuffer.featurePass = 1;
+	resetAccumulation(objectBuffer);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, target.frameBuffer);
+
+	for (int tileY = 0; tileY < height; tileY += EXPORT_TILE_SIZE) {
+		for (int tileX = 0; tileX < width; tileX += EXPORT_TILE_SIZE) {
+
+			const int tileWidth = std::min(EXPORT_TILE_SIZE, width - tileX);
+			const int tileHeight = std::min(EXPORT_TILE_SIZE, height - tileY);
+
+			glViewport(0, 0, tileWidth, tileHeight);
+			objectBuffer.tileOffset = glm::ivec2(tileX, tileY);
+
+			glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(UniformData), static_cast<const UniformData*>(&objectBuffer));
+			{
+				GpuTimerScope gpuScope(gpuTimers, "features");
+				glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+			}
+
+			const size_t offset = static_cast<size_t>(tileY) * width + tileX;
+			glReadBuffer(GL_COLOR_ATTACHMENT0);
+			readPixelsAsync(readback, tileWidth, tileHeight, GL_RGBA, &features.albedo[offset].x, 4 * width);
+			glReadBuffer(GL_COLOR_ATTACHMENT1);
+			readPixelsAsync(readback, tileWidth, tileHeight, GL_RGBA, &features.normalDepth[offset].x, 4 * width);
+		}
 	}
 
-	//We now set the sample and bounce count, but also save the old values so we can reset them later
-	int oldNumSamples = objectBuffer.numSamples;
-	int oldMaxBounces = objectBuffer.maxBounces;
+	{
+		ProfileScope scope("featureReadback");
+		finishReadbacks(readback, true);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	collectGpuTimers(gpuTimers);
+
+	if (blend) glEnable(GL_BLEND);
+
+	objectBuffer.featurePass = 0;
+	objectBuffer.tileOffset = glm::ivec2(0);
+
+	freeFeatureTarget(target);
+	freeReadback(readback);
+}
+
+//What an export changes in the object buffer, `endExport` puts it back
+struct ExportState {
+	int numSamples;
+	int maxBounces;
+	int sampler;
+	int frameIndex;
+	int accumulatedSamples;
+	int sampleOffset;
+	float jitterStrenght;
+	glm::vec2 resolution;
+};
+
+ExportState beginExport(ObjectBuffer& objectBuffer, int numSamples, int maxBounces, glm::u16vec2 resolution, float noiseThreshold, int sampler) {
+	//Sets the object buffer up for an export, every export starts from scratch, nothing is accumulated
+
+	const ExportState state = { objectBuffer.numSamples, objectBuffer.maxBounces, objectBuffer.sampler, objectBuffer.frameIndex,
+		objectBuffer.accumulatedSamples, objectBuffer.sampleOffset, objectBuffer.jitterStrenght, objectBuffer.resolution };
+
 	objectBuffer.numSamples = numSamples;
 	objectBuffer.maxBounces = maxBounces;
+	objectBuffer.noiseThreshold = noiseThreshold;
+	objectBuffer.sampler = sampler;
+	objectBuffer.sampleOffset = 0;
 
-	//Set the resolution of the render
-	glViewport(0, 0, resolution.x, resolution.y);
+	//The jitter is relative to the height of the image, it has to shrink with the pixels
 	objectBuffer.resolution = glm::vec2(resolution.x, resolution.y);
 	objectBuffer.jitterStrenght *= windowWidth;
 	objectBuffer.jitterStrenght /= resolution.x;
-	
+
 	objectBuffer.noGUI = 1;
-		
-	//We now need to do the usual rendering process
-	glClear(GL_COLOR_BUFFER_BIT);
-	
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(ObjectBuffer), &objectBuffer);
-	
-	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-	
-	//We now need to read the data from the texture and write it to a file
-	unsigned char* data = new unsigned char[resolution.x * resolution.y * 3];
-	glReadPixels(0, 0, resolution.x, resolution.y, GL_RGB, GL_UNSIGNED_BYTE, data);
-	
-	std::string filename = "render_" + std::to_string(numSamples) + "S_" + std::to_string(maxBounces) + "B_" + std::to_string(resolution.x) + "x" + std::to_string(resolution.y) + ".png";
-	stbi_flip_vertically_on_write(true);
-	stbi_write_png(filename.c_str(), resolution.x, resolution.y, 3, data, resolution.x * 3);
 
-	std::cout << "Render exported to " << filename << std::endl;
-	
-	delete[] data;
+	resetAccumulation(objectBuffer);
+
+	return state;
+}
+
+void endExport(ObjectBuffer& objectBuffer, const ExportState& state, Backend backend) {
 
-	//We now need to reset the sample and bounce count
-	objectBuffer.numSamples = oldNumSamples;
-	objectBuffer.maxBounces = oldMaxBounces;
+	objectBuffer.numSamples = state.numSamples;
+	objectBuffer.maxBounces = state.maxBounces;
+	objectBuffer.noiseThreshold = 0.0f;
+	objectBuffer.sampler = state.sampler;
+	objectBuffer.sampleOffset = state.sampleOffset;
 
-	//We now need to reset the resolution
-	glViewport(0, 0, windowWidth, windowHeight);
-	objectBuffer.resolution = glm::vec2(windowWidth, windowHeight);
-	objectBuffer.jitterStrenght *= resolution.x;
-	objectBuffer.jitterStrenght /= windowWidth;
+	objectBuffer.resolution = state.resolution;
+	objectBuffer.jitterStrenght = state.jitterStrenght;
 
 	objectBuffer.noGUI = 0;
+	objectBuffer.frameIndex = state.frameIndex;
+	objectBuffer.accumulatedSamples = state.accumulatedSamples;
+
+	if (backend == Backend::GPU) {
+		glViewport(0, 0, windowWidth, windowHeight);
+	}
+}
+
+bool traceExport(ObjectBuffer& objectBuffer, BVH& bvh, SceneBuffers& sceneBuffers, GLuint& shaderProgram, Backend backend, std::vector<glm::vec3>& image, const std::function<bool(float)>& progress, uint64_t& samples) {
+	//Traces the image with the settings `beginExport` put in the object buffer, returns false if `progress` cancelled it
+
+	if (backend == Backend::GPU) {
+		return renderTiled(objectBuffer, bvh, sceneBuffers, shaderProgram, image, progress, samples);
+	}
+
+	//The CPU backend traces the same paths as the shader, tile by tile on every hardware thread
+	RenderStats stats;
+	const bool completed = renderCPU(objectBuffer, bvh, image, EXPORT_BATCH_SAMPLES, progress, &stats);
+	samples = stats.samples;
+	return completed;
+}
+
+void denoiseExport(ObjectBuffer& objectBuffer, BVH& bvh, SceneBuffers& sceneBuffers, Backend backend, std::vector<glm::vec3>& image) {
+	//Filters the traced image guided by its first hit features, see Denoiser.h
+
+	//The features need far fewer samples than the image, they don't depend on the light
+	Features features;
+	const int numSamples = objectBuffer.numSamples;
+	objectBuffer.numSamples = std::min(DENOISE_FEATURE_SAMPLES, numSamples);
+
+	if (backend == Backend::GPU) {
+		renderFeaturesTiled(objectBuffer, bvh, sceneBuffers, features);
+	}
+	else {
+		renderFeatures(objectBuffer, bvh, features);
+	}
+
+	objectBuffer.numSamples = numSamples;
+
+	ProfileScope scope("denoise");
+	denoise(image, features, static_cast<int>(objectBuffer.resolution.x), static_cast<int>(objectBuffer.resolution.y));
+}
+
+std::string exportFilename(int numSamples, int maxBounces, glm::u16vec2 resolution) {
+	return "render_" + std::to_string(numSamples) + "S_" + std::to_string(maxBounces) + "B_" + std::to_string(resolution.x) + "x" + std::to_string(resolution.y) + ".png";
+}
+
+bool exportRender(ObjectBuffer& objectBuffer, BVH& bvh, SceneBuffers& sceneBuffers, GLuint& shaderProgram, int numSamples, int maxBounces, glm::u16vec2 resolution, Backend backend = Backend::GPU, const std::function<bool(float)>& progress = nullptr, float noiseThreshold = 0.0f, int sampler = SAMPLER_SOBOL, bool denoiseImage = false, const char* outputPath = nullptr) {
+	//`progress` is called between batches of samples with the finished fraction of the render, returning false cancels the export
+	//With a `noiseThreshold` above 0 pixels stop sampling once their relative error is below it, the samples they save go to the noisiest pixels, `numSamples` per pixel is the budget
+	//`sampler` is one of the SAMPLER_ constants, interactive frames use blue noise, exports Sobol points by default
+	//With `denoiseImage` the image is filtered guided by its first hit features before it is written, see Denoiser.h
+	//The image is written to `outputPath`, or to a file named after the settings in the working directory, by the image writer thread
+	//Returns false if the export was cancelled, whether the image could be written is reported by `takeWrittenImages`
+
+	ProfileScope scope("exportRender");
+
+	const ExportState state = beginExport(objectBuffer, numSamples, maxBounces, resolution, noiseThreshold, sampler);
+
+	std::vector<glm::vec3> image;
+	uint64_t samples = 0;
+
+	bool completed = traceExport(objectBuffer, bvh, sceneBuffers, shaderProgram, backend, image, progress, samples);
+
+	if (completed && denoiseImage) {
+		denoiseExport(objectBuffer, bvh, sceneBuffers, backend, image);
+	}
 	
-	//We now need to delete the frame buffer and texture
-	glDeleteFramebuffers(1, &frameBuffer);
-	glDeleteTextures(1, &texture);
-		
+	if (completed) {
+		const std::string filename = outputPath ? outputPath : exportFilename(numSamples, maxBounces, resolution);
+
+		if (noiseThreshold > 0.0f) {
+			std::cout << "Adaptive sampling took " << double(samples) / (double(resolution.x) * resolution.y) << " of at most " << numSamples << " samples per pixel\n";
+		}
+
+		//Encoding takes seconds for large images, the export goes on meanwhile
+		queueImage(imageWriter, image, resolution, filename);
+	}
+	else {
+		std::cout << "Render export cancelled" << std::endl;
+	}
+
+	endExport(objectBuffer, state, backend);
+
+	return completed;
+}
+
+#ifndef _WIN32
+void failServerJob(RenderServer& server, const ServerJob& job, const std::string& reason) {
+	sendToClient(server, job.client, "failed " + std::to_string(job.id) + " " + reason);
+	removeServerJob(server, job.id);
+}
+
+void serveRenderJobs(RenderServer& server, SceneBuffers& sceneBuffers, GLuint& shaderProgram) {
+	//Runs the jobs of the render server slice by slice until it is shut down and they are done, see RenderServer.h
+
+	WarmScenes warm;
+	std::weak_ptr<WarmScene> uploaded; // Scene the scene buffers hold, expires if it is dropped
+	int running = -1; // Job of the last slice
+
+	std::cout << "Serving render jobs on " << server.path << std::endl;
+
+	while (!server.shuttingDown || !server.jobs.empty()) {
+
+		//Jobs are done once the image writer wrote their image
+		for (const WrittenImage& written : takeWrittenImages(imageWriter)) {
+			const ServerJob* job = findServerJob(server, written.tag);
+			if (!job) continue;
+			if (written.written) {
+				sendToClient(server, job->client, "done " + std::to_string(job->id) + " " + written.filename);
+				removeServerJob(server, job->id);
+			}
+			else {
+				failServerJob(server, *job, "could not write " + written.filename);
+			}
+		}
+		if (server.shuttingDown && server.jobs.empty()) break;
+
+		//Only block on the socket while there is nothing to render, and only briefly while images are written
+		ServerJob* job = nextServerJob(server);
+		pollRenderServer(server, job ? 0 : server.jobs.empty() ? -1 : SERVER_WRITE_POLL_MILLISECONDS);
+
+		job = nextServerJob(server);
+		if (!job) continue;
+
+		if (job->id != running) {
+			const ServerJob* previous = findServerJob(server, running);
+			if (previous) sendToClient(server, previous->client, "preempted " + std::to_string(previous->id) + " by " + std::to_string(job->id));
+			if (job->started) sendJobStatus(server, *job, "resumed");
+			running = job->id;
+		}
+
+		//A job holds on to the scene of its first slice, so all of its slices render the scene file as it was when it started
+		if (!job->scene) {
+			job->scene = acquireScene(warm, job->options.scenePath);
+			if (!job->scene) {
+				failServerJob(server, *job, "could not load scene " + job->options.scenePath);
+				continue;
+			}
+		}
+		job->scene->lastUsed = ++warm.uses;
+		WarmScene* scene = job->scene.get();
+
+		RenderOptions& options = job->options;
+
+		if (!job->started) {
+			resolveRenderOptions(options, scene->settings);
+			if (options.noiseThreshold > 0.0f) {
+				//Whether a pixel converged depends on the samples before, a slice doesn't know them
+				failServerJob(server, *job, "adaptive sampling is not supported by the server");
+				continue;
+			}
+			job->started = true;
+			sendJobStatus(server, *job, "started");
+		}
+
+		if (options.backend == Backend::GPU && uploaded.lock() != job->scene) {
+			markSceneChanged(scene->objectBuffer, scene->bvh);
+			uploaded = job->scene;
+		}
+
+		ProfileScope scope("jobSlice");
+
+		ObjectBuffer& objectBuffer = scene->objectBuffer;
+		const int sliceSamples = std::min(EXPORT_BATCH_SAMPLES, options.samples - job->samplesDone);
+
+		//The slice goes on with the samples after the ones already averaged
+		const ExportState state = beginExport(objectBuffer, sliceSamples, options.bounces, options.resolution, 0.0f, options.sampler);
+		objectBuffer.sampleOffset = job->samplesDone;
+
+		std::vector<glm::vec3> slice;
+		uint64_t samples = 0;
+		traceExport(objectBuffer, scene->bvh, sceneBuffers, shaderProgram, options.backend, slice, nullptr, samples);
+
+		if (job->samplesDone == 0) {
+			job->image.swap(slice);
+		}
+		else {
+			const float weight = float(sliceSamples) / float(job->samplesDone + sliceSamples);
+			for (size_t i = 0; i < slice.size(); ++i) {
+				job->image[i] += (slice[i] - job->image[i]) * weight;
+			}
+		}
+		job->samplesDone += sliceSamples;
+
+		const bool finished = job->samplesDone >= options.samples;
+
+		if (finished && options.denoise) {
+			objectBuffer.sampleOffset = 0;
+			objectBuffer.numSamples = options.samples;
+			denoiseExport(objectBuffer, scene->bvh, sceneBuffers, options.backend, job->image);
+		}
+
+		endExport(objectBuffer, state, options.backend);
+
+		if (!finished) {
+			sendToClient(server, job->client, "progress " + std::to_string(job->id) + " " + std::to_string(job->samplesDone * 100 / options.samples));
+			continue;
+		}
+
+		//The next job starts while the image is written
+		const std::string filename = options.outputPath.empty() ? exportFilename(options.samples, options.bounces, options.resolution) : options.outputPath;
+		queueImage(imageWriter, job->image, options.resolution, filename, job->id);
+		job->image = std::vector<glm::vec3>();
+		job->scene.reset();
+		job->writing = true;
+		running = -1;
+	}
+
+	closeRenderServer(server);
 }
+#endif
 
-int main() {
+int main(int argc, char* argv[]) {
 	
 	GLFWwindow* window = nullptr;	
 
+	// The options are listed in RenderOptions.h. `--headless` exits with 0 once the image was written, `--serve` runs until a client
+	// shuts the server down, both trace on the CPU unless `--gpu` is passed, which traces in a window that is never shown
+	RenderOptions options;
+	options.scenePath = DEFAULT_SCENE_PATH;
+	if (!parseRenderOptions(std::vector<std::string>(argv + 1, argv + argc), options)) return 1;
+
+	const bool serve = !options.servePath.empty();
+	const bool headless = options.headless || serve;
+	const char* profilePath = options.profilePath.empty() ? nullptr : options.profilePath.c_str();
+
+#ifdef _WIN32
+	if (serve) {
+		std::cerr << "Error: The render server needs Unix domain sockets\n";
+		return 1;
+	}
+#endif
+
+	// Batch nodes usually have no GPU, so headless renders trace on the CPU unless told otherwise
+	if (headless && !options.backendChosen) options.backend = Backend::CPU;
+	const bool useGL = !headless || options.backend == Backend::GPU;
+
 	GLuint VBO, VAO, EBO;
 	GLuint UBO, UBOIndex; // Uniform Buffer Object to pass data to the shader
+	SceneBuffers sceneBuffers; // Buffer textures to pass the geometry and the bounding volume hierarchy to the shader
+	Accumulation accumulation; // Float frame buffers to average the frames until the scene changes
 
 	GLuint shaderTraceProgram;
 
-	Mesh meshes[2];
-	int numMeshes = 0;
+	std::vector<Mesh> meshes;
 	ObjectBuffer objectBuffer;
+	BVH bvh;
+
+	if (profilePath) {
+		profilerEnabled = true;
+		nameProfileThread("main");
+	}
 	
-	initGL(window);
+	if (useGL && !initGL(window, !headless)) return 1;
 
-	if (!loadShader("shaders/trace", shaderTraceProgram)) return -1;
-	createBuffers(objectBuffer, VAO, VBO, EBO, UBO, UBOIndex, shaderTraceProgram);
+	std::cout << "CPU kernels: " << cpuISAName(cpuISA) << "\n";
 
-	initBufferData(objectBuffer, meshes);
-	
-	createSphere(objectBuffer, glm::vec3(15.0f, 15.0f, .0f), 20.0f, Material{ glm::vec3(1.0f, 0.0f, 0.0f), 0.0f, glm::vec3(1.0f) });
-	createSphere(objectBuffer, glm::vec3(-1.5f, .2f, -4.0f), 1.0f, Material{ glm::vec3(1.0f, 1.0f, 0.0f), 0.2f, glm::vec3(0.0f) });
-	
-	if (loadMesh(objectBuffer, "meshes/ico_sphere.obj", meshes[0])) {
-		setMeshMaterial(objectBuffer, meshes[0], Material{ glm::vec3(1.0f, 0.0f, 1.0f), .3f, glm::vec3(0.0f) });
-		translateMesh(objectBuffer, meshes[0], glm::vec3(0.0f, 0.0f, -3.0f));
-		numMeshes++;
+	if (useGL) {
+		if (!loadShader("shaders/trace", shaderTraceProgram)) return -1;
+		createBuffers(objectBuffer, VAO, VBO, EBO, UBO, UBOIndex, shaderTraceProgram);
+		createSceneBuffers(sceneBuffers, shaderTraceProgram);
+		createAccumulation(accumulation, windowWidth, windowHeight, shaderTraceProgram);
+		createGpuTimers(gpuTimers);
 	}
-	
-	if (loadMesh(objectBuffer, "meshes/plane.obj", meshes[1])) {
-		setMeshMaterial(objectBuffer, meshes[1], Material{ glm::vec3(1.0f, 1.0f, 1.0f), 0.f, glm::vec3(0.0f) });
-		translateMesh(objectBuffer, meshes[1], glm::vec3(0.0f, -.5f, -3.0f));
-		numMeshes++;
+
+	initBufferData(objectBuffer);
+
+	// The server loads the scenes of its jobs instead
+	RenderSettings sceneSettings;
+	const bool sceneLoaded = !serve && loadScene(options.scenePath.c_str(), objectBuffer, bvh, meshes, sceneSettings);
+	const int numMeshes = static_cast<int>(meshes.size());
+
+	// The command line first, then the scene file, then the defaults
+	resolveRenderOptions(options, sceneSettings);
+	const char* outputPath = options.outputPath.empty() ? nullptr : options.outputPath.c_str();
+
+	if (headless) {
+		bool succeeded = false;
+
+#ifndef _WIN32
+		if (serve) {
+			RenderServer server;
+			server.backend = options.backend;
+			server.hasGL = useGL;
+			succeeded = openRenderServer(server, options.servePath);
+			if (succeeded) serveRenderJobs(server, sceneBuffers, shaderTraceProgram);
+		}
+#endif
+
+		if (!serve) {
+			// Progress in whole steps of 10%, the log of a batch job isn't a terminal
+			auto batchProgress = [](float progress) {
+				static int reported = -1;
+				const int percent = static_cast<int>(progress * 100.0f);
+				if (percent / 10 != reported) {
+					reported = percent / 10;
+					std::cout << "Exporting... " << percent << "%" << std::endl;
+				}
+				return true;
+			};
+
+			succeeded = sceneLoaded && exportRender(objectBuffer, bvh, sceneBuffers, shaderTraceProgram, options.samples, options.bounces, options.resolution, options.backend, batchProgress, options.noiseThreshold, options.sampler, options.denoise, outputPath);
+		}
+
+		// The exit code tells whether the image made it to the disk
+		stopImageWriter(imageWriter);
+		for (const WrittenImage& written : takeWrittenImages(imageWriter)) succeeded &= written.written;
+
+		if (profilePath) {
+			if (useGL) collectGpuTimers(gpuTimers);
+			if (writeProfile(profilePath)) std::cout << "Profile written to " << profilePath << "\n";
+		}
+
+		if (useGL) {
+			freeBuffers(VAO, VBO, EBO, UBO);
+			freeSceneBuffers(sceneBuffers);
+			freeAccumulation(accumulation);
+			freeGpuTimers(gpuTimers);
+			glfwTerminate();
+		}
+
+		return succeeded ? 0 : 1;
 	}
 
+	if (!sceneLoaded) return 1;
+
 	// Set the clear color for the screen
 	glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+	// Report the progress of the export, closing the window cancels it
+	auto exportProgress = [window](float progress) {
+		std::cout << "\rExporting... " << static_cast<int>(progress * 100.0f) << "%" << std::flush;
+		if (progress >= 1.0f) std::cout << "\n";
+		glfwPollEvents();
+		return !glfwWindowShouldClose(window);
+	};
 
-	computeTriangles(objectBuffer);
-	exportRender(objectBuffer, VAO, UBO, UBOIndex, shaderTraceProgram, 1000, 2, p8k);
+	exportRender(objectBuffer, bvh, sceneBuffers, shaderTraceProgram, options.samples, options.bounces, options.resolution, options.backend, exportProgress, options.noiseThreshold, options.sampler, options.denoise, outputPath);
 
 	unsigned int frames = 0;
 
@@ -298,21 +971,40 @@ int main() {
 		// Check for input events
 		glfwPollEvents();
 
-		update(window, objectBuffer, meshes, numMeshes);
+		// Start averaging from scratch whenever the scene or the camera changed
+		if (update(window, objectBuffer, bvh, meshes.data(), numMeshes)) {
+			resetAccumulation(objectBuffer);
+		}
 
 		// Render the scene
-		render(window, objectBuffer, VAO, UBO, UBOIndex, shaderTraceProgram);
+		render(window, objectBuffer, bvh, sceneBuffers, accumulation);
 
 		++frames;
+
+		if (dumpProfile && profilePath && writeProfile(profilePath)) {
+			std::cout << "Profile written to " << profilePath << "\n";
+		}
+		dumpProfile = false;
 	}
 	
 	std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double, std::milli> time_span = t2 - t1;
 	std::cout << "Executed " << frames << " frames in " << time_span.count() / 1000.0 << " seconds.\n";
 	std::cout << "Average FPS: " << frames / (time_span.count() / 1000.0) << "\n";
+
+	// An export may still be written
+	stopImageWriter(imageWriter);
+
+	if (profilePath) {
+		collectGpuTimers(gpuTimers);
+		if (writeProfile(profilePath)) std::cout << "Profile written to " << profilePath << "\n";
+	}
 	
 	// Clean up
 	freeBuffers(VAO, VBO, EBO, UBO);
+	freeSceneBuffers(sceneBuffers);
+	freeAccumulation(accumulation);
+	freeGpuTimers(gpuTimers);
 	glfwTerminate();
 	
 	
@@ -1,13 +1,16 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <algorithm>
+#include <climits>
+#include <vector>
 
 struct Material {
 	glm::vec3 color;
 	float smoothness;
 
 	glm::vec3 emission;
-	float padding;
+	float padding = 0.0f;
 };
 
 struct Sphere {
@@ -17,31 +20,45 @@ struct Sphere {
 	Material material;
 };
 
-struct Triangle {
-	glm::vec3 v0;
-	float pad0;
-
-	glm::vec3 v1;
-	float pad1;
-
-	glm::vec3 v2;
-	float pad2;
+struct Vertex {
+	glm::vec3 position;
+	float padding;
+};
 
-	glm::vec3 edge1;
-	float pad3;
+//Triangles only reference their vertices and their material, edges and normals are derived when intersecting
+struct Triangle {
+	glm::ivec3 indices; // Into `ObjectBuffer::vertices`
+	int material; // Into `ObjectBuffer::materials`
+};
 
-	glm::vec3 edge2;
-	float pad4;
+//The vertices and triangles of a loaded mesh file in object space, shared by every instance of it
+struct Geometry {
+	int firstTriangle;
+	int lastTriangle;
+	int firstVertex;
+	int lastVertex;
+};
 
-	glm::vec3 normal;
-	float pad5;
+//A geometry placed in the world, rays are moved into object space instead of moving the vertices
+struct Instance {
+	glm::mat4 transform; // Object to world
+	glm::mat4 inverseTransform; // World to object
+	int geometry; // Into `ObjectBuffer::geometries`
+	int material; // Into `ObjectBuffer::materials`, used for every triangle of the geometry, -1 keeps the materials of the triangles
+};
 
-	Material material;
+//A sphere or triangle with an emission, sampled directly by next event estimation, see Lights.h
+//Triangles are stored in world space, so the shader can sample them without the transform of their instance
+struct Light {
+	glm::vec4 v0; // Center and radius of a sphere, first vertex of a triangle with a radius of 0
+	glm::vec4 v1; // Second vertex and area of a triangle
+	glm::vec4 v2; // Third vertex of a triangle
+	glm::vec4 emission;
 };
 
+//Handle to a mesh in the scene
 struct Mesh {
-	int firstTriangle;
-	int lastTriangle;
+	int instance; // Into `ObjectBuffer::instances`
 	bool wasLoaded;
 	glm::vec3 center;
 };
@@ -60,8 +77,8 @@ struct Camera {
 	float pad3;
 };
 
-//The object buffer can be passed as a uniform buffer to the shader
-struct ObjectBuffer {
+//The uniform data can be passed as a uniform buffer to the shader
+struct UniformData {
 
 	glm::vec2 resolution; // 1, 2
 	int numSpheres; // 3
@@ -72,8 +89,69 @@ struct ObjectBuffer {
 	float jitterStrenght;
 	int noGUI;
 
+	int frameIndex; // Number of frames (or sample batches) averaged so far, also decorrelates the random numbers of consecutive frames
+	int accumulatedSamples; // Number of samples per pixel in the running average
+	glm::ivec2 tileOffset; // Position of the rendered tile in the image, (0, 0) unless exporting
+
+	int numInstances;
+	float noiseThreshold; // Exports stop sampling a pixel once its relative error is below this, 0 takes exactly `numSamples` samples
+	int numLights;
+	int sampler; // Where the random numbers of the paths come from, one of the SAMPLER_ constants of Sampler.h
+
+	int featurePass; // 1 while an export renders the first hit features for the denoiser instead of the image
+	int sampleOffset; // Added to the index of every sample (and to the seed of the random stream), so a render can go on where another one stopped
+	int countPass; // 1 while an export counts the pixels that didn't converge yet, only those are drawn
+	int pad6;
+
 	Camera camera;
+};
+
+//Elements of a vector that changed since it was last uploaded, empty if `first > last`
+struct DirtyRange {
+	int first = INT_MAX;
+	int last = -1;
+
+	void add(const int from, const int to) {
+		first = std::min(first, from);
+		last = std::max(last, to);
+	}
+
+	void add(const int index) {
+		add(index, index);
+	}
+
+	bool empty() const {
+		return first > last;
+	}
+
+	void clear() {
+		first = INT_MAX;
+		last = -1;
+	}
+};
+
+//Everything the scene edit functions in Bodies.h changed, so only that has to be uploaded
+struct SceneChanges {
+	DirtyRange spheres;
+	DirtyRange vertices;
+	DirtyRange triangles;
+	DirtyRange materials;
+	DirtyRange lights;
+	bool instances = false; // The top level of the BVH has to be rebuilt
+};
+
+//The object buffer holds the whole scene
+//Its uniform data goes to the uniform buffer, the geometry goes to buffer textures, so there is no limit on the scene size
+//`numSpheres`, `numTriangles`, `numInstances` and `numLights` always match the size of the vectors
+struct ObjectBuffer : UniformData {
+
+	std::vector<Sphere> spheres;
+	std::vector<Vertex> vertices;
+	std::vector<Triangle> triangles;
+	std::vector<Material> materials;
+	std::vector<Geometry> geometries;
+	std::vector<Instance> instances;
+	std::vector<Light> lights; // Derived from the materials of the spheres and the instances by `buildLights`
 
-	Sphere spheres[MAX_SPHERES];
-	Triangle triangles[MAX_TRIANGLES];
+	SceneChanges changes;
 };
\ No newline at end of file
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+	Work stealing scheduler for rendering an image in tiles on every hardware thread:
+		- Every thread gets its own deque with a contiguous run of tiles, it takes them from the front, in image order
+		  (or in the order of a given list of tiles, like the noisiest tiles adaptive sampling refines)
+		- A thread that runs out steals from the back of another thread's deque, far from where its owner is working
+		- Once fewer tiles are left in the deques than there are threads, a tile larger than the minimum size is split into quadrants
+		  before it is rendered, the thread renders one of them and the others can be stolen, so an expensive tile near the end isn't left to a single thread
+		- A thread that finds nothing to steal sleeps until tiles are split, the last tile is finished or the render is cancelled
+		- Every thread records how long it was busy rendering and idle looking for work, to see how well the load is balanced
+*/
+
+constexpr int SCHEDULER_PROGRESS_MILLISECONDS = 50; // How often the calling thread reports progress while it sleeps
+
+struct Tile {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+struct ThreadStats {
+	double busySeconds = 0.0; // Rendering tiles
+	double idleSeconds = 0.0; // Looking for tiles to steal or waiting for the other threads to finish
+	int tiles = 0; // Rendered by the thread, quadrants of split tiles count on their own
+	int stolenTiles = 0;
+	int splitTiles = 0;
+};
+
+struct TileQueue {
+	std::mutex mutex;
+	std::deque<Tile> tiles;
+};
+
+int splitTileSize(const int size, const int granularity) {
+	//Size of the first half, a multiple of `granularity`
+	return (size / 2 + granularity - 1) / granularity * granularity;
+}
+
+bool scheduleTiles(const std::vector<Tile>& tiles, const int minTileSize, const std::function<void(const Tile&)>& renderTile,
+	const std::function<bool(float)>& progress = nullptr, std::vector<ThreadStats>* stats = nullptr) {
+	//Calls `renderTile` for every pixel of `tiles` once, from every hardware thread, the threads start in the order of `tiles`
+	//`minTileSize` is the size tiles aren't split below, split tiles keep multiples of it
+	//`progress` is only ever called from the calling thread, with the finished fraction of the pixels, returning false cancels the render
+	//Returns false if the render was cancelled
+
+	const unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	std::vector<TileQueue> queues(numThreads);
+	for (unsigned int i = 0; i < numThreads; ++i) {
+		const size_t first = tiles.size() * i / numThreads;
+		const size_t last = tiles.size() * (i + 1) / numThreads;
+		queues[i].tiles.assign(tiles.begin() + first, tiles.begin() + last);
+	}
+
+	std::vector<ThreadStats> threadStats(numThreads);
+
+	int64_t totalPixels = 0;
+	for (const Tile& tile : tiles) {
+		totalPixels += static_cast<int64_t>(tile.width) * tile.height;
+	}
+	std::atomic<int64_t> finishedPixels(0);
+	std::atomic<int> queuedTiles(static_cast<int>(tiles.size()));
+	std::atomic<bool> cancelled(false);
+
+	//Counts the times tiles were queued, the last tile was finished or the render was cancelled, idle threads wait for it to change
+	std::mutex idleMutex;
+	std::condition_variable workChanged;
+	uint64_t workVersion = 0;
+
+	auto signalWork = [&]() {
+		{
+			std::lock_guard<std::mutex> lock(idleMutex);
+			workVersion++;
+		}
+		workChanged.notify_all();
+	};
+
+	auto worker = [&](const unsigned int id) {
+		using Clock = std::chrono::steady_clock;
+
+		ThreadStats& stats = threadStats[id];
+		int64_t reportedPixels = -1;
+
+		auto reportProgress = [&]() {
+			//Only the calling thread reports, and only when something changed
+			if (id != 0 || !progress) return;
+
+			const int64_t finished = finishedPixels;
+			if (finished == reportedPixels) return;
+			reportedPixels = finished;
+
+			if (!progress(float(finished) / totalPixels)) {
+				cancelled = true;
+				signalWork();
+			}
+		};
+
+		auto takeTile = [&](Tile& tile) {
+			{
+				std::lock_guard<std::mutex> lock(queues[id].mutex);
+				if (!queues[id].tiles.empty()) {
+					tile = queues[id].tiles.front();
+					queues[id].tiles.pop_front();
+					queuedTiles--;
+					return true;
+				}
+			}
+
+			for (unsigned int i = 1; i < numThreads; ++i) {
+				TileQueue& victim = queues[(id + i) % numThreads];
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if (!victim.tiles.empty()) {
+					tile = victim.tiles.back();
+					victim.tiles.pop_back();
+					queuedTiles--;
+					stats.stolenTiles++;
+					return true;
+				}
+			}
+
+			return false;
+		};
+
+		while (!cancelled && finishedPixels < totalPixels) {
+
+			const Clock::time_point searchStart = Clock::now();
+
+			Tile tile;
+			if (!takeTile(tile)) {
+				//Everything left is being rendered, but a busy thread may still split its tile
+				for (;;) {
+					//Read before looking, so tiles queued after the last look aren't slept through
+					uint64_t version;
+					{
+						std::lock_guard<std::mutex> lock(idleMutex);
+						version = workVersion;
+					}
+
+					if (cancelled || finishedPixels >= totalPixels || takeTile(tile)) break;
+
+					reportProgress();
+
+					std::unique_lock<std::mutex> lock(idleMutex);
+					auto changed = [&]() { return workVersion != version; };
+					if (id == 0 && progress) {
+						workChanged.wait_for(lock, std::chrono::milliseconds(SCHEDULER_PROGRESS_MILLISECONDS), changed);
+					}
+					else {
+						workChanged.wait(lock, changed);
+					}
+				}
+
+				stats.idleSeconds += std::chrono::duration<double>(Clock::now() - searchStart).count();
+				if (cancelled || finishedPixels >= totalPixels) break;
+			}
+
+			if (queuedTiles < static_cast<int>(numThreads) && (tile.width > minTileSize || tile.height > minTileSize)) {
+				const int leftWidth = tile.width > minTileSize ? splitTileSize(tile.width, minTileSize) : tile.width;
+				const int topHeight = tile.height > minTileSize ? splitTileSize(tile.height, minTileSize) : tile.height;
+
+				const Tile quadrants[3] = {
+					Tile{ tile.x + leftWidth, tile.y, tile.width - leftWidth, topHeight },
+					Tile{ tile.x, tile.y + topHeight, leftWidth, tile.height - topHeight },
+					Tile{ tile.x + leftWidth, tile.y + topHeight, tile.width - leftWidth, tile.height - topHeight }
+				};
+
+				{
+					std::lock_guard<std::mutex> lock(queues[id].mutex);
+					//In reverse, so the owner continues in image order
+					for (int i = 2; i >= 0; --i) {
+						if (quadrants[i].width > 0 && quadrants[i].height > 0) {
+							queues[id].tiles.push_front(quadrants[i]);
+							queuedTiles++;
+						}
+					}
+				}
+
+				tile.width = leftWidth;
+				tile.height = topHeight;
+				stats.splitTiles++;
+
+				signalWork();
+			}
+
+			const Clock::time_point renderStart = Clock::now();
+			renderTile(tile);
+			stats.busySeconds += std::chrono::duration<double>(Clock::now() - renderStart).count();
+			stats.tiles++;
+
+			if ((finishedPixels += static_cast<int64_t>(tile.width) * tile.height) == totalPixels) signalWork();
+
+			reportProgress();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned int i = 1; i < numThreads; ++i) {
+		threads.emplace_back(worker, i);
+	}
+
+	worker(0);
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	//The other threads may still have been busy when the calling thread ran out of tiles
+	if (progress && !cancelled) progress(1.0f);
+
+	if (stats) *stats = threadStats;
+
+	return !cancelled;
+}
+
+bool scheduleTiles(const int width, const int height, const int tileSize, const int minTileSize, const std::function<void(const Tile&)>& renderTile,
+	const std::function<bool(float)>& progress = nullptr, std::vector<ThreadStats>* stats = nullptr) {
+	//Calls `renderTile` for tiles covering the image once, in image order
+
+	std::vector<Tile> tiles;
+	for (int y = 0; y < height; y += tileSize) {
+		for (int x = 0; x < width; x += tileSize) {
+			tiles.push_back(Tile{ x, y, std::min(tileSize, width - x), std::min(tileSize, height - y) });
+		}
+	}
+
+	return scheduleTiles(tiles, minTileSize, renderTile, progress, stats);
+}
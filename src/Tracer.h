@@ -0,0 +1,1308 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "Denoiser.h"
+#include "Profiler.h"
+#include "Sampler.h"
+#include "TileScheduler.h"
+
+/*
+	CPU backend:
+		- Every function in here mirrors its counterpart in `shaders/trace.frag`, so both backends trace the same paths
+		  from the same samples (see Sampler.h) and produce the same image statistically
+		- If you change the algorithm in the shader, change it here as well
+		- The image is stored bottom row first, just like the frame buffer read back by `glReadPixels`
+*/
+
+constexpr int CPU_TILE_SIZE = 32;
+constexpr int CPU_MIN_TILE_SIZE = 8; // Tiles are split down to this size while threads are idle, a multiple of the packet size
+constexpr int CPU_PACKET_SIZE = 4; // Primary rays are traced in packets of 4x4 pixels, packets never cross the border of a tile
+constexpr int CPU_PACKET_RAYS = CPU_PACKET_SIZE * CPU_PACKET_SIZE;
+
+bool usePrimaryRayPackets = true; // Trace primary rays in packets, otherwise every ray is traced on its own (for comparisons)
+
+constexpr int RUSSIAN_ROULETTE_DEPTH = 3; // Bounces every path takes before Russian roulette may terminate it
+bool useRussianRoulette = true; // Like the shader, otherwise every path takes `maxBounces` bounces (for comparisons)
+
+bool useNextEventEstimation = true; // Like the shader, otherwise lights are only found by bouncing into them (for comparisons)
+
+//Filled in by `renderCPU` if requested
+struct RenderStats {
+	uint64_t rays = 0; // Primary, secondary and shadow rays cast into the scene
+	uint64_t samples = 0; // Samples taken of all pixels, at most the resolution times `numSamples`, less with adaptive sampling if pixels converged
+	std::vector<int> pixelSamples; // Samples every pixel took, bottom row first like the image, above `numSamples` for refined pixels
+	double firstTileSeconds = 0.0; // Until the first tile of pixels was finished
+	double seconds = 0.0;
+	std::vector<ThreadStats> threads; // How the tiles were balanced between the threads
+};
+
+thread_local uint64_t tracedRays = 0; // Rays cast by the current thread, only used for statistics
+thread_local uint64_t tracedSamples = 0; // Samples taken by the current thread, only used for statistics
+
+/*
+	Adaptive sampling, used by exports on both backends if `ObjectBuffer::noiseThreshold` is set:
+		- Every pixel keeps the running average of the squared luminance of its samples next to its color
+		- The spread of the samples gives the standard error of the pixel, relative to its brightness, the spread of whole batches
+		  would hide the rare bright samples (light found by a bounce, Russian roulette survivors) inside their batch averages
+		  and leave only a handful of batches to estimate it from
+		- A converged pixel takes no more batches, the shader passes its average through,
+		  an exported tile on the GPU (or a packet on the CPU) stops once all of its pixels converged
+		- The first pass takes at most `numSamples` samples of every pixel, the budget is the resolution times `numSamples`
+		- What the converged pixels left of the budget goes to the pixels still noisy after the first pass: `planRefinement` gives
+		  every tile of ADAPTIVE_TILE_SIZE pixels with noisy ones a higher limit, the tile with the most error first, until the budget is spent
+		- Both backends continue the noisy pixels of those tiles where the first pass left them, batch by batch up to the new limit
+*/
+
+constexpr int ADAPTIVE_MIN_SAMPLES = 64; // A pixel that didn't find its rare bright paths (light found by a bounce, Russian roulette survivors) yet looks converged but too dark
+constexpr float ADAPTIVE_DARK_LUMINANCE = 0.05f; // Added to the luminance, so dark pixels don't need an error of zero
+constexpr int ADAPTIVE_TILE_SIZE = 64; // The leftover budget is handed out per tile of this size, on both backends
+constexpr int ADAPTIVE_MAX_FACTOR = 4; // A pixel takes at most this many times `numSamples`, so one tile that never converges can't take the whole budget
+
+float luminance(const glm::vec3& color) {
+	return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+float relativeError(const glm::vec3& average, const float averageSquaredLuminance, const int numSamples) {
+	//Standard error of a pixel with these averages over `numSamples` samples, relative to its brightness
+	const float mean = luminance(average);
+	const float variance = std::max(averageSquaredLuminance - mean * mean, 0.0f);
+	return std::sqrt(variance / float(std::max(numSamples - 1, 1))) / (mean + ADAPTIVE_DARK_LUMINANCE);
+}
+
+bool converged(const ObjectBuffer& objectBuffer, const glm::vec3& average, const float averageSquaredLuminance, const int numSamples) {
+	//Whether a pixel with these averages over `numSamples` samples can stop sampling, the same as in the shader
+	//A converged pixel stays converged with more samples of the same averages, the error only shrinks
+
+	if (objectBuffer.noiseThreshold <= 0.0f || numSamples < ADAPTIVE_MIN_SAMPLES) return false;
+
+	//A pixel lit by paths that only every other sample finds can't get below the threshold in fewer samples,
+	//one that seems to did most likely miss its bright paths so far
+	if (float(numSamples) * objectBuffer.noiseThreshold * objectBuffer.noiseThreshold < 1.0f) return false;
+
+	return relativeError(average, averageSquaredLuminance, numSamples) < objectBuffer.noiseThreshold;
+}
+
+//A tile whose noisy pixels take more samples than `numSamples` after the first pass
+struct RefinedTile {
+	Tile tile;
+	int maxSamples; // The most a pixel of the tile takes
+};
+
+std::vector<RefinedTile> planRefinement(const ObjectBuffer& objectBuffer, const std::vector<glm::vec3>& image, const std::vector<float>& averageSquared, uint64_t budget) {
+	//Hands `budget`, the samples the first pass didn't take, to the tiles with noisy pixels, the one with the most error first
+	//After the first pass a pixel either converged or took `numSamples`, so its averages alone tell whether it is noisy
+	//The noisy pixels of a tile all get the same limit, so they never take more than the tile was given
+
+	std::vector<RefinedTile> refined;
+	if (budget == 0) return refined;
+
+	const int width = static_cast<int>(objectBuffer.resolution.x);
+	const int height = static_cast<int>(objectBuffer.resolution.y);
+	const int numSamples = objectBuffer.numSamples;
+
+	struct NoisyTile {
+		Tile tile;
+		int noisyPixels;
+		float error; // Sum of the relative errors of the noisy pixels
+	};
+	std::vector<NoisyTile> noisyTiles;
+
+	for (int tileY = 0; tileY < height; tileY += ADAPTIVE_TILE_SIZE) {
+		for (int tileX = 0; tileX < width; tileX += ADAPTIVE_TILE_SIZE) {
+			NoisyTile noisy = { Tile{ tileX, tileY, std::min(ADAPTIVE_TILE_SIZE, width - tileX), std::min(ADAPTIVE_TILE_SIZE, height - tileY) }, 0, 0.0f };
+
+			for (int y = tileY; y < tileY + noisy.tile.height; ++y) {
+				for (int x = tileX; x < tileX + noisy.tile.width; ++x) {
+					const size_t i = static_cast<size_t>(y) * width + x;
+					if (converged(objectBuffer, image[i], averageSquared[i], numSamples)) continue;
+
+					noisy.noisyPixels++;
+					noisy.error += relativeError(image[i], averageSquared[i], numSamples);
+				}
+			}
+
+			if (noisy.noisyPixels > 0) noisyTiles.push_back(noisy);
+		}
+	}
+
+	//Equal errors stay in image order, so both backends get the same plan
+	std::stable_sort(noisyTiles.begin(), noisyTiles.end(), [](const NoisyTile& a, const NoisyTile& b) { return a.error > b.error; });
+
+	for (const NoisyTile& noisy : noisyTiles) {
+		const uint64_t extraSamples = std::min<uint64_t>(static_cast<uint64_t>(ADAPTIVE_MAX_FACTOR - 1) * numSamples, budget / noisy.noisyPixels);
+		if (extraSamples == 0) continue;
+
+		refined.push_back(RefinedTile{ noisy.tile, numSamples + static_cast<int>(extraSamples) });
+		budget -= extraSamples * noisy.noisyPixels;
+	}
+
+	return refined;
+}
+
+struct Intersection {
+	Material material;
+	float dst;
+	glm::vec3 normal;
+	glm::vec3 position;
+	int sphere = -1; // Index of the hit sphere, -1 for triangles
+	float area = 0.0f; // World space area of the hit triangle, only set if it is emissive
+};
+
+void raySphere(const Ray& ray, const Sphere& sphere, float& distance, bool& hit) {
+
+	glm::vec3 oc = ray.origin - sphere.center;
+
+	float a = glm::dot(ray.direction, ray.direction);
+	float b = 2.0f * glm::dot(oc, ray.direction);
+	float c = glm::dot(oc, oc) - sphere.radius * sphere.radius;
+
+	float discriminant = (b * b) - (4.0f * a * c);
+
+	float dst = discriminant <= 0.0f ? -1 : (-b - sqrt(discriminant)) / (2.0f * a);
+
+	if (dst > 0 && (distance < 0 || dst < distance)) {
+		distance = dst;
+		hit = true;
+	}
+}
+
+bool rayGeometry(const Ray& ray, const BVH& bvh, const int rootNode, float& distance, int& triangleIndex) {
+	//Walks the bottom level tree of a geometry with a ray in its object space
+	//Returns true if a triangle closer than `distance` was found
+
+	const glm::vec3 invDirection = 1.0f / ray.direction;
+
+	int stack[BVH_MAX_DEPTH];
+	int stackSize = 0;
+	int nodeIndex = rootNode;
+
+	bool closerHit = false;
+
+	if (rayAABB(ray.origin, invDirection, bvh.bottomLevel.nodes[rootNode].boundsMin, bvh.bottomLevel.nodes[rootNode].boundsMax, distance > 0 ? distance : 1e30f) == 1e30f) {
+		nodeIndex = -1;
+	}
+
+	while (nodeIndex >= 0) {
+
+		const BVHNode& node = bvh.bottomLevel.nodes[nodeIndex];
+
+		if (node.count > 0) {
+
+			//The triangles of the leaf, in blocks for the SIMD kernels, this is `rayTriangle` of the shader
+			const int numBlocks = (node.count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+
+			if (rayTriangleBlocks(ray.origin, ray.direction, &bvh.triangleBlocks[bvh.leafBlocks[nodeIndex]], numBlocks, distance, triangleIndex)) {
+				closerHit = true;
+			}
+
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+			continue;
+		}
+
+		//Visit the closer child first and remember the other one for later
+		const float closest = distance > 0 ? distance : 1e30f;
+
+		int nearChild = node.leftFirst;
+		int farChild = node.leftFirst + 1;
+
+		float nearDistance = rayAABB(ray.origin, invDirection, bvh.bottomLevel.nodes[nearChild].boundsMin, bvh.bottomLevel.nodes[nearChild].boundsMax, closest);
+		float farDistance = rayAABB(ray.origin, invDirection, bvh.bottomLevel.nodes[farChild].boundsMin, bvh.bottomLevel.nodes[farChild].boundsMax, closest);
+
+		if (farDistance < nearDistance) {
+			std::swap(nearChild, farChild);
+			std::swap(nearDistance, farDistance);
+		}
+
+		if (nearDistance == 1e30f) {
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+		}
+		else {
+			nodeIndex = nearChild;
+			if (farDistance != 1e30f) stack[stackSize++] = farChild;
+		}
+	}
+
+	return closerHit;
+}
+
+Intersection closestIntersection(const Ray& ray, const ObjectBuffer& objectBuffer, const int closestHitSphereIndex, const float closestHitSphereDistance,
+	const int closestHitTriangleIndex, const int closestHitInstanceIndex, const float closestHitTriangleDistance) {
+	//Picks the closer of the sphere and the triangle hit, a distance of -1 means there is no hit
+
+	bool triangleHit = closestHitTriangleDistance > 0;
+
+	bool sphereCloser = closestHitSphereDistance > 0 && (!triangleHit || closestHitSphereDistance < closestHitTriangleDistance);
+
+	Intersection intersection;
+
+	if (sphereCloser) {
+		intersection.material = objectBuffer.spheres[closestHitSphereIndex].material;
+		intersection.dst = closestHitSphereDistance;
+		intersection.normal = glm::normalize(ray.origin + ray.direction * closestHitSphereDistance - objectBuffer.spheres[closestHitSphereIndex].center);
+		intersection.sphere = closestHitSphereIndex;
+	}
+	else if (triangleHit) {
+		const Triangle& triangle = objectBuffer.triangles[closestHitTriangleIndex];
+		const Instance& instance = objectBuffer.instances[closestHitInstanceIndex];
+		const glm::vec3& v0 = objectBuffer.vertices[triangle.indices.x].position;
+		const glm::vec3 normal = glm::cross(objectBuffer.vertices[triangle.indices.y].position - v0, objectBuffer.vertices[triangle.indices.z].position - v0);
+
+		intersection.material = objectBuffer.materials[instance.material >= 0 ? instance.material : triangle.material];
+		intersection.dst = closestHitTriangleDistance;
+		//Normals are transformed with the transpose of the inverse
+		intersection.normal = glm::normalize(glm::transpose(glm::mat3(instance.inverseTransform)) * glm::normalize(normal));
+
+		//Emission that is hit is weighed against sampling the triangle as a light, which needs its area in world space
+		if (isEmissive(intersection.material)) {
+			const glm::mat3 transform = glm::mat3(instance.transform);
+			intersection.area = 0.5f * glm::length(glm::cross(transform * (objectBuffer.vertices[triangle.indices.y].position - v0), transform * (objectBuffer.vertices[triangle.indices.z].position - v0)));
+		}
+	}
+	else {
+		intersection.dst = -1;
+	}
+
+	intersection.position = ray.origin + ray.direction * intersection.dst;
+
+	return intersection;
+}
+
+Intersection rayScene(const Ray& ray, const ObjectBuffer& objectBuffer, const BVH& bvh) {
+
+	tracedRays++;
+
+	int closestHitSphereIndex = -1;
+	float closestHitSphereDistance = -1;
+	int closestHitTriangleIndex = -1;
+	int closestHitInstanceIndex = -1;
+	float closestHitTriangleDistance = -1;
+	bool hit = false;
+
+	for (int i = 0; i < objectBuffer.numSpheres; ++i) {
+
+		raySphere(ray, objectBuffer.spheres[i], closestHitSphereDistance, hit);
+
+		if (hit) {
+			closestHitSphereIndex = i;
+			hit = false;
+		}
+	}
+
+	if (!bvh.topLevel.nodes.empty()) {
+
+		const glm::vec3 invDirection = 1.0f / ray.direction;
+
+		int stack[BVH_MAX_DEPTH];
+		int stackSize = 0;
+		int nodeIndex = 0;
+
+		if (rayAABB(ray.origin, invDirection, bvh.topLevel.nodes[0].boundsMin, bvh.topLevel.nodes[0].boundsMax, 1e30f) == 1e30f) {
+			nodeIndex = -1;
+		}
+
+		while (nodeIndex >= 0) {
+
+			const BVHNode& node = bvh.topLevel.nodes[nodeIndex];
+
+			if (node.count > 0) {
+
+				for (int i = 0; i < node.count; ++i) {
+
+					const int instanceIndex = bvh.topLevel.indices[node.leftFirst + i];
+					const Instance& instance = objectBuffer.instances[instanceIndex];
+					const int rootNode = bvh.roots[instance.geometry];
+
+					if (rootNode < 0) continue;
+
+					//The direction isn't renormalized, so distances in object space are the same as in world space
+					Ray objectRay;
+					objectRay.origin = glm::vec3(instance.inverseTransform * glm::vec4(ray.origin, 1.0f));
+					objectRay.direction = glm::vec3(instance.inverseTransform * glm::vec4(ray.direction, 0.0f));
+
+					if (rayGeometry(objectRay, bvh, rootNode, closestHitTriangleDistance, closestHitTriangleIndex)) {
+						closestHitInstanceIndex = instanceIndex;
+					}
+				}
+
+				nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+				continue;
+			}
+
+			//Visit the closer child first and remember the other one for later
+			const float closest = closestHitTriangleDistance > 0 ? closestHitTriangleDistance : 1e30f;
+
+			int nearChild = node.leftFirst;
+			int farChild = node.leftFirst + 1;
+
+			float nearDistance = rayAABB(ray.origin, invDirection, bvh.topLevel.nodes[nearChild].boundsMin, bvh.topLevel.nodes[nearChild].boundsMax, closest);
+			float farDistance = rayAABB(ray.origin, invDirection, bvh.topLevel.nodes[farChild].boundsMin, bvh.topLevel.nodes[farChild].boundsMax, closest);
+
+			if (farDistance < nearDistance) {
+				std::swap(nearChild, farChild);
+				std::swap(nearDistance, farDistance);
+			}
+
+			if (nearDistance == 1e30f) {
+				nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+			}
+			else {
+				nodeIndex = nearChild;
+				if (farDistance != 1e30f) stack[stackSize++] = farChild;
+			}
+		}
+	}
+
+	return closestIntersection(ray, objectBuffer, closestHitSphereIndex, closestHitSphereDistance, closestHitTriangleIndex, closestHitInstanceIndex, closestHitTriangleDistance);
+}
+
+bool occludedGeometry(const Ray& ray, const BVH& bvh, const int rootNode, const float distance) {
+	//Like `rayGeometry`, but stops at the first triangle closer than `distance` instead of looking for the closest one
+
+	const glm::vec3 invDirection = 1.0f / ray.direction;
+
+	int stack[BVH_MAX_DEPTH];
+	int stackSize = 0;
+	int nodeIndex = rootNode;
+
+	if (rayAABB(ray.origin, invDirection, bvh.bottomLevel.nodes[rootNode].boundsMin, bvh.bottomLevel.nodes[rootNode].boundsMax, distance) == 1e30f) {
+		nodeIndex = -1;
+	}
+
+	while (nodeIndex >= 0) {
+
+		const BVHNode& node = bvh.bottomLevel.nodes[nodeIndex];
+
+		if (node.count > 0) {
+
+			const int numBlocks = (node.count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+
+			float closest = distance;
+			int triangleIndex = -1;
+
+			if (rayTriangleBlocks(ray.origin, ray.direction, &bvh.triangleBlocks[bvh.leafBlocks[nodeIndex]], numBlocks, closest, triangleIndex)) {
+				return true;
+			}
+
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+			continue;
+		}
+
+		const BVHNode& left = bvh.bottomLevel.nodes[node.leftFirst];
+		const BVHNode& right = bvh.bottomLevel.nodes[node.leftFirst + 1];
+
+		const bool leftHit = rayAABB(ray.origin, invDirection, left.boundsMin, left.boundsMax, distance) != 1e30f;
+		const bool rightHit = rayAABB(ray.origin, invDirection, right.boundsMin, right.boundsMax, distance) != 1e30f;
+
+		if (leftHit) {
+			nodeIndex = node.leftFirst;
+			if (rightHit) stack[stackSize++] = node.leftFirst + 1;
+		}
+		else if (rightHit) {
+			nodeIndex = node.leftFirst + 1;
+		}
+		else {
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+		}
+	}
+
+	return false;
+}
+
+bool occluded(const Ray& ray, const ObjectBuffer& objectBuffer, const BVH& bvh, const float distance) {
+	//Returns true if anything is hit closer than `distance`, for shadow rays any hit will do
+
+	tracedRays++;
+
+	for (int i = 0; i < objectBuffer.numSpheres; ++i) {
+
+		float closest = distance;
+		bool hit = false;
+
+		raySphere(ray, objectBuffer.spheres[i], closest, hit);
+
+		if (hit) return true;
+	}
+
+	if (bvh.topLevel.nodes.empty()) return false;
+
+	const glm::vec3 invDirection = 1.0f / ray.direction;
+
+	int stack[BVH_MAX_DEPTH];
+	int stackSize = 0;
+	int nodeIndex = 0;
+
+	if (rayAABB(ray.origin, invDirection, bvh.topLevel.nodes[0].boundsMin, bvh.topLevel.nodes[0].boundsMax, distance) == 1e30f) {
+		nodeIndex = -1;
+	}
+
+	while (nodeIndex >= 0) {
+
+		const BVHNode& node = bvh.topLevel.nodes[nodeIndex];
+
+		if (node.count > 0) {
+
+			for (int i = 0; i < node.count; ++i) {
+
+				const Instance& instance = objectBuffer.instances[bvh.topLevel.indices[node.leftFirst + i]];
+				const int rootNode = bvh.roots[instance.geometry];
+
+				if (rootNode < 0) continue;
+
+				Ray objectRay;
+				objectRay.origin = glm::vec3(instance.inverseTransform * glm::vec4(ray.origin, 1.0f));
+				objectRay.direction = glm::vec3(instance.inverseTransform * glm::vec4(ray.direction, 0.0f));
+
+				if (occludedGeometry(objectRay, bvh, rootNode, distance)) return true;
+			}
+
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+			continue;
+		}
+
+		const BVHNode& left = bvh.topLevel.nodes[node.leftFirst];
+		const BVHNode& right = bvh.topLevel.nodes[node.leftFirst + 1];
+
+		const bool leftHit = rayAABB(ray.origin, invDirection, left.boundsMin, left.boundsMax, distance) != 1e30f;
+		const bool rightHit = rayAABB(ray.origin, invDirection, right.boundsMin, right.boundsMax, distance) != 1e30f;
+
+		if (leftHit) {
+			nodeIndex = node.leftFirst;
+			if (rightHit) stack[stackSize++] = node.leftFirst + 1;
+		}
+		else if (rightHit) {
+			nodeIndex = node.leftFirst + 1;
+		}
+		else {
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+		}
+	}
+
+	return false;
+}
+
+struct RayPacket {
+	glm::vec3 origin; // Shared by every ray of the packet
+	glm::vec3 directions[CPU_PACKET_RAYS];
+	int numRays;
+};
+
+struct PacketBounds {
+	//Interval of the reciprocal directions of a packet, only along the axes where every ray points the same way
+	glm::vec3 invMin;
+	glm::vec3 invMax;
+	glm::bvec3 valid;
+};
+
+PacketBounds packetBounds(const RayPacket& packet) {
+
+	PacketBounds bounds;
+
+	for (int axis = 0; axis < 3; ++axis) {
+		bool positive = true, negative = true;
+		bounds.invMin[axis] = 1e30f;
+		bounds.invMax[axis] = -1e30f;
+
+		for (int i = 0; i < packet.numRays; ++i) {
+			const float direction = packet.directions[i][axis];
+			positive = positive && direction > 0.0f;
+			negative = negative && direction < 0.0f;
+			bounds.invMin[axis] = std::min(bounds.invMin[axis], 1.0f / direction);
+			bounds.invMax[axis] = std::max(bounds.invMax[axis], 1.0f / direction);
+		}
+
+		bounds.valid[axis] = positive || negative;
+	}
+
+	return bounds;
+}
+
+float packetAABB(const glm::vec3& origin, const PacketBounds& bounds, const glm::vec3& boundsMin, const glm::vec3& boundsMax, const float farthest) {
+	//Returns a lower bound of the distance at which any ray of the packet enters the box, or 1e30 if none of them can hit it before `farthest`
+	//Since the rays share their origin, the slabs can be intersected with the whole interval of directions at once (the frustum of the packet)
+	//Axes the rays point along in both directions can't bound anything and are skipped
+
+	float tNear = 0.0f;
+	float tFar = farthest;
+
+	for (int axis = 0; axis < 3; ++axis) {
+		if (!bounds.valid[axis]) continue;
+
+		const bool positive = bounds.invMin[axis] > 0.0f;
+		const float nearPlane = (positive ? boundsMin[axis] : boundsMax[axis]) - origin[axis];
+		const float farPlane = (positive ? boundsMax[axis] : boundsMin[axis]) - origin[axis];
+
+		tNear = std::max(tNear, std::min(nearPlane * bounds.invMin[axis], nearPlane * bounds.invMax[axis]));
+		tFar = std::min(tFar, std::max(farPlane * bounds.invMin[axis], farPlane * bounds.invMax[axis]));
+	}
+
+	return tNear <= tFar ? tNear : 1e30f;
+}
+
+template<typename LeafFunction>
+void walkPacket(const BVHTree& tree, const int rootNode, const RayPacket& packet, const float* distances, const LeafFunction& leaf) {
+	//Walks a tree with the whole packet, nodes are culled with the frustum of the packet and the rays are only tested one by one in the leaves
+	//`leaf(nodeIndex, node)` is called for every leaf the frustum touches
+
+	const PacketBounds bounds = packetBounds(packet);
+
+	int stack[BVH_MAX_DEPTH];
+	int stackSize = 0;
+	int nodeIndex = rootNode;
+
+	//A node can be skipped once it is further away than the closest hit of every ray
+	auto farthestHit = [&]() {
+		float farthest = 0.0f;
+		for (int i = 0; i < packet.numRays; ++i) {
+			farthest = std::max(farthest, distances[i] > 0 ? distances[i] : 1e30f);
+		}
+		return farthest;
+	};
+
+	if (packetAABB(packet.origin, bounds, tree.nodes[rootNode].boundsMin, tree.nodes[rootNode].boundsMax, 1e30f) == 1e30f) {
+		nodeIndex = -1;
+	}
+
+	while (nodeIndex >= 0) {
+
+		const BVHNode& node = tree.nodes[nodeIndex];
+
+		if (node.count > 0) {
+			leaf(nodeIndex, node);
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+			continue;
+		}
+
+		const float farthest = farthestHit();
+
+		int nearChild = node.leftFirst;
+		int farChild = node.leftFirst + 1;
+
+		float nearDistance = packetAABB(packet.origin, bounds, tree.nodes[nearChild].boundsMin, tree.nodes[nearChild].boundsMax, farthest);
+		float farDistance = packetAABB(packet.origin, bounds, tree.nodes[farChild].boundsMin, tree.nodes[farChild].boundsMax, farthest);
+
+		if (farDistance < nearDistance) {
+			std::swap(nearChild, farChild);
+			std::swap(nearDistance, farDistance);
+		}
+
+		if (nearDistance == 1e30f) {
+			nodeIndex = stackSize > 0 ? stack[--stackSize] : -1;
+		}
+		else {
+			nodeIndex = nearChild;
+			if (farDistance != 1e30f) stack[stackSize++] = farChild;
+		}
+	}
+}
+
+void rayGeometryPacket(const RayPacket& packet, const BVH& bvh, const int rootNode, float* distances, int* triangleIndices, bool* closerHits) {
+	//`rayGeometry` for a whole packet in the object space of the geometry, `closerHits` is set for every ray that found a closer triangle
+
+	glm::vec3 invDirections[CPU_PACKET_RAYS];
+	for (int i = 0; i < packet.numRays; ++i) {
+		invDirections[i] = 1.0f / packet.directions[i];
+	}
+
+	walkPacket(bvh.bottomLevel, rootNode, packet, distances, [&](const int nodeIndex, const BVHNode& node) {
+		const int numBlocks = (node.count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+
+		for (int i = 0; i < packet.numRays; ++i) {
+			if (rayAABB(packet.origin, invDirections[i], node.boundsMin, node.boundsMax, distances[i] > 0 ? distances[i] : 1e30f) == 1e30f) continue;
+
+			if (rayTriangleBlocks(packet.origin, packet.directions[i], &bvh.triangleBlocks[bvh.leafBlocks[nodeIndex]], numBlocks, distances[i], triangleIndices[i])) {
+				closerHits[i] = true;
+			}
+		}
+	});
+}
+
+void rayScenePacket(const RayPacket& packet, const ObjectBuffer& objectBuffer, const BVH& bvh, Intersection* intersections) {
+	//`rayScene` for every ray of the packet, finds the same hits (up to ties between triangles at the same distance)
+
+	tracedRays += packet.numRays;
+
+	int closestHitSphereIndex[CPU_PACKET_RAYS];
+	float closestHitSphereDistance[CPU_PACKET_RAYS];
+	int closestHitTriangleIndex[CPU_PACKET_RAYS];
+	int closestHitInstanceIndex[CPU_PACKET_RAYS];
+	float closestHitTriangleDistance[CPU_PACKET_RAYS];
+
+	for (int r = 0; r < packet.numRays; ++r) {
+
+		const Ray ray{ packet.origin, packet.directions[r] };
+
+		closestHitSphereIndex[r] = -1;
+		closestHitSphereDistance[r] = -1;
+		closestHitTriangleIndex[r] = -1;
+		closestHitInstanceIndex[r] = -1;
+		closestHitTriangleDistance[r] = -1;
+		bool hit = false;
+
+		for (int i = 0; i < objectBuffer.numSpheres; ++i) {
+
+			raySphere(ray, objectBuffer.spheres[i], closestHitSphereDistance[r], hit);
+
+			if (hit) {
+				closestHitSphereIndex[r] = i;
+				hit = false;
+			}
+		}
+	}
+
+	if (!bvh.topLevel.nodes.empty()) {
+
+		walkPacket(bvh.topLevel, 0, packet, closestHitTriangleDistance, [&](const int, const BVHNode& node) {
+
+			for (int i = 0; i < node.count; ++i) {
+
+				const int instanceIndex = bvh.topLevel.indices[node.leftFirst + i];
+				const Instance& instance = objectBuffer.instances[instanceIndex];
+				const int rootNode = bvh.roots[instance.geometry];
+
+				if (rootNode < 0) continue;
+
+				//An affine transform keeps the shared origin shared
+				RayPacket objectPacket;
+				objectPacket.origin = glm::vec3(instance.inverseTransform * glm::vec4(packet.origin, 1.0f));
+				objectPacket.numRays = packet.numRays;
+				for (int r = 0; r < packet.numRays; ++r) {
+					objectPacket.directions[r] = glm::vec3(instance.inverseTransform * glm::vec4(packet.directions[r], 0.0f));
+				}
+
+				bool closerHits[CPU_PACKET_RAYS] = {};
+				rayGeometryPacket(objectPacket, bvh, rootNode, closestHitTriangleDistance, closestHitTriangleIndex, closerHits);
+
+				for (int r = 0; r < packet.numRays; ++r) {
+					if (closerHits[r]) closestHitInstanceIndex[r] = instanceIndex;
+				}
+			}
+		});
+	}
+
+	for (int r = 0; r < packet.numRays; ++r) {
+		intersections[r] = closestIntersection(Ray{ packet.origin, packet.directions[r] }, objectBuffer, closestHitSphereIndex[r], closestHitSphereDistance[r],
+			closestHitTriangleIndex[r], closestHitInstanceIndex[r], closestHitTriangleDistance[r]);
+	}
+}
+
+glm::vec3 randomDirection(Sampler& sampler) {
+	glm::vec2 u = sample2D(sampler);
+	float z = 1.0f - 2.0f * u.x;
+	float a = 6.28318530718f * u.y;
+	float r = sqrt(1.0f - (z * z));
+	return glm::vec3(r * cos(a), r * sin(a), z);
+}
+
+glm::vec2 randomInCircle(Sampler& sampler) {
+	glm::vec2 u = sample2D(sampler);
+	float r = sqrt(u.x);
+	float a = 6.28318530718f * u.y;
+	return glm::vec2(r * cos(a), r * sin(a));
+}
+
+constexpr float PI = 3.14159265359f;
+
+float sphereConeSize(const float radius2, const float distance2) {
+	//1 - cos of the half angle of the cone a sphere covers seen from `distance2` away, written so it stays accurate for small cones
+	const float sin2 = radius2 / distance2;
+	return sin2 / (1.0f + std::sqrt(1.0f - sin2));
+}
+
+bool sampleLight(const glm::vec3& position, Sampler& sampler, const ObjectBuffer& objectBuffer, glm::vec3& direction, float& distance, glm::vec3& emission, float& pdf) {
+	//Picks one of the lights uniformly and samples a point on it that is seen from `position`
+	//Returns false if the point can't be seen from there, otherwise the direction and distance to it, its emission and the
+	//probability density of having sampled that direction, per solid angle
+
+	const int index = std::min(int(sample1D(sampler) * float(objectBuffer.numLights)), objectBuffer.numLights - 1);
+	const glm::vec2 u = sample2D(sampler);
+	const float u1 = u.x;
+	const float u2 = u.y;
+
+	const Light& light = objectBuffer.lights[index];
+	emission = glm::vec3(light.emission);
+
+	if (light.v0.w > 0.0f) {
+		//Spheres are sampled uniformly in the cone of directions they cover
+		const glm::vec3 toCenter = glm::vec3(light.v0) - position;
+		const float distance2 = glm::dot(toCenter, toCenter);
+		const float radius2 = light.v0.w * light.v0.w;
+
+		if (distance2 <= radius2) return false;
+
+		const float coneSize = sphereConeSize(radius2, distance2);
+		const float cosTheta = 1.0f - u1 * coneSize;
+		const float sinTheta = std::sqrt(std::max(1.0f - cosTheta * cosTheta, 0.0f));
+		const float phi = 2.0f * PI * u2;
+
+		const glm::vec3 w = toCenter / std::sqrt(distance2);
+		const glm::vec3 u = glm::normalize(glm::cross(std::abs(w.x) > 0.1f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f), w));
+		const glm::vec3 v = glm::cross(w, u);
+		direction = (u * std::cos(phi) + v * std::sin(phi)) * sinTheta + w * cosTheta;
+
+		const float b = glm::dot(toCenter, direction);
+		distance = b - std::sqrt(std::max(radius2 - (distance2 - b * b), 0.0f));
+		pdf = 1.0f / (2.0f * PI * coneSize);
+	}
+	else {
+		//Triangles are sampled uniformly by area and only emit to the front, the side they can be hit from
+		const glm::vec3 v0 = glm::vec3(light.v0);
+		const glm::vec3 v1 = glm::vec3(light.v1);
+		const glm::vec3 v2 = glm::vec3(light.v2);
+
+		const float s = std::sqrt(u1);
+		const glm::vec3 point = v0 * (1.0f - s) + v1 * (s * (1.0f - u2)) + v2 * (s * u2);
+		const glm::vec3 toPoint = point - position;
+		const float distance2 = glm::dot(toPoint, toPoint);
+
+		distance = std::sqrt(distance2);
+		direction = toPoint / distance;
+
+		const float cosLight = -glm::dot(glm::normalize(glm::cross(v1 - v0, v2 - v0)), direction);
+
+		if (cosLight <= 0.0f) return false;
+
+		pdf = distance2 / (cosLight * light.v1.w);
+	}
+
+	pdf /= float(objectBuffer.numLights);
+	return true;
+}
+
+float lightPdf(const glm::vec3& position, const Intersection& intersection, const glm::vec3& direction, const ObjectBuffer& objectBuffer) {
+	//The density with which `sampleLight` would have picked the direction towards an emissive hit from `position`
+
+	if (intersection.sphere >= 0) {
+		const Sphere& sphere = objectBuffer.spheres[intersection.sphere];
+		const glm::vec3 toCenter = sphere.center - position;
+		const float distance2 = glm::dot(toCenter, toCenter);
+		const float radius2 = sphere.radius * sphere.radius;
+
+		if (distance2 <= radius2) return 0.0f;
+
+		return 1.0f / (2.0f * PI * sphereConeSize(radius2, distance2) * float(objectBuffer.numLights));
+	}
+
+	const glm::vec3 toHit = intersection.position - position;
+	return glm::dot(toHit, toHit) / (std::abs(glm::dot(intersection.normal, direction)) * intersection.area * float(objectBuffer.numLights));
+}
+
+glm::vec3 trace(Ray ray, Sampler& sampler, const ObjectBuffer& objectBuffer, const BVH& bvh, const Intersection* primaryHit = nullptr) {
+	//`primaryHit` is the intersection of `ray` if it was already traced as part of a packet
+
+	glm::vec3 rayColor = glm::vec3(1.f);
+	glm::vec3 totalLight = glm::vec3(0.f);
+
+	//Set when the previous bounce sampled the lights directly, then emission that is hit is weighed against that
+	bool sampledLights = false;
+	glm::vec3 previousOrigin;
+	float scatterPdf = 0.0f;
+
+	for (int i = 0; i < objectBuffer.maxBounces; ++i) {
+
+		Intersection intersection = i == 0 && primaryHit ? *primaryHit : rayScene(ray, objectBuffer, bvh);
+
+		if (intersection.dst < 0.0f) {
+			break;
+		}
+
+		const Material& material = intersection.material;
+
+		//Multiple importance sampling with the power heuristic between bouncing into a light and sampling it
+		float emissionWeight = 1.0f;
+		if (sampledLights && isEmissive(material)) {
+			const float pdf = lightPdf(previousOrigin, intersection, ray.direction, objectBuffer);
+			emissionWeight = scatterPdf * scatterPdf / (scatterPdf * scatterPdf + pdf * pdf);
+		}
+
+		ray.origin = intersection.position + intersection.normal * 0.001f;
+
+		//Next event estimation: diffuse surfaces also send a shadow ray to a light, unless the path ends here anyway.
+		//The blend of the diffuse and specular direction has no density to weigh against, so only fully diffuse ones do
+		sampledLights = useNextEventEstimation && objectBuffer.numLights > 0 && material.smoothness == 0.0f && i + 1 < objectBuffer.maxBounces;
+
+		if (sampledLights) {
+			glm::vec3 lightDirection;
+			float lightDistance;
+			glm::vec3 lightEmission;
+			float pdf;
+
+			if (sampleLight(ray.origin, sampler, objectBuffer, lightDirection, lightDistance, lightEmission, pdf)) {
+				const float cosSurface = glm::dot(intersection.normal, lightDirection);
+
+				if (cosSurface > 0.0f && !occluded(Ray{ ray.origin, lightDirection }, objectBuffer, bvh, lightDistance * 0.999f)) {
+					const float bsdfPdf = cosSurface / PI;
+					totalLight += rayColor * material.color * lightEmission * (bsdfPdf / pdf) * (pdf * pdf / (pdf * pdf + bsdfPdf * bsdfPdf));
+				}
+			}
+		}
+
+		glm::vec3 diffuseDir = glm::normalize(intersection.normal + randomDirection(sampler));
+		glm::vec3 specularDir = glm::reflect(ray.direction, intersection.normal);
+		ray.direction = glm::mix(diffuseDir, specularDir, material.smoothness);
+
+		if (sampledLights) {
+			previousOrigin = ray.origin;
+			scatterPdf = std::max(glm::dot(intersection.normal, ray.direction), 0.0f) / PI;
+		}
+
+		totalLight += rayColor * material.emission * emissionWeight;
+		rayColor *= material.color;
+
+		//Russian roulette: a path continues with the probability of its throughput and carries that much more light if it does,
+		//so dark paths stop early and the average stays the same
+		if (useRussianRoulette && i + 1 >= RUSSIAN_ROULETTE_DEPTH && i + 1 < objectBuffer.maxBounces) {
+			const float survival = std::min(std::max(rayColor.r, std::max(rayColor.g, rayColor.b)), 1.0f);
+			if (sample1D(sampler) >= survival) {
+				break;
+			}
+			rayColor /= survival;
+		}
+	}
+
+	return totalLight;
+}
+
+glm::vec3 renderRaytraced(Sampler& sampler, const glm::vec2 world, const int firstSample, const int numSamples, const ObjectBuffer& objectBuffer, const BVH& bvh, float& squaredLuminance) {
+	//`firstSample` counts the samples the pixel took before, over all batches
+	//`squaredLuminance` returns the average of the squared luminance of the samples, for adaptive sampling
+	glm::vec3 color = glm::vec3(0.0f);
+	squaredLuminance = 0.0f;
+
+	Ray ray;
+	ray.origin = objectBuffer.camera.position; //The ray starts at the camera position
+
+	for (int i = 0; i < numSamples; ++i) {
+
+		startSample(sampler, firstSample + i);
+
+		glm::vec2 jitter = randomInCircle(sampler) * objectBuffer.jitterStrenght;
+		glm::vec2 jitterWorld = world + jitter;
+
+		ray.direction = glm::normalize(objectBuffer.camera.direction + jitterWorld.x * objectBuffer.camera.right + jitterWorld.y * objectBuffer.camera.up);
+
+		const glm::vec3 radiance = trace(ray, sampler, objectBuffer, bvh);
+		color += radiance;
+		squaredLuminance += luminance(radiance) * luminance(radiance);
+	}
+
+	squaredLuminance /= float(numSamples);
+	return color / float(numSamples);
+}
+
+void renderPacket(const ObjectBuffer& objectBuffer, const BVH& bvh, const int samplesPerBatch, const int firstSample, const int maxSamples, const int startX, const int startY, const int endX, const int endY,
+	std::vector<glm::vec3>& image, std::vector<float>& averageSquared, std::vector<int>& pixelSamples) {
+	//Renders up to `CPU_PACKET_SIZE` x `CPU_PACKET_SIZE` pixels like `renderTile`, but the primary rays of a sample are traced as one packet
+	//Every pixel keeps its own sampler and uses it in the same order as `renderRaytraced`, so the image doesn't change, the bounces are traced one by one
+
+	const int width = static_cast<int>(objectBuffer.resolution.x);
+
+	glm::vec2 world[CPU_PACKET_RAYS];
+	glm::ivec2 pixel[CPU_PACKET_RAYS];
+	uint32_t pixelIndex[CPU_PACKET_RAYS];
+	glm::vec3 average[CPU_PACKET_RAYS];
+	float squaredAverage[CPU_PACKET_RAYS];
+	int taken[CPU_PACKET_RAYS];
+	int numPixels = 0;
+
+	for (int y = startY; y < endY; ++y) {
+		for (int x = startX; x < endX; ++x) {
+			const glm::vec2 fragCoord = glm::vec2(x + 0.5f, y + 0.5f);
+			world[numPixels] = (fragCoord - objectBuffer.resolution / 2.0f) / objectBuffer.resolution.y;
+			pixel[numPixels] = glm::ivec2(x, y);
+			pixelIndex[numPixels] = static_cast<uint32_t>(fragCoord.x + fragCoord.y * objectBuffer.resolution.x);
+
+			const size_t i = static_cast<size_t>(y) * width + x;
+			average[numPixels] = firstSample > 0 ? image[i] : glm::vec3(0.0f);
+			squaredAverage[numPixels] = firstSample > 0 ? averageSquared[i] : 0.0f;
+			taken[numPixels] = firstSample > 0 ? pixelSamples[i] : 0;
+			numPixels++;
+		}
+	}
+
+	//Pixels still sampled, converged pixels drop out of the packet
+	int active[CPU_PACKET_RAYS];
+	int numActive = 0;
+	for (int p = 0; p < numPixels; ++p) {
+		if (!converged(objectBuffer, average[p], squaredAverage[p], firstSample)) active[numActive++] = p;
+	}
+
+	RayPacket packet;
+	packet.origin = objectBuffer.camera.position;
+
+	int accumulatedSamples = firstSample;
+
+	//A refined pixel goes on with the batches it would have taken next
+	for (int batch = (firstSample + samplesPerBatch - 1) / samplesPerBatch; accumulatedSamples < maxSamples && numActive > 0; ++batch) {
+
+		const int numSamples = std::min(samplesPerBatch, maxSamples - accumulatedSamples);
+
+		Sampler samplers[CPU_PACKET_RAYS];
+		glm::vec3 colors[CPU_PACKET_RAYS];
+		float squares[CPU_PACKET_RAYS];
+
+		for (int a = 0; a < numActive; ++a) {
+			samplers[a] = createSampler(objectBuffer.sampler, pixel[active[a]], pixelIndex[active[a]], objectBuffer.frameIndex + objectBuffer.sampleOffset + batch);
+			colors[a] = glm::vec3(0.0f);
+			squares[a] = 0.0f;
+		}
+
+		packet.numRays = numActive;
+
+		for (int i = 0; i < numSamples; ++i) {
+
+			for (int a = 0; a < numActive; ++a) {
+				startSample(samplers[a], objectBuffer.sampleOffset + objectBuffer.accumulatedSamples + accumulatedSamples + i);
+
+				glm::vec2 jitter = randomInCircle(samplers[a]) * objectBuffer.jitterStrenght;
+				glm::vec2 jitterWorld = world[active[a]] + jitter;
+
+				packet.directions[a] = glm::normalize(objectBuffer.camera.direction + jitterWorld.x * objectBuffer.camera.right + jitterWorld.y * objectBuffer.camera.up);
+			}
+
+			Intersection primaryHits[CPU_PACKET_RAYS];
+			if (objectBuffer.maxBounces > 0) {
+				rayScenePacket(packet, objectBuffer, bvh, primaryHits);
+			}
+
+			for (int a = 0; a < numActive; ++a) {
+				const glm::vec3 radiance = trace(Ray{ packet.origin, packet.directions[a] }, samplers[a], objectBuffer, bvh, &primaryHits[a]);
+				colors[a] += radiance;
+				squares[a] += luminance(radiance) * luminance(radiance);
+			}
+		}
+
+		tracedSamples += static_cast<uint64_t>(numSamples) * numActive;
+
+		int stillActive = 0;
+		for (int a = 0; a < numActive; ++a) {
+			const int p = active[a];
+
+			glm::vec3 color = colors[a] / float(numSamples);
+			float squared = squares[a] / float(numSamples);
+
+			if (accumulatedSamples > 0) {
+				const float weight = float(numSamples) / float(accumulatedSamples + numSamples);
+				color = average[p] + (color - average[p]) * weight;
+				squared = squaredAverage[p] + (squared - squaredAverage[p]) * weight;
+			}
+
+			average[p] = color;
+			squaredAverage[p] = squared;
+			taken[p] = accumulatedSamples + numSamples;
+
+			if (!converged(objectBuffer, average[p], squaredAverage[p], accumulatedSamples + numSamples)) {
+				active[stillActive++] = p;
+			}
+		}
+
+		numActive = stillActive;
+		accumulatedSamples += numSamples;
+	}
+
+	int p = 0;
+	for (int y = startY; y < endY; ++y) {
+		for (int x = startX; x < endX; ++x, ++p) {
+			const size_t i = static_cast<size_t>(y) * width + x;
+			image[i] = average[p];
+			averageSquared[i] = squaredAverage[p];
+			pixelSamples[i] = taken[p];
+		}
+	}
+}
+
+void renderTile(const ObjectBuffer& objectBuffer, const BVH& bvh, const int samplesPerBatch, const int firstSample, const int maxSamples, const Tile& tile,
+	std::vector<glm::vec3>& image, std::vector<float>& averageSquared, std::vector<int>& pixelSamples) {
+	//Samples the pixels of the tile up to `maxSamples`, `averageSquared` and `pixelSamples` keep what adaptive sampling needs of every pixel
+	//With a `firstSample` above 0 the pixels that didn't converge within it go on from their averages, like `planRefinement` asks
+
+	const int width = static_cast<int>(objectBuffer.resolution.x);
+
+	const int tileX = tile.x;
+	const int tileY = tile.y;
+	const int endX = tile.x + tile.width;
+	const int endY = tile.y + tile.height;
+
+	if (usePrimaryRayPackets) {
+		for (int y = tileY; y < endY; y += CPU_PACKET_SIZE) {
+			for (int x = tileX; x < endX; x += CPU_PACKET_SIZE) {
+				renderPacket(objectBuffer, bvh, samplesPerBatch, firstSample, maxSamples, x, y, std::min(x + CPU_PACKET_SIZE, endX), std::min(y + CPU_PACKET_SIZE, endY), image, averageSquared, pixelSamples);
+			}
+		}
+		return;
+	}
+
+	for (int y = tileY; y < endY; ++y) {
+		for (int x = tileX; x < endX; ++x) {
+
+			//Same as gl_FragCoord, which points to the center of the pixel
+			const glm::vec2 fragCoord = glm::vec2(x + 0.5f, y + 0.5f);
+
+			glm::vec2 world = (fragCoord - objectBuffer.resolution / 2.0f) / objectBuffer.resolution.y;
+
+			uint32_t pixelIndex = static_cast<uint32_t>(fragCoord.x + fragCoord.y * objectBuffer.resolution.x);
+
+			const size_t i = static_cast<size_t>(y) * width + x;
+
+			//The samples are split into batches exactly like the tiled export on the GPU, each batch is averaged in like a frame
+			glm::vec3 average = firstSample > 0 ? image[i] : glm::vec3(0.0f);
+			float squaredAverage = firstSample > 0 ? averageSquared[i] : 0.0f;
+			int accumulatedSamples = firstSample;
+
+			if (converged(objectBuffer, average, squaredAverage, accumulatedSamples)) continue;
+
+			for (int batch = (firstSample + samplesPerBatch - 1) / samplesPerBatch; accumulatedSamples < maxSamples; ++batch) {
+
+				const int numSamples = std::min(samplesPerBatch, maxSamples - accumulatedSamples);
+
+				Sampler sampler = createSampler(objectBuffer.sampler, glm::ivec2(x, y), pixelIndex, objectBuffer.frameIndex + objectBuffer.sampleOffset + batch);
+
+				float squared;
+				glm::vec3 color = renderRaytraced(sampler, world, objectBuffer.sampleOffset + objectBuffer.accumulatedSamples + accumulatedSamples, numSamples, objectBuffer, bvh, squared);
+
+				if (accumulatedSamples > 0) {
+					const float weight = float(numSamples) / float(accumulatedSamples + numSamples);
+					color = average + (color - average) * weight;
+					squared = squaredAverage + (squared - squaredAverage) * weight;
+				}
+
+				average = color;
+				squaredAverage = squared;
+				accumulatedSamples += numSamples;
+
+				if (converged(objectBuffer, average, squaredAverage, accumulatedSamples)) break;
+			}
+
+			tracedSamples += accumulatedSamples - firstSample;
+
+			image[i] = average;
+			averageSquared[i] = squaredAverage;
+			pixelSamples[i] = accumulatedSamples;
+		}
+	}
+}
+
+bool renderCPU(const ObjectBuffer& objectBuffer, const BVH& bvh, std::vector<glm::vec3>& image, int samplesPerBatch = 0, const std::function<bool(float)>& progress = nullptr, RenderStats* stats = nullptr) {
+	//Renders the whole frame with the current settings of the object buffer, using every hardware thread
+	//`progress` is only ever called from the calling thread, with the finished fraction of the image, returning false cancels the render
+	//With adaptive sampling the noisy pixels are refined once the image is done, `progress` stays at 1 meanwhile
+	//Returns false if the render was cancelled
+
+	const auto start = std::chrono::steady_clock::now();
+
+	const int width = static_cast<int>(objectBuffer.resolution.x);
+	const int height = static_cast<int>(objectBuffer.resolution.y);
+	const int numSamples = objectBuffer.numSamples;
+
+	if (samplesPerBatch <= 0) samplesPerBatch = numSamples;
+
+	const size_t numPixels = static_cast<size_t>(width) * height;
+	image.assign(numPixels, glm::vec3(0.0f));
+
+	std::vector<float> averageSquared(numPixels, 0.0f);
+	std::vector<int> pixelSamples(numPixels, 0);
+
+	//Every thread starts with its own run of tiles and steals from the others when it runs out, see `TileScheduler.h`
+	std::atomic<uint64_t> rays(0);
+	std::atomic<uint64_t> samples(0);
+	std::atomic<int64_t> firstTileNanoseconds(-1);
+
+	auto render = [&](const Tile& tile, const int firstSample, const int maxSamples) {
+		const uint64_t firstRay = tracedRays;
+		const uint64_t firstTracedSample = tracedSamples;
+
+		ProfileScope scope("renderTile");
+		renderTile(objectBuffer, bvh, samplesPerBatch, firstSample, maxSamples, tile, image, averageSquared, pixelSamples);
+
+		rays += tracedRays - firstRay;
+		samples += tracedSamples - firstTracedSample;
+
+		int64_t noTile = -1;
+		firstTileNanoseconds.compare_exchange_strong(noTile, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	};
+
+	bool completed = scheduleTiles(width, height, CPU_TILE_SIZE, CPU_MIN_TILE_SIZE, [&](const Tile& tile) { render(tile, 0, numSamples); }, progress, stats ? &stats->threads : nullptr);
+
+	if (completed && objectBuffer.noiseThreshold > 0.0f) {
+		//The samples the converged pixels saved go to the noisiest tiles, the GPU export plans them the same way
+		const std::vector<RefinedTile> refined = planRefinement(objectBuffer, image, averageSquared, static_cast<uint64_t>(numPixels) * numSamples - samples);
+
+		//A refined tile may be split, its parts find their limit by their position
+		const int refinedTilesX = (width + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE;
+		const int refinedTilesY = (height + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE;
+		std::vector<int> maxSamples(static_cast<size_t>(refinedTilesX) * refinedTilesY, numSamples);
+		std::vector<Tile> tiles;
+
+		for (const RefinedTile& tile : refined) {
+			maxSamples[(tile.tile.y / ADAPTIVE_TILE_SIZE) * refinedTilesX + tile.tile.x / ADAPTIVE_TILE_SIZE] = tile.maxSamples;
+			tiles.push_back(tile.tile);
+		}
+
+		auto refine = [&](const Tile& tile) {
+			render(tile, numSamples, maxSamples[(tile.y / ADAPTIVE_TILE_SIZE) * refinedTilesX + tile.x / ADAPTIVE_TILE_SIZE]);
+		};
+		auto refineProgress = [&](float) { return !progress || progress(1.0f); };
+
+		std::vector<ThreadStats> refineThreads;
+		completed = scheduleTiles(tiles, CPU_MIN_TILE_SIZE, refine, refineProgress, stats ? &refineThreads : nullptr);
+
+		//The same threads did both passes
+		if (stats) {
+			for (size_t i = 0; i < refineThreads.size() && i < stats->threads.size(); ++i) {
+				ThreadStats& thread = stats->threads[i];
+				thread.busySeconds += refineThreads[i].busySeconds;
+				thread.idleSeconds += refineThreads[i].idleSeconds;
+				thread.tiles += refineThreads[i].tiles;
+				thread.stolenTiles += refineThreads[i].stolenTiles;
+				thread.splitTiles += refineThreads[i].splitTiles;
+			}
+		}
+	}
+
+	if (stats) {
+		stats->rays = rays;
+		stats->samples = samples;
+		stats->pixelSamples = std::move(pixelSamples);
+		stats->firstTileSeconds = std::max<int64_t>(firstTileNanoseconds, 0) * 1e-9;
+		stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	return completed;
+}
+
+void renderFeatures(const ObjectBuffer& objectBuffer, const BVH& bvh, Features& features) {
+	//First hit albedo, normal and distance of every pixel for the denoiser, like the feature pass of the shader
+	//Averaged over `objectBuffer.numSamples` jittered primary rays, with the lens samples the image starts with
+
+	const int width = static_cast<int>(objectBuffer.resolution.x);
+	const int height = static_cast<int>(objectBuffer.resolution.y);
+
+	features.albedo.assign(static_cast<size_t>(width) * height, glm::vec4(0.0f));
+	features.normalDepth.assign(static_cast<size_t>(width) * height, glm::vec4(0.0f));
+
+	scheduleTiles(width, height, CPU_TILE_SIZE, CPU_MIN_TILE_SIZE, [&](const Tile& tile) {
+		for (int y = tile.y; y < tile.y + tile.height; ++y) {
+			for (int x = tile.x; x < tile.x + tile.width; ++x) {
+
+				const glm::vec2 fragCoord = glm::vec2(x + 0.5f, y + 0.5f);
+				const glm::vec2 world = (fragCoord - objectBuffer.resolution / 2.0f) / objectBuffer.resolution.y;
+				const uint32_t pixelIndex = static_cast<uint32_t>(fragCoord.x + fragCoord.y * objectBuffer.resolution.x);
+
+				Sampler sampler = createSampler(objectBuffer.sampler, glm::ivec2(x, y), pixelIndex, objectBuffer.frameIndex + objectBuffer.sampleOffset);
+
+				glm::vec3 albedo = glm::vec3(0.0f);
+				glm::vec4 normalDepth = glm::vec4(0.0f);
+
+				Ray ray;
+				ray.origin = objectBuffer.camera.position;
+
+				for (int i = 0; i < objectBuffer.numSamples; ++i) {
+
+					startSample(sampler, i);
+
+					const glm::vec2 jitterWorld = world + randomInCircle(sampler) * objectBuffer.jitterStrenght;
+					ray.direction = glm::normalize(objectBuffer.camera.direction + jitterWorld.x * objectBuffer.camera.right + jitterWorld.y * objectBuffer.camera.up);
+
+					const Intersection intersection = rayScene(ray, objectBuffer, bvh);
+
+					if (intersection.dst > 0.0f) {
+						albedo += intersection.material.color;
+						normalDepth += glm::vec4(intersection.normal, intersection.dst);
+					}
+				}
+
+				features.albedo[y * width + x] = glm::vec4(albedo / float(objectBuffer.numSamples), 1.0f);
+				features.normalDepth[y * width + x] = normalDepth / float(objectBuffer.numSamples);
+			}
+		}
+	});
+}
+
+//Converts to 8 bit the same way OpenGL does when writing to a normalized frame buffer, every float becomes one byte
+
+void convertValuesScalar(const float* values, const size_t count, unsigned char* data) {
+	for (size_t i = 0; i < count; ++i) {
+		data[i] = static_cast<unsigned char>(glm::clamp(values[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+	}
+}
+
+#ifdef RENDERER_X86
+
+//Lambdas don't inherit the target of the function they are in, so the kernels use these helpers
+TARGET_SSE42 inline __m128i convertToIntSSE42(const float* values) {
+	const __m128 value = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(values), _mm_setzero_ps()), _mm_set1_ps(1.0f));
+	return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(value, _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f)));
+}
+
+TARGET_AVX2 inline __m256i convertToIntAVX2(const float* values) {
+	const __m256 value = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(values), _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+	return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(value, _mm256_set1_ps(255.0f)), _mm256_set1_ps(0.5f)));
+}
+
+TARGET_AVX512 inline __m512i convertToIntAVX512(const float* values) {
+	const __m512 value = _mm512_min_ps(_mm512_max_ps(_mm512_loadu_ps(values), _mm512_setzero_ps()), _mm512_set1_ps(1.0f));
+	return _mm512_cvttps_epi32(_mm512_add_ps(_mm512_mul_ps(value, _mm512_set1_ps(255.0f)), _mm512_set1_ps(0.5f)));
+}
+
+TARGET_SSE42 void convertValuesSSE42(const float* values, const size_t count, unsigned char* data) {
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const __m128i low = _mm_packus_epi32(convertToIntSSE42(values + i), convertToIntSSE42(values + i + 4));
+		const __m128i high = _mm_packus_epi32(convertToIntSSE42(values + i + 8), convertToIntSSE42(values + i + 12));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_packus_epi16(low, high));
+	}
+
+	convertValuesScalar(values + i, count - i, data + i);
+}
+
+TARGET_AVX2 void convertValuesAVX2(const float* values, const size_t count, unsigned char* data) {
+
+	//Packing works within 128 bit lanes, this puts the groups of 4 bytes back in order
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	size_t i = 0;
+	for (; i + 32 <= count; i += 32) {
+		const __m256i low = _mm256_packus_epi32(convertToIntAVX2(values + i), convertToIntAVX2(values + i + 8));
+		const __m256i high = _mm256_packus_epi32(convertToIntAVX2(values + i + 16), convertToIntAVX2(values + i + 24));
+		const __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(low, high), order);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i), bytes);
+	}
+
+	convertValuesScalar(values + i, count - i, data + i);
+}
+
+TARGET_AVX512 void convertValuesAVX512(const float* values, const size_t count, unsigned char* data) {
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm512_cvtusepi32_epi8(convertToIntAVX512(values + i)));
+	}
+
+	convertValuesScalar(values + i, count - i, data + i);
+}
+
+#endif
+
+void convertImage(const std::vector<glm::vec3>& image, unsigned char* data) {
+
+	const float* values = image.empty() ? nullptr : &image[0].x;
+	const size_t count = 3 * image.size();
+
+	switch (cpuISA) {
+#ifdef RENDERER_X86
+	case CpuISA::AVX512: convertValuesAVX512(values, count, data); break;
+	case CpuISA::AVX2: convertValuesAVX2(values, count, data); break;
+	case CpuISA::SSE42: convertValuesSSE42(values, count, data); break;
+#endif
+	default: convertValuesScalar(values, count, data); break;
+	}
+}
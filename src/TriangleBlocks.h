@@ -0,0 +1,313 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "CpuFeatures.h"
+
+/*
+	Ray versus triangle tests on blocks of triangles stored as a structure of arrays:
+		- Every component of the first vertex and of both edges is an array of `TRIANGLE_BLOCK_SIZE` floats, so one load fills a SIMD register
+		- The SSE4.2 kernel tests a ray against half a block (4 triangles) at once, the AVX2 kernel against one block (8 triangles),
+		  the AVX-512 kernel against two consecutive blocks (16 triangles), the scalar kernel loops over the lanes
+		- `rayTriangleBlocks` calls the kernel of the instruction set picked at startup, see CpuFeatures.h
+		- The test is the same as `rayTriangle` in `trace.frag`: single sided, hits behind the origin don't count
+		- Unused lanes hold a degenerate triangle, it never passes the determinant test
+		- Lanes are checked in order and a hit has to be strictly closer, so ties go to the first triangle, just like a scalar loop
+*/
+
+constexpr int TRIANGLE_BLOCK_SIZE = 8;
+
+struct alignas(32) TriangleBlock {
+	float v0[3][TRIANGLE_BLOCK_SIZE];
+	float edge1[3][TRIANGLE_BLOCK_SIZE];
+	float edge2[3][TRIANGLE_BLOCK_SIZE];
+	int triangle[TRIANGLE_BLOCK_SIZE]; // Index into the triangles of the object buffer, -1 for unused lanes
+};
+
+void clearTriangleBlock(TriangleBlock& block) {
+	for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; ++lane) {
+		for (int axis = 0; axis < 3; ++axis) {
+			block.v0[axis][lane] = 0.0f;
+			block.edge1[axis][lane] = 0.0f;
+			block.edge2[axis][lane] = 0.0f;
+		}
+		block.triangle[lane] = -1;
+	}
+}
+
+void setBlockTriangle(TriangleBlock& block, const int lane, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, const int triangle) {
+	const glm::vec3 edge1 = v1 - v0;
+	const glm::vec3 edge2 = v2 - v0;
+
+	for (int axis = 0; axis < 3; ++axis) {
+		block.v0[axis][lane] = v0[axis];
+		block.edge1[axis][lane] = edge1[axis];
+		block.edge2[axis][lane] = edge2[axis];
+	}
+	block.triangle[lane] = triangle;
+}
+
+bool rayTriangleBlocksScalar(const glm::vec3& origin, const glm::vec3& direction, const TriangleBlock* blocks, const int numBlocks, float& distance, int& triangle) {
+	//Returns true if a triangle closer than `distance` (negative if there is no hit yet) was found, `distance` and `triangle` are updated then
+
+	bool hit = false;
+
+	for (int i = 0; i < numBlocks; ++i) {
+		const TriangleBlock& block = blocks[i];
+
+		for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; ++lane) {
+
+			const glm::vec3 edge1(block.edge1[0][lane], block.edge1[1][lane], block.edge1[2][lane]);
+			const glm::vec3 edge2(block.edge2[0][lane], block.edge2[1][lane], block.edge2[2][lane]);
+
+			glm::vec3 p = glm::cross(direction, edge2);
+			float det = glm::dot(edge1, p);
+
+			if (det < 10e-6f) continue;
+
+			glm::vec3 t = origin - glm::vec3(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+
+			float u = glm::dot(t, p);
+
+			if (det < u || u < 0.0f) continue;
+
+			float invDet = 1.0f / det;
+			u *= invDet;
+
+			glm::vec3 q = glm::cross(t, edge1);
+
+			float v = glm::dot(direction, q) * invDet;
+
+			if (v < 0.0f || u + v > 1.0f) continue;
+
+			float dst = glm::dot(edge2, q) * invDet;
+
+			if (dst > 0 && (distance < 0 || dst < distance)) {
+				distance = dst;
+				triangle = block.triangle[lane];
+				hit = true;
+			}
+		}
+	}
+
+	return hit;
+}
+
+#ifdef RENDERER_X86
+
+//Returns true if any lane of `hits` is closer than `distance`, the lanes are visited in order
+inline bool closestLane(unsigned int hits, const float* distances, const int* triangles, float& distance, int& triangle) {
+	bool hit = false;
+	for (int lane = 0; hits; ++lane, hits >>= 1) {
+		if ((hits & 1) && (distance < 0 || distances[lane] < distance)) {
+			distance = distances[lane];
+			triangle = triangles[lane];
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+TARGET_SSE42 bool rayTriangleBlocksSSE42(const glm::vec3& origin, const glm::vec3& direction, const TriangleBlock* blocks, const int numBlocks, float& distance, int& triangle) {
+
+	const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	const __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 epsilon = _mm_set1_ps(10e-6f);
+
+	bool hit = false;
+
+	for (int i = 0; i < numBlocks; ++i) {
+		const TriangleBlock& block = blocks[i];
+
+		for (int half = 0; half < TRIANGLE_BLOCK_SIZE; half += 4) {
+
+			const __m128 e1x = _mm_load_ps(block.edge1[0] + half), e1y = _mm_load_ps(block.edge1[1] + half), e1z = _mm_load_ps(block.edge1[2] + half);
+			const __m128 e2x = _mm_load_ps(block.edge2[0] + half), e2y = _mm_load_ps(block.edge2[1] + half), e2z = _mm_load_ps(block.edge2[2] + half);
+
+			//p = cross(direction, edge2), det = dot(edge1, p)
+			const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+			const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+			const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+			const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+
+			__m128 mask = _mm_cmpge_ps(det, epsilon);
+			if (!_mm_movemask_ps(mask)) continue;
+
+			const __m128 tx = _mm_sub_ps(ox, _mm_load_ps(block.v0[0] + half));
+			const __m128 ty = _mm_sub_ps(oy, _mm_load_ps(block.v0[1] + half));
+			const __m128 tz = _mm_sub_ps(oz, _mm_load_ps(block.v0[2] + half));
+
+			__m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz));
+			mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmple_ps(u, det), _mm_cmpge_ps(u, zero)));
+			if (!_mm_movemask_ps(mask)) continue;
+
+			const __m128 invDet = _mm_div_ps(one, det);
+			u = _mm_mul_ps(u, invDet);
+
+			//q = cross(t, edge1)
+			const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+			const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+			const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+			const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+			const __m128 dst = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+			mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+			mask = _mm_and_ps(mask, _mm_cmpgt_ps(dst, zero));
+
+			const unsigned int hits = _mm_movemask_ps(mask);
+			if (!hits) continue;
+
+			alignas(16) float distances[4];
+			_mm_store_ps(distances, dst);
+
+			if (closestLane(hits, distances, block.triangle + half, distance, triangle)) hit = true;
+		}
+	}
+
+	return hit;
+}
+
+TARGET_AVX2 bool rayTriangleBlocksAVX2(const glm::vec3& origin, const glm::vec3& direction, const TriangleBlock* blocks, const int numBlocks, float& distance, int& triangle) {
+
+	const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+	const __m256 dx = _mm256_set1_ps(direction.x), dy = _mm256_set1_ps(direction.y), dz = _mm256_set1_ps(direction.z);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 epsilon = _mm256_set1_ps(10e-6f);
+
+	bool hit = false;
+
+	for (int i = 0; i < numBlocks; ++i) {
+		const TriangleBlock& block = blocks[i];
+
+		const __m256 e1x = _mm256_load_ps(block.edge1[0]), e1y = _mm256_load_ps(block.edge1[1]), e1z = _mm256_load_ps(block.edge1[2]);
+		const __m256 e2x = _mm256_load_ps(block.edge2[0]), e2y = _mm256_load_ps(block.edge2[1]), e2z = _mm256_load_ps(block.edge2[2]);
+
+		//p = cross(direction, edge2), det = dot(edge1, p)
+		const __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+		const __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+		const __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+		const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+
+		__m256 mask = _mm256_cmp_ps(det, epsilon, _CMP_GE_OQ);
+		if (!_mm256_movemask_ps(mask)) continue;
+
+		const __m256 tx = _mm256_sub_ps(ox, _mm256_load_ps(block.v0[0]));
+		const __m256 ty = _mm256_sub_ps(oy, _mm256_load_ps(block.v0[1]));
+		const __m256 tz = _mm256_sub_ps(oz, _mm256_load_ps(block.v0[2]));
+
+		__m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz));
+		mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(u, det, _CMP_LE_OQ), _mm256_cmp_ps(u, zero, _CMP_GE_OQ)));
+		if (!_mm256_movemask_ps(mask)) continue;
+
+		const __m256 invDet = _mm256_div_ps(one, det);
+		u = _mm256_mul_ps(u, invDet);
+
+		//q = cross(t, edge1)
+		const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+		const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+		const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+
+		const __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+		const __m256 dst = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+
+		mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(dst, zero, _CMP_GT_OQ));
+
+		const unsigned int hits = _mm256_movemask_ps(mask);
+		if (!hits) continue;
+
+		alignas(32) float distances[8];
+		_mm256_store_ps(distances, dst);
+
+		if (closestLane(hits, distances, block.triangle, distance, triangle)) hit = true;
+	}
+
+	return hit;
+}
+
+TARGET_AVX512 inline __m512 loadBlockPair(const float* first, const float* second) {
+	//The lanes of two blocks in one register
+	return _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castpd256_pd512(_mm256_castps_pd(_mm256_load_ps(first))), _mm256_castps_pd(_mm256_load_ps(second)), 1));
+}
+
+TARGET_AVX512 bool rayTriangleBlocksAVX512(const glm::vec3& origin, const glm::vec3& direction, const TriangleBlock* blocks, const int numBlocks, float& distance, int& triangle) {
+
+	const __m512 ox = _mm512_set1_ps(origin.x), oy = _mm512_set1_ps(origin.y), oz = _mm512_set1_ps(origin.z);
+	const __m512 dx = _mm512_set1_ps(direction.x), dy = _mm512_set1_ps(direction.y), dz = _mm512_set1_ps(direction.z);
+	const __m512 zero = _mm512_setzero_ps();
+	const __m512 one = _mm512_set1_ps(1.0f);
+	const __m512 epsilon = _mm512_set1_ps(10e-6f);
+
+	bool hit = false;
+
+	int i = 0;
+	for (; i + 1 < numBlocks; i += 2) {
+		const TriangleBlock& a = blocks[i];
+		const TriangleBlock& b = blocks[i + 1];
+
+		const __m512 e1x = loadBlockPair(a.edge1[0], b.edge1[0]), e1y = loadBlockPair(a.edge1[1], b.edge1[1]), e1z = loadBlockPair(a.edge1[2], b.edge1[2]);
+		const __m512 e2x = loadBlockPair(a.edge2[0], b.edge2[0]), e2y = loadBlockPair(a.edge2[1], b.edge2[1]), e2z = loadBlockPair(a.edge2[2], b.edge2[2]);
+
+		const __m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+		const __m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+		const __m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+		const __m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)), _mm512_mul_ps(e1z, pz));
+
+		__mmask16 mask = _mm512_cmp_ps_mask(det, epsilon, _CMP_GE_OQ);
+		if (!mask) continue;
+
+		const __m512 tx = _mm512_sub_ps(ox, loadBlockPair(a.v0[0], b.v0[0]));
+		const __m512 ty = _mm512_sub_ps(oy, loadBlockPair(a.v0[1], b.v0[1]));
+		const __m512 tz = _mm512_sub_ps(oz, loadBlockPair(a.v0[2], b.v0[2]));
+
+		__m512 u = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(tx, px), _mm512_mul_ps(ty, py)), _mm512_mul_ps(tz, pz));
+		mask = _mm512_mask_cmp_ps_mask(mask, u, det, _CMP_LE_OQ);
+		mask = _mm512_mask_cmp_ps_mask(mask, u, zero, _CMP_GE_OQ);
+		if (!mask) continue;
+
+		const __m512 invDet = _mm512_div_ps(one, det);
+		u = _mm512_mul_ps(u, invDet);
+
+		const __m512 qx = _mm512_sub_ps(_mm512_mul_ps(ty, e1z), _mm512_mul_ps(tz, e1y));
+		const __m512 qy = _mm512_sub_ps(_mm512_mul_ps(tz, e1x), _mm512_mul_ps(tx, e1z));
+		const __m512 qz = _mm512_sub_ps(_mm512_mul_ps(tx, e1y), _mm512_mul_ps(ty, e1x));
+
+		const __m512 v = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz)), invDet);
+		const __m512 dst = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz)), invDet);
+
+		mask = _mm512_mask_cmp_ps_mask(mask, v, zero, _CMP_GE_OQ);
+		mask = _mm512_mask_cmp_ps_mask(mask, _mm512_add_ps(u, v), one, _CMP_LE_OQ);
+		mask = _mm512_mask_cmp_ps_mask(mask, dst, zero, _CMP_GT_OQ);
+		if (!mask) continue;
+
+		alignas(64) float distances[16];
+		_mm512_store_ps(distances, dst);
+
+		if (closestLane(mask & 0xFF, distances, a.triangle, distance, triangle)) hit = true;
+		if (closestLane(mask >> 8, distances + 8, b.triangle, distance, triangle)) hit = true;
+	}
+
+	//An odd block is left over
+	if (i < numBlocks && rayTriangleBlocksAVX2(origin, direction, blocks + i, 1, distance, triangle)) hit = true;
+
+	return hit;
+}
+
+#endif
+
+bool rayTriangleBlocks(const glm::vec3& origin, const glm::vec3& direction, const TriangleBlock* blocks, const int numBlocks, float& distance, int& triangle) {
+	//The kernel of the instruction set picked at startup
+
+	switch (cpuISA) {
+#ifdef RENDERER_X86
+	case CpuISA::AVX512: return rayTriangleBlocksAVX512(origin, direction, blocks, numBlocks, distance, triangle);
+	case CpuISA::AVX2: return rayTriangleBlocksAVX2(origin, direction, blocks, numBlocks, distance, triangle);
+	case CpuISA::SSE42: return rayTriangleBlocksSSE42(origin, direction, blocks, numBlocks, distance, triangle);
+#endif
+	default: return rayTriangleBlocksScalar(origin, direction, blocks, numBlocks, distance, triangle);
+	}
+}
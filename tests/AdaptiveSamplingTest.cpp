@@ -0,0 +1,134 @@
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include <glm/gtx/rotate_vector.hpp>
+#include <glm/gtx/scalar_multiplication.hpp>
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+#ifdef _WIN32
+#include "../src/MappedFile.h" // Pulls in windows.h with the right defines
+#endif
+
+#include "../src/Structures.h"
+#include "../src/BVH.h"
+#include "../src/Selection.h"
+#include "../src/Tracer.h"
+#include "../src/ObjLoader.h"
+#include "../src/Bodies.h"
+#include "TestScenes.h"
+
+/*
+	Adaptive sampling must not change the brightness of the image, and must give what converged pixels save to the noisy ones:
+		- A closed room with deep paths, so Russian roulette ends most of them, is rendered on the CPU with all samples and adaptively
+		- Pixels that stopped before they found their rare bright paths (light found by a bounce, roulette survivors) make the adaptive
+		  image darker, its mean may differ from the reference by at most MAX_RELATIVE_DIFFERENCE
+		- Lit by a small light the room stays noisy in places, there some pixels must take more than SAMPLES samples,
+		  while all of them together take no more than SAMPLES per pixel
+		- The seeds are fixed, so the result is the same on every run
+		- Run it from the repository root, the room loads its walls from `meshes/`
+*/
+
+constexpr int WIDTH = 80;
+constexpr int HEIGHT = 60;
+constexpr int SAMPLES = 256;
+constexpr int SAMPLES_PER_BATCH = 16;
+constexpr int BOUNCES = 16;
+constexpr float NOISE_THRESHOLD = 0.1f;
+constexpr float SMALL_LIGHT_RADIUS = 0.5f; // Leaves about 800 pixels noisy after SAMPLES samples
+constexpr double MAX_RELATIVE_DIFFERENCE = 0.005; // Stopping too early darkened this room by 7% once
+
+bool renderRoom(const float noiseThreshold, const float lightRadius, double& mean, RenderStats& stats) {
+	//Returns the mean of all channels of the image
+
+	ObjectBuffer objectBuffer;
+	BVH bvh;
+
+	RoomOptions options;
+	options.lightRadius = lightRadius;
+
+	initTestScene(objectBuffer, WIDTH, HEIGHT, SAMPLES, BOUNCES);
+	if (!buildRoom(objectBuffer, options)) {
+		std::cerr << "Error: Could not build the room, run the test from the repository root\n";
+		return false;
+	}
+	objectBuffer.noiseThreshold = noiseThreshold;
+	buildBVH(bvh, objectBuffer);
+
+	std::vector<glm::vec3> image;
+	renderCPU(objectBuffer, bvh, image, SAMPLES_PER_BATCH, nullptr, &stats);
+
+	mean = 0.0;
+	for (const glm::vec3& pixel : image) {
+		mean += pixel.r + pixel.g + pixel.b;
+	}
+	mean /= 3.0 * image.size();
+
+	return true;
+}
+
+int main() {
+
+	useRussianRoulette = true;
+
+	const float lightRadius = RoomOptions().lightRadius;
+
+	double reference, adaptive;
+	RenderStats referenceStats, adaptiveStats;
+	if (!renderRoom(0.0f, lightRadius, reference, referenceStats) || !renderRoom(NOISE_THRESHOLD, lightRadius, adaptive, adaptiveStats)) return 1;
+
+	const double referenceSamples = double(referenceStats.samples) / (WIDTH * HEIGHT);
+	const double adaptiveSamples = double(adaptiveStats.samples) / (WIDTH * HEIGHT);
+
+	const double difference = (adaptive - reference) / reference;
+	printf("Reference mean %.6f with %.1f samples per pixel, adaptive mean %.6f with %.1f, %+.3f%%\n",
+		reference, referenceSamples, adaptive, adaptiveSamples, 100.0 * difference);
+
+	//Otherwise there is nothing to compare
+	if (adaptiveSamples >= SAMPLES) {
+		std::cerr << "Error: Adaptive sampling took all samples\n";
+		return 1;
+	}
+
+	if (std::abs(difference) > MAX_RELATIVE_DIFFERENCE) {
+		std::cerr << "Error: The adaptive image is " << 100.0 * std::abs(difference) << "% " << (difference < 0.0 ? "darker" : "brighter") << " than the reference\n";
+		return 1;
+	}
+
+	double smallLight;
+	RenderStats smallLightStats;
+	if (!renderRoom(NOISE_THRESHOLD, SMALL_LIGHT_RADIUS, smallLight, smallLightStats)) return 1;
+
+	uint64_t pixelSamples = 0;
+	int refinedPixels = 0;
+	for (const int samples : smallLightStats.pixelSamples) {
+		pixelSamples += samples;
+		if (samples > SAMPLES) refinedPixels++;
+	}
+
+	const uint64_t budget = uint64_t(WIDTH) * HEIGHT * SAMPLES;
+	printf("Small light took %.1f samples per pixel, %d pixels took more than %d\n", double(smallLightStats.samples) / (WIDTH * HEIGHT), refinedPixels, SAMPLES);
+
+	if (pixelSamples != smallLightStats.samples) {
+		std::cerr << "Error: The pixels took " << pixelSamples << " samples, but " << smallLightStats.samples << " were counted\n";
+		return 1;
+	}
+
+	if (refinedPixels == 0) {
+		std::cerr << "Error: No noisy pixel got the samples the converged pixels saved\n";
+		return 1;
+	}
+
+	if (smallLightStats.samples > budget) {
+		std::cerr << "Error: Adaptive sampling took " << smallLightStats.samples << " samples, more than the budget of " << budget << "\n";
+		return 1;
+	}
+
+	return 0;
+}
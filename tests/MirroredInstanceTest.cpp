@@ -0,0 +1,96 @@
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include <glm/gtx/rotate_vector.hpp>
+#include <glm/gtx/scalar_multiplication.hpp>
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+#ifdef _WIN32
+#include "../src/MappedFile.h" // Pulls in windows.h with the right defines
+#endif
+
+#include "../src/Structures.h"
+#include "../src/BVH.h"
+#include "../src/Selection.h"
+#include "../src/Tracer.h"
+#include "../src/ObjLoader.h"
+#include "../src/Bodies.h"
+#include "TestScenes.h"
+
+/*
+	Mirrored instances must look like the mirror image of the instance:
+		- A room with a box and an emissive ball in it is rendered on the CPU, then again with every mesh scaled by -1 along x
+		- The camera sits on the mirror plane, so the second image is the first one flipped left to right, up to noise
+		- A mirrored mesh whose triangles were culled, or a mirrored lamp that next event estimation can't see, makes the
+		  second image darker, the halves of both images may differ by at most MAX_RELATIVE_DIFFERENCE
+		- Run it from the repository root, the room loads its meshes from `meshes/`
+*/
+
+constexpr int WIDTH = 64;
+constexpr int HEIGHT = 48;
+constexpr int SAMPLES = 64;
+constexpr int BOUNCES = 4;
+constexpr double MAX_RELATIVE_DIFFERENCE = 0.01; // Next event estimation missing the mirrored lamp once made the room 99% darker
+
+bool renderRoom(const bool mirrored, double& left, double& right) {
+	//Returns the mean of all channels of the left and the right half of the image
+
+	ObjectBuffer objectBuffer;
+	BVH bvh;
+
+	//Only the lamp lights the room, so nothing hides a lamp that next event estimation misses
+	RoomOptions options;
+	options.lightRadius = 0.0f;
+	options.boxAndLamp = true;
+	if (mirrored) options.scale = glm::vec3(-1.0f, 1.0f, 1.0f);
+
+	initTestScene(objectBuffer, WIDTH, HEIGHT, SAMPLES, BOUNCES);
+	if (!buildRoom(objectBuffer, options)) {
+		std::cerr << "Error: Could not build the room, run the test from the repository root\n";
+		return false;
+	}
+	buildBVH(bvh, objectBuffer);
+
+	std::vector<glm::vec3> image;
+	renderCPU(objectBuffer, bvh, image, SAMPLES);
+
+	left = right = 0.0;
+	for (int y = 0; y < HEIGHT; ++y) {
+		for (int x = 0; x < WIDTH; ++x) {
+			const glm::vec3& pixel = image[y * WIDTH + x];
+			(x < WIDTH / 2 ? left : right) += pixel.r + pixel.g + pixel.b;
+		}
+	}
+	left /= 3.0 * WIDTH / 2 * HEIGHT;
+	right /= 3.0 * WIDTH / 2 * HEIGHT;
+
+	return true;
+}
+
+int main() {
+
+	double left, right;
+	double mirroredLeft, mirroredRight;
+	if (!renderRoom(false, left, right) || !renderRoom(true, mirroredLeft, mirroredRight)) return 1;
+
+	//The left half of the mirrored room is the right half of the room
+	const double differences[2] = { (mirroredLeft - right) / right, (mirroredRight - left) / left };
+	printf("Left %.6f, right %.6f, mirrored left %.6f (%+.3f%%), mirrored right %.6f (%+.3f%%)\n",
+		left, right, mirroredLeft, 100.0 * differences[0], mirroredRight, 100.0 * differences[1]);
+
+	for (const double difference : differences) {
+		if (std::abs(difference) > MAX_RELATIVE_DIFFERENCE) {
+			std::cerr << "Error: A half of the mirrored room is " << 100.0 * std::abs(difference) << "% " << (difference < 0.0 ? "darker" : "brighter") << " than its mirror image\n";
+			return 1;
+		}
+	}
+
+	return 0;
+}
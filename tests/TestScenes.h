@@ -0,0 +1,121 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+/*
+	Scenes shared by the benchmarks and the tests, they are built on the CPU without a window:
+		- `initTestScene` sets the defaults `initBufferData` would, the camera sits at the origin and looks down -z
+		- `buildRoom` builds a closed room around the camera, `RoomOptions` holds what its users vary
+		- Run them from the repository root, the meshes are loaded from `meshes/`
+*/
+
+struct RoomOptions {
+	float lightRadius = 2.0f; // Of the sphere under the ceiling, 0 leaves it out, its emission is scaled so the room is equally bright with every radius
+	bool furniture = false; // An ico sphere and a pillar on the floor
+	bool boxAndLamp = false; // A box on the left and an emissive ico sphere on the right, so the room is no mirror image of itself
+	glm::vec3 scale = glm::vec3(1.0f); // Of every mesh around the camera after it was placed, a negative factor mirrors the room
+};
+
+void initTestScene(ObjectBuffer& objectBuffer, const int width, const int height, const int numSamples, const int maxBounces) {
+	//Same defaults as `initBufferData`, which can't be used without a window
+
+	objectBuffer = ObjectBuffer();
+
+	objectBuffer.resolution = glm::vec2(width, height);
+	objectBuffer.numSpheres = 0;
+	objectBuffer.numTriangles = 0;
+	objectBuffer.numInstances = 0;
+	objectBuffer.numLights = 0;
+
+	objectBuffer.maxBounces = maxBounces;
+	objectBuffer.numSamples = numSamples;
+	objectBuffer.noiseThreshold = 0.0f;
+	objectBuffer.sampler = SAMPLER_SOBOL;
+	objectBuffer.jitterStrenght = .9f / width;
+
+	objectBuffer.noGUI = 1;
+	objectBuffer.frameIndex = 0;
+	objectBuffer.accumulatedSamples = 0;
+	objectBuffer.sampleOffset = 0;
+	objectBuffer.tileOffset = glm::ivec2(0);
+
+	objectBuffer.camera.position = glm::vec3(0.0f, 0.0f, 0.0f);
+	objectBuffer.camera.direction = glm::vec3(0.0f, 0.0f, -1.0f);
+	objectBuffer.camera.up = glm::vec3(0.0f, 1.0f, 0.0f);
+	objectBuffer.camera.right = glm::vec3(1.0f, 0.0f, 0.0f);
+}
+
+bool buildRoom(ObjectBuffer& objectBuffer, const RoomOptions& options = RoomOptions()) {
+	//No path leaves the room, so only the bounce limit or Russian roulette ends them
+	//The side walls differ in color, so a mirrored room looks different from the room
+
+	std::vector<Mesh> meshes(6);
+
+	if (options.lightRadius > 0.0f) {
+		createSphere(objectBuffer, glm::vec3(0.0f, 5.0f, -4.0f), options.lightRadius,
+			Material{ glm::vec3(1.0f), 0.0f, glm::vec3(16.0f / (options.lightRadius * options.lightRadius)) });
+	}
+
+	if (!loadMesh(objectBuffer, "meshes/plane.obj", meshes[0])) return false;
+	for (int i = 1; i < 6; ++i) {
+		if (!instanceMesh(objectBuffer, meshes[0], meshes[i])) return false;
+	}
+
+	//The plane faces up and triangles are only hit from the front, so every wall is turned to face into the room
+	const float quarter = 1.57079632679f;
+	rotateMesh(objectBuffer, meshes[1], 2.0f * quarter, glm::vec3(1.0f, 0.0f, 0.0f));
+	rotateMesh(objectBuffer, meshes[2], quarter, glm::vec3(1.0f, 0.0f, 0.0f));
+	rotateMesh(objectBuffer, meshes[3], -quarter, glm::vec3(1.0f, 0.0f, 0.0f));
+	rotateMesh(objectBuffer, meshes[4], -quarter, glm::vec3(0.0f, 0.0f, 1.0f));
+	rotateMesh(objectBuffer, meshes[5], quarter, glm::vec3(0.0f, 0.0f, 1.0f));
+
+	const glm::vec3 offsets[6] = { glm::vec3(0.0f, -5.0f, -4.0f), glm::vec3(0.0f, 5.0f, -4.0f), glm::vec3(0.0f, 0.0f, -9.0f),
+		glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(-5.0f, 0.0f, -4.0f), glm::vec3(5.0f, 0.0f, -4.0f) };
+	const glm::vec3 colors[6] = { glm::vec3(0.8f), glm::vec3(0.8f), glm::vec3(0.8f), glm::vec3(0.8f), glm::vec3(0.8f, 0.2f, 0.2f), glm::vec3(0.2f, 0.8f, 0.2f) };
+
+	for (int i = 0; i < 6; ++i) {
+		setMeshMaterial(objectBuffer, meshes[i], Material{ colors[i], 0.0f, glm::vec3(0.0f) });
+		translateMesh(objectBuffer, meshes[i], offsets[i]);
+	}
+
+	if (options.furniture) {
+		Mesh icoSphere, pillar;
+
+		if (!loadMesh(objectBuffer, "meshes/ico_sphere.obj", icoSphere)) return false;
+		setMeshMaterial(objectBuffer, icoSphere, Material{ glm::vec3(0.9f, 0.9f, 0.3f), 0.5f, glm::vec3(0.0f) });
+		translateMesh(objectBuffer, icoSphere, glm::vec3(-1.5f, -4.0f, -5.0f));
+
+		if (!loadMesh(objectBuffer, "meshes/whatever.obj", pillar)) return false;
+		setMeshMaterial(objectBuffer, pillar, Material{ glm::vec3(0.3f, 0.5f, 0.9f), 0.0f, glm::vec3(0.0f) });
+		translateMesh(objectBuffer, pillar, glm::vec3(2.0f, -4.5f, -6.0f));
+
+		meshes.push_back(icoSphere);
+		meshes.push_back(pillar);
+	}
+
+	if (options.boxAndLamp) {
+		Mesh box, lamp;
+
+		if (!loadMesh(objectBuffer, "meshes/cube.obj", box) || !loadMesh(objectBuffer, "meshes/ico_sphere.obj", lamp)) return false;
+
+		setMeshMaterial(objectBuffer, box, Material{ glm::vec3(0.8f, 0.8f, 0.2f), 0.0f, glm::vec3(0.0f) });
+		scaleMesh(objectBuffer, box, glm::vec3(3.0f, 2.0f, 2.0f));
+		rotateMesh(objectBuffer, box, 0.6f, glm::vec3(0.3f, 1.0f, 0.2f));
+		translateMesh(objectBuffer, box, glm::vec3(-2.0f, -3.0f, -6.0f));
+
+		setMeshMaterial(objectBuffer, lamp, Material{ glm::vec3(1.0f), 0.0f, glm::vec3(20.0f) });
+		translateMesh(objectBuffer, lamp, glm::vec3(2.5f, 3.0f, -5.0f));
+
+		meshes.push_back(box);
+		meshes.push_back(lamp);
+	}
+
+	if (options.scale != glm::vec3(1.0f)) {
+		for (Mesh& mesh : meshes) {
+			scaleMesh(objectBuffer, mesh, options.scale);
+		}
+	}
+
+	return true;
+}